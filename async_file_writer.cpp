@@ -0,0 +1,379 @@
+#include "async_file_writer.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(HAVE_LIBURING)
+#include <liburing.h>
+#endif
+
+#include "wrapper/host_api.h"
+
+static constexpr size_t BlockAlignment = 2 << 20;
+static constexpr size_t DirectAlignment = 4096;
+// fallocate() this far past the block being written.
+static constexpr uint64_t PreallocateSize = 64 << 20;
+
+#if defined(HAVE_LIBURING)
+struct AsyncFileWriter::Ring
+{
+    struct io_uring ring;
+    std::vector<Block> blocks; // in flight, by buffer index
+};
+#else
+struct AsyncFileWriter::Ring
+{
+};
+#endif
+
+static size_t AlignUp(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+static uint64_t SteadyNs()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+AsyncFileWriter::AsyncFileWriter() = default;
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+    Close();
+}
+
+bool AsyncFileWriter::Open(const std::string &path, size_t blockSize, uint32_t blockCount, bool direct,
+                           uint64_t resumeOffset)
+{
+    Close();
+
+    int flags = O_RDWR | O_CREAT | O_CLOEXEC | (resumeOffset ? 0 : O_TRUNC);
+    m_direct = direct && blockSize % DirectAlignment == 0;
+    m_fd = open(path.c_str(), flags | (m_direct ? O_DIRECT : 0), 0644);
+    if (m_fd < 0 && m_direct && errno == EINVAL) {
+        // tmpfs and some network filesystems refuse O_DIRECT.
+        m_direct = false;
+        m_fd = open(path.c_str(), flags, 0644);
+    }
+    if (m_fd < 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to create %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+
+    m_blockSize = blockSize;
+    for (uint32_t i = 0; i < blockCount; i++) {
+        void *buffer = nullptr;
+        if (posix_memalign(&buffer, BlockAlignment, blockSize) != 0) {
+            Close();
+            return false;
+        }
+        m_buffers.push_back(static_cast<uint8_t *>(buffer));
+    }
+
+    m_path = path;
+    m_free.assign(m_buffers.begin() + 1, m_buffers.end());
+    m_pending.clear();
+    m_current = m_buffers[0];
+    m_used = 0;
+    m_size = 0;
+    m_allocated = 0;
+    m_stop = false;
+    m_failed = false;
+    m_openTime = SteadyNs();
+    m_rewrite.clear();
+
+    // Blocks stay aligned to the start of the file, so the part of the
+    // last block that is kept is read back into the first buffer.
+    if (resumeOffset) {
+        uint64_t blockStart = resumeOffset / blockSize * blockSize;
+        size_t tail = resumeOffset - blockStart;
+        size_t readSize = m_direct ? AlignUp(tail, DirectAlignment) : tail;
+        if (ftruncate(m_fd, resumeOffset) != 0 || pread(m_fd, m_current, readSize, blockStart) < static_cast<ssize_t>(tail)) {
+            g_Log(logLevelError, "VAAPI :: Failed to resume %s at %llu", path.c_str(),
+                  static_cast<unsigned long long>(resumeOffset));
+            Close();
+            return false;
+        }
+        m_used = tail;
+        m_size = resumeOffset;
+    }
+
+#if defined(HAVE_LIBURING)
+    m_ring = std::make_unique<Ring>();
+    if (io_uring_queue_init(blockCount, &m_ring->ring, 0) == 0) {
+        m_ring->blocks.resize(blockCount);
+        m_inFlight = 0;
+    } else {
+        m_ring.reset();
+    }
+#endif
+    if (!m_ring)
+        m_thread = std::thread(&AsyncFileWriter::WriterThread, this);
+    return true;
+}
+
+bool AsyncFileWriter::Write(const void *data, size_t size)
+{
+    if (m_fd < 0)
+        return false;
+
+    const uint8_t *src = static_cast<const uint8_t *>(data);
+    while (size) {
+        size_t chunk = std::min(size, m_blockSize - m_used);
+        memcpy(m_current + m_used, src, chunk);
+        m_used += chunk;
+        m_size += chunk;
+        src += chunk;
+        size -= chunk;
+
+        if (m_used == m_blockSize && !Submit(m_blockSize))
+            return false;
+    }
+    return true;
+}
+
+void AsyncFileWriter::Preallocate(uint64_t end)
+{
+    if (end <= m_allocated)
+        return;
+
+    // Keeps the file size, so a crash leaves no zeroed tail behind. Close()
+    // truncates what wasn't used.
+    uint64_t target = end + PreallocateSize;
+    if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, m_allocated, target - m_allocated) != 0)
+        target = UINT64_MAX; // not supported here, don't ask again
+    m_allocated = target;
+}
+
+// Queues the current block with size bytes, which may include padding past
+// m_size, and picks the next free one unless this was the last.
+bool AsyncFileWriter::Submit(size_t size)
+{
+    Block block = { m_current, size, m_size - m_used };
+    Preallocate(block.offset + size);
+    bool last = m_used < m_blockSize;
+
+#if defined(HAVE_LIBURING)
+    if (m_ring) {
+        uint32_t index = std::find(m_buffers.begin(), m_buffers.end(), block.data) - m_buffers.begin();
+        m_ring->blocks[index] = block;
+
+        // The ring has an entry for every block, so one is always free.
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&m_ring->ring);
+        io_uring_prep_write(sqe, m_fd, block.data, block.size, block.offset);
+        io_uring_sqe_set_data(sqe, &m_ring->blocks[index]);
+        if (io_uring_submit(&m_ring->ring) != 1) {
+            m_failed = true;
+            return false;
+        }
+        m_inFlight++;
+
+        if (last)
+            return true;
+        while (ReapCompletion(false))
+            ;
+        while (m_free.empty() && !m_failed)
+            ReapCompletion(true);
+        if (m_failed)
+            return false;
+
+        m_current = m_free.back();
+        m_free.pop_back();
+        m_used = 0;
+        return true;
+    }
+#endif
+
+    std::unique_lock<std::mutex> guard(m_lock);
+    m_pending.push_back(block);
+    m_cond.notify_all();
+    if (last)
+        return true;
+
+    m_cond.wait(guard, [this] { return !m_free.empty() || m_failed; });
+    if (m_failed)
+        return false;
+
+    m_current = m_free.back();
+    m_free.pop_back();
+    m_used = 0;
+    return true;
+}
+
+bool AsyncFileWriter::ReapCompletion(bool wait)
+{
+#if defined(HAVE_LIBURING)
+    if (!m_inFlight)
+        return false;
+
+    struct io_uring_cqe *cqe = nullptr;
+    int ret = wait ? io_uring_wait_cqe(&m_ring->ring, &cqe) : io_uring_peek_cqe(&m_ring->ring, &cqe);
+    if (ret < 0) {
+        if (wait && ret != -EINTR)
+            m_failed = true;
+        return false;
+    }
+
+    Block block = *static_cast<Block *>(io_uring_cqe_get_data(cqe));
+    int res = cqe->res;
+    io_uring_cqe_seen(&m_ring->ring, cqe);
+    m_inFlight--;
+
+    // Finish short writes synchronously, they're rare for regular files.
+    if (res < 0)
+        m_failed = true;
+    else if (static_cast<size_t>(res) < block.size)
+        m_failed = !WriteBlock({ block.data + res, block.size - res, block.offset + res }) || m_failed;
+
+    m_free.push_back(block.data);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool AsyncFileWriter::WriteBlock(const Block &block)
+{
+    size_t written = 0;
+    while (written < block.size) {
+        ssize_t ret = pwrite(m_fd, block.data + written, block.size - written, block.offset + written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return false;
+        written += ret;
+    }
+    return true;
+}
+
+bool AsyncFileWriter::Sync()
+{
+    if (m_fd < 0)
+        return false;
+
+    // Every block but the current one back means nothing is in flight.
+    bool failed;
+    if (m_ring) {
+        while (m_inFlight && ReapCompletion(true))
+            ;
+        failed = m_failed;
+    } else {
+        std::unique_lock<std::mutex> guard(m_lock);
+        m_cond.wait(guard, [this] { return m_free.size() + 1 == m_buffers.size() || m_failed; });
+        failed = m_failed;
+    }
+    if (failed)
+        return false;
+
+    // The partial block is written in place now and again once it's full.
+    if (m_used) {
+        size_t size = m_used;
+        if (m_direct) {
+            size = AlignUp(m_used, DirectAlignment);
+            memset(m_current + m_used, 0, size - m_used);
+        }
+        if (!WriteBlock({ m_current, size, m_size - m_used }))
+            return false;
+    }
+    return fdatasync(m_fd) == 0;
+}
+
+void AsyncFileWriter::RewriteOnClose(uint64_t offset, const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    m_rewriteOffset = offset;
+    m_rewrite.assign(bytes, bytes + size);
+}
+
+bool AsyncFileWriter::Close()
+{
+    if (m_fd < 0)
+        return true;
+
+    const char *backend = m_ring ? "io_uring" : "a writer thread";
+    if (m_used) {
+        // O_DIRECT writes whole sectors, the padding is truncated below.
+        size_t size = m_used;
+        if (m_direct) {
+            size = AlignUp(m_used, DirectAlignment);
+            memset(m_current + m_used, 0, size - m_used);
+        }
+        Submit(size);
+    }
+
+    if (m_ring) {
+        while (m_inFlight && ReapCompletion(true))
+            ;
+#if defined(HAVE_LIBURING)
+        io_uring_queue_exit(&m_ring->ring);
+#endif
+        m_ring.reset();
+    } else if (m_thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_stop = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+    }
+
+    bool ok = !m_failed;
+    if (ftruncate(m_fd, m_size) != 0)
+        ok = false;
+    if (ok && !m_rewrite.empty()) {
+        // A few bytes anywhere in the file don't fit O_DIRECT's alignment.
+        if (m_direct)
+            fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+        ok = WriteBlock({ m_rewrite.data(), m_rewrite.size(), m_rewriteOffset });
+        m_rewrite.clear();
+    }
+    if (close(m_fd) != 0)
+        ok = false;
+    m_fd = -1;
+
+    for (uint8_t *buffer : m_buffers)
+        free(buffer);
+    m_buffers.clear();
+    m_free.clear();
+    m_current = nullptr;
+    m_used = 0;
+
+    if (ok) {
+        double seconds = (SteadyNs() - m_openTime) / 1e9;
+        g_Log(logLevelInfo, "VAAPI :: Wrote %.1f MB to %s in %.1f s through %s%s", m_size / 1e6, m_path.c_str(),
+              seconds, backend, m_direct ? " with O_DIRECT" : "");
+    } else {
+        g_Log(logLevelError, "VAAPI :: Failed to write %s", m_path.c_str());
+    }
+    return ok;
+}
+
+void AsyncFileWriter::WriterThread()
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (true) {
+        m_cond.wait(guard, [this] { return m_stop || !m_pending.empty(); });
+        if (m_pending.empty())
+            break;
+
+        Block block = m_pending.front();
+        m_pending.erase(m_pending.begin());
+        guard.unlock();
+
+        bool ok = WriteBlock(block);
+
+        guard.lock();
+        if (!ok)
+            m_failed = true;
+        m_free.push_back(block.data);
+        m_cond.notify_all();
+    }
+}
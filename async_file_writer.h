@@ -0,0 +1,98 @@
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Appends to a file in the background. Data is gathered into a few large
+// blocks, 4 MB by default, held in buffers aligned to 2 MB in memory. Each
+// block is written with a single request at an offset that is a multiple of
+// the block size, so the caller only waits on the disk when every block is
+// already queued. Blocks are submitted through io_uring when the
+// plugin is built with liburing and the kernel allows it, and pwrite() from
+// a writer thread otherwise. Space is reserved with fallocate() ahead of
+// the write position.
+class AsyncFileWriter
+{
+public:
+    static constexpr size_t DefaultBlockSize = 4 << 20;
+    static constexpr uint32_t DefaultBlockCount = 4;
+
+    AsyncFileWriter();
+    ~AsyncFileWriter();
+
+    // direct bypasses the page cache with O_DIRECT where the filesystem
+    // supports it; blockSize must then be a multiple of 4096. A non-zero
+    // resumeOffset keeps the file up to there and appends after it.
+    bool Open(const std::string &path, size_t blockSize = DefaultBlockSize,
+              uint32_t blockCount = DefaultBlockCount, bool direct = false, uint64_t resumeOffset = 0);
+    bool Write(const void *data, size_t size);
+    // Waits until everything appended so far is on disk, including the
+    // partially filled block.
+    bool Sync();
+    // Overwrites bytes appended earlier once everything is written, for
+    // headers whose fields are only known at the end. Applied by Close().
+    void RewriteOnClose(uint64_t offset, const void *data, size_t size);
+    // Writes out everything queued and closes the file. Returns false if
+    // any write failed.
+    bool Close();
+
+    bool IsOpen() const
+    {
+        return m_fd >= 0;
+    }
+    // Bytes appended so far, written or not.
+    uint64_t GetSize() const
+    {
+        return m_size;
+    }
+
+private:
+    AsyncFileWriter(const AsyncFileWriter &) = delete;
+    AsyncFileWriter &operator=(const AsyncFileWriter &) = delete;
+
+    struct Block
+    {
+        uint8_t *data;
+        size_t size;
+        uint64_t offset;
+    };
+    struct Ring;
+
+    bool Submit(size_t size);
+    bool WriteBlock(const Block &block);
+    void Preallocate(uint64_t end);
+    void WriterThread();
+    // io_uring only: reaps one completion, waiting for it when wait is set.
+    bool ReapCompletion(bool wait);
+
+    int m_fd = -1;
+    std::string m_path;
+    size_t m_blockSize = 0;
+    bool m_direct = false;
+    std::vector<uint8_t *> m_buffers;
+    uint8_t *m_current = nullptr;
+    size_t m_used = 0;
+    uint64_t m_size = 0;
+    uint64_t m_allocated = 0;
+    uint64_t m_openTime = 0;
+    uint64_t m_rewriteOffset = 0;
+    std::vector<uint8_t> m_rewrite;
+
+    std::unique_ptr<Ring> m_ring;
+    uint32_t m_inFlight = 0;
+
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    std::vector<uint8_t *> m_free;
+    std::vector<Block> m_pending;
+    bool m_stop = false;
+    bool m_failed = false;
+};
@@ -0,0 +1,217 @@
+#include "av1_obu.h"
+
+#include "bit_reader.h"
+
+enum
+{
+    OBU_SEQUENCE_HEADER = 1,
+    OBU_TEMPORAL_DELIMITER = 2,
+};
+
+struct Obu
+{
+    uint8_t type;
+    const uint8_t *header; // 1 or 2 bytes, with the extension
+    size_t headerSize;
+    const uint8_t *payload;
+    size_t payloadSize;
+    size_t totalSize;
+};
+
+// OBUs without a size field run to the end of the data.
+static bool ReadObu(const uint8_t *data, size_t size, Obu &obu)
+{
+    if (!size || data[0] & 0x80)
+        return false;
+
+    obu.type = data[0] >> 3 & 0xF;
+    obu.header = data;
+    obu.headerSize = data[0] & 0x04 ? 2 : 1;
+    if (size < obu.headerSize)
+        return false;
+
+    size_t offset = obu.headerSize;
+    if (data[0] & 0x02) {
+        uint64_t payloadSize = 0;
+        size_t lebSize = ReadLeb128(data + offset, size - offset, payloadSize);
+        if (!lebSize || payloadSize > size - offset - lebSize)
+            return false;
+        offset += lebSize;
+        obu.payloadSize = payloadSize;
+    } else {
+        obu.payloadSize = size - offset;
+    }
+
+    obu.payload = data + offset;
+    obu.totalSize = offset + obu.payloadSize;
+    return true;
+}
+
+static void ReadColorConfig(BitReader &reader, AV1SequenceHeader &header)
+{
+    header.highBitDepth = reader.ReadBit();
+    header.twelveBit = header.profile == 2 && header.highBitDepth ? reader.ReadBit() : 0;
+    header.monochrome = header.profile == 1 ? 0 : reader.ReadBit();
+
+    // CP_UNSPECIFIED, TC_UNSPECIFIED, MC_UNSPECIFIED.
+    header.colorPrimaries = 2;
+    header.transferCharacteristics = 2;
+    header.matrixCoefficients = 2;
+    if (reader.ReadBit()) {
+        header.colorPrimaries = reader.ReadBits(8);
+        header.transferCharacteristics = reader.ReadBits(8);
+        header.matrixCoefficients = reader.ReadBits(8);
+    }
+
+    header.chromaSamplePosition = 0;
+    if (header.monochrome) {
+        header.colorRange = reader.ReadBit();
+        header.subsamplingX = 1;
+        header.subsamplingY = 1;
+        return;
+    }
+
+    // BT.709 primaries, sRGB transfer and identity matrix mean 4:4:4 RGB.
+    if (header.colorPrimaries == 1 && header.transferCharacteristics == 13 && header.matrixCoefficients == 0) {
+        header.colorRange = 1;
+        header.subsamplingX = 0;
+        header.subsamplingY = 0;
+        return;
+    }
+
+    header.colorRange = reader.ReadBit();
+    if (header.profile == 0) {
+        header.subsamplingX = 1;
+        header.subsamplingY = 1;
+    } else if (header.profile == 1) {
+        header.subsamplingX = 0;
+        header.subsamplingY = 0;
+    } else if (header.twelveBit) {
+        header.subsamplingX = reader.ReadBit();
+        header.subsamplingY = header.subsamplingX ? reader.ReadBit() : 0;
+    } else {
+        header.subsamplingX = 1;
+        header.subsamplingY = 0;
+    }
+    if (header.subsamplingX && header.subsamplingY)
+        header.chromaSamplePosition = reader.ReadBits(2);
+}
+
+bool ParseAV1SequenceHeader(const uint8_t *payload, size_t size, AV1SequenceHeader &header)
+{
+    BitReader reader(payload, size);
+    header = {};
+
+    header.profile = reader.ReadBits(3);
+    reader.Skip(1); // still_picture
+    bool reducedStillPictureHeader = reader.ReadBit();
+
+    if (reducedStillPictureHeader) {
+        header.level = reader.ReadBits(5);
+    } else {
+        bool decoderModelInfoPresent = false;
+        uint32_t bufferDelayLength = 0;
+        if (reader.ReadBit()) { // timing_info_present_flag
+            reader.Skip(64); // num_units_in_display_tick, time_scale
+            if (reader.ReadBit()) // equal_picture_interval
+                reader.ReadUvlc();
+            decoderModelInfoPresent = reader.ReadBit();
+            if (decoderModelInfoPresent) {
+                bufferDelayLength = reader.ReadBits(5) + 1;
+                reader.Skip(32 + 5 + 5); // num_units_in_decoding_tick, two lengths
+            }
+        }
+        bool initialDisplayDelayPresent = reader.ReadBit();
+
+        uint32_t operatingPoints = reader.ReadBits(5) + 1;
+        for (uint32_t i = 0; i < operatingPoints; i++) {
+            reader.Skip(12); // operating_point_idc
+            uint8_t level = reader.ReadBits(5);
+            uint8_t tier = level > 7 ? reader.ReadBit() : 0;
+            if (i == 0) {
+                header.level = level;
+                header.tier = tier;
+            }
+            if (decoderModelInfoPresent && reader.ReadBit())
+                reader.Skip(bufferDelayLength * 2 + 1);
+            if (initialDisplayDelayPresent && reader.ReadBit())
+                reader.Skip(4);
+        }
+    }
+
+    uint32_t widthBits = reader.ReadBits(4) + 1;
+    uint32_t heightBits = reader.ReadBits(4) + 1;
+    header.maxWidth = reader.ReadBits(widthBits) + 1;
+    header.maxHeight = reader.ReadBits(heightBits) + 1;
+
+    if (!reducedStillPictureHeader && reader.ReadBit()) // frame_id_numbers_present_flag
+        reader.Skip(4 + 3);
+
+    reader.Skip(3); // use_128x128_superblock, enable_filter_intra, enable_intra_edge_filter
+    if (!reducedStillPictureHeader) {
+        reader.Skip(4); // interintra, masked compound, warped motion, dual filter
+        bool enableOrderHint = reader.ReadBit();
+        if (enableOrderHint)
+            reader.Skip(2); // enable_jnt_comp, enable_ref_frame_mvs
+
+        uint32_t forceScreenContentTools = 2; // SELECT_SCREEN_CONTENT_TOOLS
+        if (!reader.ReadBit()) // seq_choose_screen_content_tools
+            forceScreenContentTools = reader.ReadBit();
+        if (forceScreenContentTools > 0 && !reader.ReadBit()) // seq_choose_integer_mv
+            reader.Skip(1);
+
+        if (enableOrderHint)
+            reader.Skip(3);
+    }
+    reader.Skip(3); // enable_superres, enable_cdef, enable_restoration
+
+    ReadColorConfig(reader, header);
+    return !reader.IsOverrun();
+}
+
+bool BuildAV1ConfigRecord(const uint8_t *data, size_t size, std::vector<uint8_t> &record)
+{
+    // marker and version 1.
+    if (size >= 4 && data[0] == 0x81) {
+        record.assign(data, data + size);
+        return true;
+    }
+
+    Obu obu;
+    for (size_t offset = 0; ReadObu(data + offset, size - offset, obu); offset += obu.totalSize) {
+        if (obu.type != OBU_SEQUENCE_HEADER)
+            continue;
+
+        AV1SequenceHeader header;
+        if (!ParseAV1SequenceHeader(obu.payload, obu.payloadSize, header))
+            return false;
+
+        record.clear();
+        record.push_back(0x81);
+        record.push_back(header.profile << 5 | header.level);
+        record.push_back(header.tier << 7 | header.highBitDepth << 6 | header.twelveBit << 5 | header.monochrome << 4 |
+                         header.subsamplingX << 3 | header.subsamplingY << 2 | header.chromaSamplePosition);
+        record.push_back(0); // no initial_presentation_delay
+
+        // configOBUs need the size field.
+        record.push_back(obu.header[0] | 0x02);
+        record.insert(record.end(), obu.header + 1, obu.header + obu.headerSize);
+        uint64_t payloadSize = obu.payloadSize;
+        do {
+            record.push_back((payloadSize & 0x7F) | (payloadSize > 0x7F ? 0x80 : 0));
+            payloadSize >>= 7;
+        } while (payloadSize);
+        record.insert(record.end(), obu.payload, obu.payload + obu.payloadSize);
+        return true;
+    }
+    return false;
+}
+
+size_t GetAV1TemporalDelimiterSize(const uint8_t *data, size_t size)
+{
+    size_t offset = 0;
+    Obu obu;
+    while (ReadObu(data + offset, size - offset, obu) && obu.type == OBU_TEMPORAL_DELIMITER && obu.totalSize < size - offset)
+        offset += obu.totalSize;
+    return offset;
+}
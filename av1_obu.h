@@ -0,0 +1,37 @@
+#pragma once
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The fields of an AV1 sequence header that the av1C record carries.
+struct AV1SequenceHeader
+{
+    uint8_t profile;
+    uint8_t level; // of operating point 0
+    uint8_t tier;
+    uint8_t highBitDepth;
+    uint8_t twelveBit;
+    uint8_t monochrome;
+    uint8_t subsamplingX;
+    uint8_t subsamplingY;
+    uint8_t chromaSamplePosition;
+    uint8_t colorPrimaries;
+    uint8_t transferCharacteristics;
+    uint8_t matrixCoefficients;
+    uint8_t colorRange;
+    uint32_t maxWidth;
+    uint32_t maxHeight;
+};
+
+// Parses a sequence header OBU payload, without the OBU header.
+bool ParseAV1SequenceHeader(const uint8_t *payload, size_t size, AV1SequenceHeader &header);
+
+// Builds an av1C record from OBUs holding a sequence header, such as the
+// encoder's extradata. Extradata that already is an av1C is kept.
+bool BuildAV1ConfigRecord(const uint8_t *data, size_t size, std::vector<uint8_t> &record);
+
+// Bytes of temporal delimiter OBUs at the start of a temporal unit, which
+// MP4 samples must not contain.
+size_t GetAV1TemporalDelimiterSize(const uint8_t *data, size_t size);
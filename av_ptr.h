@@ -0,0 +1,46 @@
+#pragma once
+
+#include <memory>
+
+extern "C" {
+#include <libavutil/avutil.h>
+#include <libavcodec/avcodec.h>
+}
+
+// Owning pointers for libav objects, so every early return releases them.
+struct AVCodecContextDeleter
+{
+    void operator()(AVCodecContext *ctx) const
+    {
+        avcodec_free_context(&ctx);
+    }
+};
+
+struct AVFrameDeleter
+{
+    void operator()(AVFrame *frame) const
+    {
+        av_frame_free(&frame);
+    }
+};
+
+struct AVPacketDeleter
+{
+    void operator()(AVPacket *pkt) const
+    {
+        av_packet_free(&pkt);
+    }
+};
+
+struct AVBufferRefDeleter
+{
+    void operator()(AVBufferRef *buf) const
+    {
+        av_buffer_unref(&buf);
+    }
+};
+
+using AVCodecContextPtr = std::unique_ptr<AVCodecContext, AVCodecContextDeleter>;
+using AVFramePtr = std::unique_ptr<AVFrame, AVFrameDeleter>;
+using AVPacketPtr = std::unique_ptr<AVPacket, AVPacketDeleter>;
+using AVBufferRefPtr = std::unique_ptr<AVBufferRef, AVBufferRefDeleter>;
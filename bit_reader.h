@@ -0,0 +1,102 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// MSB-first reader over a bitstream header. Reads past the end return
+// zeros and set an overrun flag, so parsers check once at the end.
+class BitReader
+{
+public:
+    BitReader(const uint8_t *data, size_t size)
+        : m_data(data)
+        , m_size(size)
+    {
+    }
+
+    uint32_t ReadBit()
+    {
+        if (m_pos >= m_size * 8) {
+            m_overrun = true;
+            return 0;
+        }
+        uint32_t bit = m_data[m_pos >> 3] >> (7 - (m_pos & 7)) & 1;
+        m_pos++;
+        return bit;
+    }
+
+    // Up to 32 bits.
+    uint32_t ReadBits(uint32_t count)
+    {
+        uint32_t value = 0;
+        while (count--)
+            value = value << 1 | ReadBit();
+        return value;
+    }
+
+    void Skip(size_t count)
+    {
+        m_pos += count;
+        if (m_pos > m_size * 8) {
+            m_pos = m_size * 8;
+            m_overrun = true;
+        }
+    }
+
+    // AV1 uvlc().
+    uint32_t ReadUvlc()
+    {
+        uint32_t leadingZeros = 0;
+        while (!ReadBit()) {
+            if (m_overrun || ++leadingZeros >= 32)
+                return UINT32_MAX;
+        }
+        return leadingZeros ? (1u << leadingZeros) - 1 + ReadBits(leadingZeros) : 0;
+    }
+
+    // H.264/HEVC ue(v) and se(v).
+    uint32_t ReadUE()
+    {
+        return ReadUvlc();
+    }
+
+    int32_t ReadSE()
+    {
+        uint32_t value = ReadUE();
+        return value & 1 ? static_cast<int32_t>((value + 1) / 2) : -static_cast<int32_t>(value / 2);
+    }
+
+    // For values no valid stream has, so the caller's check fails the same way.
+    void Invalidate()
+    {
+        m_overrun = true;
+    }
+
+    size_t GetPosition() const
+    {
+        return m_pos;
+    }
+
+    bool IsOverrun() const
+    {
+        return m_overrun;
+    }
+
+private:
+    const uint8_t *m_data;
+    size_t m_size;
+    size_t m_pos = 0;
+    bool m_overrun = false;
+};
+
+// AV1 leb128(), returns the number of bytes read or 0 when malformed.
+static inline size_t ReadLeb128(const uint8_t *data, size_t size, uint64_t &value)
+{
+    value = 0;
+    for (size_t i = 0; i < 8 && i < size; i++) {
+        value |= uint64_t(data[i] & 0x7F) << (i * 7);
+        if (!(data[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,141 @@
+#include "checkpoint.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "wrapper/host_api.h"
+
+static constexpr uint32_t JournalMagic = 0x504b4356; // "VCKP"
+static constexpr uint32_t JournalVersion = 1;
+
+struct CheckpointJournal::Record
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t settingsHash;
+    uint64_t generation;
+    Checkpoint checkpoint;
+    uint64_t checksum; // of everything above
+};
+
+std::mutex CheckpointJournal::s_lock;
+std::map<std::string, std::weak_ptr<CheckpointJournal>> CheckpointJournal::s_journals;
+
+uint64_t CheckpointJournal::Hash(const void *data, size_t size, uint64_t seed)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    for (size_t i = 0; i < size; i++)
+        seed = (seed ^ bytes[i]) * 0x100000001b3;
+    return seed;
+}
+
+CheckpointJournal::~CheckpointJournal()
+{
+    if (m_fd >= 0)
+        close(m_fd);
+
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto it = s_journals.find(m_outputPath);
+    if (it != s_journals.end() && it->second.expired())
+        s_journals.erase(it);
+}
+
+std::shared_ptr<CheckpointJournal> CheckpointJournal::Open(const std::string &outputPath, uint64_t settingsHash)
+{
+    std::shared_ptr<CheckpointJournal> journal(new CheckpointJournal());
+    journal->m_outputPath = outputPath;
+    journal->m_path = outputPath + ".resume";
+    journal->m_settingsHash = settingsHash;
+
+    journal->m_fd = open(journal->m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (journal->m_fd < 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to open %s: %s", journal->m_path.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    // The newest intact slot wins.
+    bool mismatch = false;
+    for (int slot = 0; slot < 2; slot++) {
+        Record record;
+        if (pread(journal->m_fd, &record, sizeof(record), slot * sizeof(record)) != sizeof(record))
+            continue;
+        if (record.magic != JournalMagic || record.version != JournalVersion ||
+            record.checksum != Hash(&record, offsetof(Record, checksum)))
+            continue;
+        if (record.settingsHash != settingsHash) {
+            mismatch = true;
+            continue;
+        }
+        if (!journal->m_hasResume || record.generation > journal->m_generation) {
+            journal->m_hasResume = true;
+            journal->m_generation = record.generation;
+            journal->m_resume = record.checkpoint;
+        }
+    }
+
+    struct stat st;
+    if (journal->m_hasResume && (stat(outputPath.c_str(), &st) != 0 ||
+                                 static_cast<uint64_t>(st.st_size) < journal->m_resume.offset)) {
+        g_Log(logLevelWarn, "VAAPI :: %s is shorter than its checkpoint, starting over", outputPath.c_str());
+        journal->m_hasResume = false;
+    }
+
+    if (journal->m_hasResume) {
+        g_Log(logLevelInfo, "VAAPI :: Resuming %s at pts %lld, byte %llu", outputPath.c_str(),
+              static_cast<long long>(journal->m_resume.pts), static_cast<unsigned long long>(journal->m_resume.offset));
+    } else {
+        if (mismatch)
+            g_Log(logLevelWarn, "VAAPI :: Settings changed since %s was checkpointed, starting over", outputPath.c_str());
+        journal->m_generation = 0;
+        if (ftruncate(journal->m_fd, 0) != 0)
+            return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_journals[outputPath] = journal;
+    return journal;
+}
+
+std::shared_ptr<CheckpointJournal> CheckpointJournal::Find(const std::string &outputPath)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto it = s_journals.find(outputPath);
+    return it != s_journals.end() ? it->second.lock() : nullptr;
+}
+
+bool CheckpointJournal::Commit(const Checkpoint &checkpoint)
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_fd < 0)
+        return false;
+
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = JournalMagic;
+    record.version = JournalVersion;
+    record.settingsHash = m_settingsHash;
+    record.generation = ++m_generation;
+    record.checkpoint = checkpoint;
+    record.checksum = Hash(&record, offsetof(Record, checksum));
+
+    off_t offset = (record.generation % 2) * sizeof(record);
+    if (pwrite(m_fd, &record, sizeof(record), offset) != sizeof(record) || fdatasync(m_fd) != 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to write checkpoint to %s", m_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+void CheckpointJournal::Remove()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    if (m_fd < 0)
+        return;
+
+    close(m_fd);
+    m_fd = -1;
+    unlink(m_path.c_str());
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Sidecar journal that lets a crashed render continue from its last closed
+// GOP. The container commits a checkpoint once everything before a keyframe
+// is on disk. A later render with the same settings to the same path finds
+// it, the container truncates the output there and the encoder skips the
+// frames before the keyframe.
+//
+// The file holds two fixed-size slots that are written alternately and
+// fdatasync()ed, so a crash during a commit leaves the previous one intact.
+class CheckpointJournal
+{
+public:
+    struct Checkpoint
+    {
+        uint64_t offset; // output bytes before the keyframe
+        int64_t pts; // of the keyframe, the first frame encoded again
+        // Container timeline, where the output format needs one.
+        int64_t firstDts;
+        uint64_t decodeTime;
+        uint32_t sequence;
+        uint32_t reserved;
+    };
+
+    // Containers commit at the first keyframe this long after the previous
+    // checkpoint, since every commit waits for two fdatasync() calls.
+    static constexpr uint32_t IntervalSeconds = 10;
+
+    ~CheckpointJournal();
+
+    // Encoder side: opens the journal next to outputPath, keeps a checkpoint
+    // left by a render with the same settingsHash and makes the journal
+    // available to the container.
+    static std::shared_ptr<CheckpointJournal> Open(const std::string &outputPath, uint64_t settingsHash);
+    // Container side: the journal the encoder opened for outputPath, if any.
+    static std::shared_ptr<CheckpointJournal> Find(const std::string &outputPath);
+
+    // 64-bit FNV-1a, chained through seed.
+    static uint64_t Hash(const void *data, size_t size, uint64_t seed = 0xcbf29ce484222325);
+
+    // The checkpoint to resume from, nullptr to start from scratch.
+    const Checkpoint *GetResume() const
+    {
+        return m_hasResume ? &m_resume : nullptr;
+    }
+
+    bool Commit(const Checkpoint &checkpoint);
+    // The render completed, there is nothing to resume.
+    void Remove();
+
+private:
+    struct Record;
+
+    CheckpointJournal() = default;
+    CheckpointJournal(const CheckpointJournal &) = delete;
+    CheckpointJournal &operator=(const CheckpointJournal &) = delete;
+
+    std::string m_outputPath;
+    std::string m_path;
+    int m_fd = -1;
+    uint64_t m_settingsHash = 0;
+    uint64_t m_generation = 0;
+    bool m_hasResume = false;
+    Checkpoint m_resume = {};
+
+    std::mutex m_lock;
+
+    static std::mutex s_lock;
+    static std::map<std::string, std::weak_ptr<CheckpointJournal>> s_journals;
+};
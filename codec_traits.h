@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+enum class CodecId
+{
+    H264,
+    HEVC,
+    AV1,
+};
+
+struct ConfigRecordParams
+{
+    const uint8_t *extradata;
+    size_t size;
+    uint32_t depth;
+    uint32_t frameRateNum;
+    uint32_t frameRateDen;
+};
+
+// Everything that identifies one registered codec. The table itself lives
+// next to the per-codec template specializations in vaapi_encoder.cpp, so
+// adding a codec variant is a single entry there.
+struct CodecTraits
+{
+    uint8_t uuid[16];
+    uint32_t fourcc;
+    const char *ffName;
+    const char *group;
+    const char *name;
+    uint32_t depth;
+    CodecId id;
+    int maxQP;
+    double qpPerDoubling; // QP change that roughly halves the frame size
+
+    // Builds the MP4 sample description record (avcC, hvcC, av1C).
+    bool (*buildConfigRecord)(const ConfigRecordParams &params, std::vector<uint8_t> &record);
+    // The record also goes in front of the first MP4 keyframe.
+    bool prependConfigRecord;
+    // Number of leading packet bytes that don't belong in an MP4 sample. The
+    // encoder strips them for the host's MP4, our own does while copying.
+    size_t (*mp4PayloadOffset)(const uint8_t *data, size_t size);
+};
+
+enum {
+    FOURCC_AVC = 1635148593,
+    FOURCC_HEVC = 1752589105,
+    FOURCC_AV1 = 1635135537,
+};
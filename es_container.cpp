@@ -0,0 +1,290 @@
+#include "es_container.h"
+
+#include <algorithm>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "wrapper/host_api.h"
+
+// Two blocks: one filling while the other is on its way to the disk.
+static constexpr size_t BlockSize = 2 << 20;
+static constexpr uint32_t BlockCount = 2;
+
+#define ES_UUID(last) { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, last }
+
+const ElementaryStreamContainer::FormatInfo ElementaryStreamContainer::s_Formats[] = {
+    { ES_UUID(0x31), "VAAPI H.264 Elementary Stream", "h264", CodecId::H264, Format::AnnexB },
+    { ES_UUID(0x32), "VAAPI H.265 Elementary Stream", "hevc", CodecId::HEVC, Format::AnnexB },
+    { ES_UUID(0x33), "VAAPI AV1 IVF", "ivf", CodecId::AV1, Format::IVF },
+    { ES_UUID(0x34), "VAAPI AV1 OBU Stream", "obu", CodecId::AV1, Format::OBU },
+};
+
+#undef ES_UUID
+
+class ElementaryStreamTrack : public IPluginTrackBase, public IPluginTrackWriter
+{
+public:
+    explicit ElementaryStreamTrack(ElementaryStreamContainer *container)
+        : IPluginTrackBase(container)
+    {
+    }
+
+    StatusCode DoWrite(HostBufferRef *p_pBuf) override
+    {
+        return static_cast<ElementaryStreamContainer *>(m_pContainer)->WriteSample(p_pBuf);
+    }
+
+private:
+    ~ElementaryStreamTrack() = default;
+};
+
+static void PutLE16(uint8_t *out, uint16_t value)
+{
+    out[0] = value;
+    out[1] = value >> 8;
+}
+
+static void PutLE32(uint8_t *out, uint32_t value)
+{
+    PutLE16(out, value);
+    PutLE16(out + 2, value >> 16);
+}
+
+static void PutLE64(uint8_t *out, uint64_t value)
+{
+    PutLE32(out, value);
+    PutLE32(out + 4, value >> 32);
+}
+
+// Frames in the first end bytes of an IVF file, walking the frame headers.
+static bool CountIVFFrames(const std::string &path, uint64_t end, uint32_t &count)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    count = 0;
+    uint64_t offset = 32;
+    uint8_t header[12];
+    while (offset < end && fseeko(file, offset, SEEK_SET) == 0 && fread(header, sizeof(header), 1, file) == 1) {
+        offset += sizeof(header) + (header[0] | header[1] << 8 | header[2] << 16 | uint32_t(header[3]) << 24);
+        count++;
+    }
+    fclose(file);
+    return offset == end;
+}
+
+ElementaryStreamContainer::ElementaryStreamContainer(const FormatInfo &format)
+    : m_format(format)
+{
+}
+
+ElementaryStreamContainer::~ElementaryStreamContainer()
+{
+    m_file.Close();
+    if (m_index)
+        m_index->Close();
+}
+
+ElementaryStreamContainer *ElementaryStreamContainer::Create(const uint8_t *uuid)
+{
+    for (const FormatInfo &format : s_Formats) {
+        if (!memcmp(uuid, format.uuid, sizeof(format.uuid)))
+            return new ElementaryStreamContainer(format);
+    }
+    return nullptr;
+}
+
+StatusCode ElementaryStreamContainer::Register(HostListRef *p_pList)
+{
+    for (const FormatInfo &format : s_Formats) {
+        HostPropertyCollectionRef info;
+        info.SetProperty(pIOPropUUID, propTypeUInt8, format.uuid, sizeof(format.uuid));
+        info.SetProperty(pIOPropName, propTypeString, format.name, strlen(format.name));
+        info.SetProperty(pIOPropContainerExt, propTypeString, format.ext, strlen(format.ext));
+
+        uint32_t mediaType = mediaVideo;
+        info.SetProperty(pIOPropMediaType, propTypeUInt32, &mediaType, 1);
+
+        if (!p_pList->Append(&info))
+            return errFail;
+    }
+    return errNone;
+}
+
+std::vector<std::string> ElementaryStreamContainer::GetIds(CodecId codec)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    std::vector<std::string> ids;
+    for (const FormatInfo &format : s_Formats) {
+        if (format.codec != codec)
+            continue;
+        std::string hex;
+        for (uint8_t byte : format.uuid) {
+            hex.push_back(digits[byte >> 4]);
+            hex.push_back(digits[byte & 0xF]);
+        }
+        ids.push_back(hex);
+    }
+    return ids;
+}
+
+StatusCode ElementaryStreamContainer::DoInit(HostPropertyCollectionRef *p_pProps)
+{
+    return errNone;
+}
+
+StatusCode ElementaryStreamContainer::DoOpen(HostPropertyCollectionRef *p_pProps)
+{
+    if (!p_pProps->GetString(pIOPropPath, m_path) || m_path.empty())
+        return errNoParam;
+
+    // The file is opened with the track, once the encoder decided whether
+    // it resumes from a checkpoint.
+    g_Log(logLevelInfo, "VAAPI :: %s %s", m_format.name, m_path.c_str());
+    return errNone;
+}
+
+StatusCode ElementaryStreamContainer::DoAddTrack(HostPropertyCollectionRef *p_pProps, HostPropertyCollectionRef *p_pCodecProps,
+                                                 IPluginTrackBase **p_pTrack)
+{
+    uint32_t mediaType = mediaNone;
+    p_pProps->GetUINT32(pIOPropMediaType, mediaType);
+    if (mediaType != mediaVideo || m_hasTrack) {
+        g_Log(logLevelError, "VAAPI :: %s only takes a single video track", m_format.name);
+        return errUnsupported;
+    }
+
+    HostCodecConfigCommon common;
+    common.Load(p_pProps);
+    common.Load(p_pCodecProps);
+    m_width = common.GetWidth();
+    m_height = common.GetHeight();
+    m_frameRateNum = common.GetFrameRateNum();
+    m_frameRateDen = common.GetFrameRateDen();
+
+    // With global headers the encoder keeps SPS/PPS (and VPS) out of the
+    // packets, so they go in front of the first one.
+    PropertyType type = propTypeNull;
+    const void *cookie = nullptr;
+    int cookieSize = 0;
+    if (m_format.format == Format::AnnexB &&
+        p_pCodecProps->GetProperty(pIOPropMagicCookie, &type, &cookie, &cookieSize) == errNone &&
+        type == propTypeUInt8 && cookieSize > 0) {
+        const uint8_t *bytes = static_cast<const uint8_t *>(cookie);
+        m_parameterSets.assign(bytes, bytes + cookieSize);
+    }
+
+    m_journal = CheckpointJournal::Find(m_path);
+    const CheckpointJournal::Checkpoint *resume = m_journal ? m_journal->GetResume() : nullptr;
+    m_frameCount = 0;
+    if (resume && m_format.format == Format::IVF && !CountIVFFrames(m_path, resume->offset, m_frameCount)) {
+        g_Log(logLevelError, "VAAPI :: %s doesn't end in a whole frame at the checkpoint", m_path.c_str());
+        return errFail;
+    }
+    if (!m_file.Open(m_path, BlockSize, BlockCount, true, resume ? resume->offset : 0))
+        return errFail;
+    // Headers and parameter sets are in the kept part already.
+    m_started = resume != nullptr;
+
+    // The PTS are in frame periods.
+    m_index = KeyframeIndexWriter::Find(m_path);
+    if (m_index && !m_index->Open(m_frameRateDen, m_frameRateNum, resume ? resume->offset : 0)) {
+        g_Log(logLevelWarn, "VAAPI :: Rendering %s without a keyframe index", m_path.c_str());
+        m_index.reset();
+    }
+
+    m_hasTrack = true;
+    *p_pTrack = new ElementaryStreamTrack(this);
+    return errNone;
+}
+
+StatusCode ElementaryStreamContainer::WriteSample(HostBufferRef *p_pBuf)
+{
+    if (!p_pBuf) {
+        m_ended = true;
+        return errNone;
+    }
+    if (m_failed)
+        return errFail;
+
+    int64_t pts = 0;
+    uint8_t isKeyFrame = 0;
+    p_pBuf->GetINT64(pIOPropPTS, pts);
+    p_pBuf->GetUINT8(pIOPropIsKeyFrame, isKeyFrame);
+
+    if (!m_started) {
+        bool ok = true;
+        if (m_format.format == Format::IVF) {
+            uint8_t header[32] = { 'D', 'K', 'I', 'F' };
+            PutLE16(header + 4, 0); // version
+            PutLE16(header + 6, sizeof(header));
+            memcpy(header + 8, "AV01", 4);
+            PutLE16(header + 12, m_width);
+            PutLE16(header + 14, m_height);
+            PutLE32(header + 16, m_frameRateNum);
+            PutLE32(header + 20, m_frameRateDen);
+            PutLE32(header + 24, 0); // frame count, filled in on close
+            ok = m_file.Write(header, sizeof(header));
+        } else if (!m_parameterSets.empty()) {
+            ok = m_file.Write(m_parameterSets.data(), m_parameterSets.size());
+        }
+        m_failed = !ok;
+        m_started = true;
+    }
+
+    // With closed GOPs everything before a keyframe stands on its own.
+    if (m_journal && isKeyFrame && pts >= m_nextCheckpointPts) {
+        CheckpointJournal::Checkpoint checkpoint = {};
+        checkpoint.offset = m_file.GetSize();
+        checkpoint.pts = pts;
+        if (!m_file.Sync() || !m_journal->Commit(checkpoint))
+            m_failed = true;
+        m_nextCheckpointPts = pts + int64_t(CheckpointJournal::IntervalSeconds) * m_frameRateNum / std::max(m_frameRateDen, 1u);
+    }
+
+    char *data = nullptr;
+    size_t size = 0;
+    if (!p_pBuf->LockBuffer(&data, &size))
+        return errAlloc;
+
+    uint64_t offset = m_file.GetSize();
+    bool ok = true;
+    if (m_format.format == Format::IVF) {
+        uint8_t header[12];
+        PutLE32(header, size);
+        PutLE64(header + 4, pts);
+        ok = m_file.Write(header, sizeof(header));
+    }
+    ok = ok && m_file.Write(data, size);
+    p_pBuf->UnlockBuffer();
+    if (ok) {
+        if (m_index)
+            m_index->Add(pts, offset, m_file.GetSize() - offset, isKeyFrame);
+        m_frameCount++;
+    }
+
+    m_failed = m_failed || !ok;
+    return m_failed ? errFail : errNone;
+}
+
+StatusCode ElementaryStreamContainer::DoClose()
+{
+    if (!m_file.IsOpen())
+        return errNone;
+
+    if (m_format.format == Format::IVF && m_started) {
+        uint8_t count[4];
+        PutLE32(count, m_frameCount);
+        m_file.RewriteOnClose(24, count, sizeof(count));
+    }
+    bool ok = m_file.Close() && !m_failed;
+    if (m_index)
+        m_index->Close();
+    // Only a render that got to its end has nothing left to resume.
+    if (ok && m_ended && m_journal)
+        m_journal->Remove();
+    return ok ? errNone : errFail;
+}
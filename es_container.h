@@ -0,0 +1,73 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "async_file_writer.h"
+#include "checkpoint.h"
+#include "codec_traits.h"
+#include "keyframe_index.h"
+#include "wrapper/plugin_api.h"
+
+using namespace IOPlugin;
+
+// Raw elementary stream output: Annex B for H.264 and HEVC, IVF or a plain
+// low-overhead OBU stream for AV1. Packets are appended as they come into
+// double-buffered 2 MB blocks written with O_DIRECT where possible.
+class ElementaryStreamContainer : public IPluginContainerRef
+{
+public:
+    static ElementaryStreamContainer *Create(const uint8_t *uuid);
+    static StatusCode Register(HostListRef *p_pList);
+    // Entries that select the raw formats of a codec in its pIOPropContainerList.
+    static std::vector<std::string> GetIds(CodecId codec);
+
+    // Called by the track, p_pBuf is NULL at the end of the stream.
+    StatusCode WriteSample(HostBufferRef *p_pBuf);
+
+private:
+    enum class Format
+    {
+        AnnexB,
+        IVF,
+        OBU,
+    };
+
+    struct FormatInfo
+    {
+        uint8_t uuid[16];
+        const char *name;
+        const char *ext;
+        CodecId codec;
+        Format format;
+    };
+
+    static const FormatInfo s_Formats[];
+
+    explicit ElementaryStreamContainer(const FormatInfo &format);
+    ~ElementaryStreamContainer();
+
+    StatusCode DoInit(HostPropertyCollectionRef *p_pProps) override;
+    StatusCode DoOpen(HostPropertyCollectionRef *p_pProps) override;
+    StatusCode DoAddTrack(HostPropertyCollectionRef *p_pProps, HostPropertyCollectionRef *p_pCodecProps,
+                          IPluginTrackBase **p_pTrack) override;
+    StatusCode DoClose() override;
+
+    const FormatInfo &m_format;
+    std::string m_path;
+    AsyncFileWriter m_file;
+    bool m_hasTrack = false;
+    bool m_started = false;
+    bool m_ended = false;
+    bool m_failed = false;
+    std::shared_ptr<CheckpointJournal> m_journal;
+    int64_t m_nextCheckpointPts = INT64_MIN;
+    uint32_t m_width = 0;
+    uint32_t m_height = 0;
+    uint32_t m_frameRateNum = 0;
+    uint32_t m_frameRateDen = 0;
+    uint32_t m_frameCount = 0; // IVF frames in the file
+    std::vector<uint8_t> m_parameterSets;
+    std::shared_ptr<KeyframeIndexWriter> m_index;
+};
@@ -0,0 +1,450 @@
+#include "fmp4_container.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "av1_obu.h"
+#include "codec_traits.h"
+#include "wrapper/host_api.h"
+
+static const uint8_t s_UUID[] = { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, 0x30 };
+static const uint8_t s_SegmentedUUID[] = { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, 0x35 };
+
+// Fragments are cut at the first keyframe after FragmentSeconds, or at any
+// frame after MaxFragmentSeconds so long GOPs don't pile up in memory.
+// Segments wait for a keyframe however long it takes.
+static constexpr uint32_t FragmentSeconds = 1;
+static constexpr uint32_t MaxFragmentSeconds = 4;
+
+// Segments the encoder may get ahead of the disk before it waits.
+static constexpr size_t MaxQueuedSegments = 4;
+
+static std::string HexId(const uint8_t *uuid)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (int i = 0; i < 16; i++) {
+        hex.push_back(digits[uuid[i] >> 4]);
+        hex.push_back(digits[uuid[i] & 0xF]);
+    }
+    return hex;
+}
+
+class FragmentedMP4Track : public IPluginTrackBase, public IPluginTrackWriter
+{
+public:
+    explicit FragmentedMP4Track(FragmentedMP4Container *container)
+        : IPluginTrackBase(container)
+    {
+    }
+
+    StatusCode DoWrite(HostBufferRef *p_pBuf) override
+    {
+        return static_cast<FragmentedMP4Container *>(m_pContainer)->WriteSample(p_pBuf);
+    }
+
+private:
+    ~FragmentedMP4Track() = default;
+};
+
+FragmentedMP4Container::FragmentedMP4Container(bool segmented)
+    : m_segmented(segmented)
+{
+}
+
+FragmentedMP4Container *FragmentedMP4Container::Create(const uint8_t *uuid)
+{
+    if (!memcmp(uuid, s_UUID, sizeof(s_UUID)))
+        return new FragmentedMP4Container(false);
+    if (!memcmp(uuid, s_SegmentedUUID, sizeof(s_SegmentedUUID)))
+        return new FragmentedMP4Container(true);
+    return nullptr;
+}
+
+StatusCode FragmentedMP4Container::Register(HostListRef *p_pList)
+{
+    auto addContainer = [&p_pList](const uint8_t *uuid, const char *name, const char *ext) {
+        HostPropertyCollectionRef info;
+        info.SetProperty(pIOPropUUID, propTypeUInt8, uuid, 16);
+        info.SetProperty(pIOPropName, propTypeString, name, strlen(name));
+        info.SetProperty(pIOPropContainerExt, propTypeString, ext, strlen(ext));
+
+        uint32_t mediaType = mediaVideo;
+        info.SetProperty(pIOPropMediaType, propTypeUInt32, &mediaType, 1);
+
+        return p_pList->Append(&info);
+    };
+
+    if (!addContainer(s_UUID, "VAAPI Fragmented MP4", "mp4") ||
+        !addContainer(s_SegmentedUUID, "VAAPI CMAF (HLS)", "m3u8"))
+        return errFail;
+    return errNone;
+}
+
+const std::string &FragmentedMP4Container::GetId()
+{
+    static const std::string id = HexId(s_UUID);
+    return id;
+}
+
+const std::string &FragmentedMP4Container::GetSegmentedId()
+{
+    static const std::string id = HexId(s_SegmentedUUID);
+    return id;
+}
+
+FragmentedMP4Container::~FragmentedMP4Container()
+{
+    StopSegmentThread();
+    m_file.Close();
+}
+
+StatusCode FragmentedMP4Container::DoInit(HostPropertyCollectionRef *p_pProps)
+{
+    return errNone;
+}
+
+StatusCode FragmentedMP4Container::DoOpen(HostPropertyCollectionRef *p_pProps)
+{
+    if (!p_pProps->GetString(pIOPropPath, m_path) || m_path.empty())
+        return errNoParam;
+
+    if (m_segmented) {
+        std::filesystem::path path(m_path);
+        m_dir = path.parent_path().string();
+        m_baseName = path.stem().string();
+        g_Log(logLevelInfo, "VAAPI :: CMAF segments for %s", m_path.c_str());
+        return errNone;
+    }
+
+    // The file is opened with the track, once the encoder decided whether
+    // it resumes from a checkpoint.
+    g_Log(logLevelInfo, "VAAPI :: Fragmented MP4 %s", m_path.c_str());
+    return errNone;
+}
+
+StatusCode FragmentedMP4Container::DoAddTrack(HostPropertyCollectionRef *p_pProps, HostPropertyCollectionRef *p_pCodecProps,
+                                              IPluginTrackBase **p_pTrack)
+{
+    uint32_t mediaType = mediaNone;
+    p_pProps->GetUINT32(pIOPropMediaType, mediaType);
+    if (mediaType != mediaVideo || m_hasTrack) {
+        g_Log(logLevelError, "VAAPI :: Fragmented MP4 only takes a single video track");
+        return errUnsupported;
+    }
+
+    // Codec properties override the track ones where both are set.
+    HostCodecConfigCommon common;
+    common.Load(p_pProps);
+    common.Load(p_pCodecProps);
+
+    uint32_t fourcc = 0;
+    p_pCodecProps->GetUINT32(pIOPropFourCC, fourcc);
+    if (fourcc != FOURCC_AVC && fourcc != FOURCC_HEVC && fourcc != FOURCC_AV1) {
+        g_Log(logLevelError, "VAAPI :: Fragmented MP4 doesn't support codec %08x", fourcc);
+        return errUnsupported;
+    }
+
+    PropertyType type = propTypeNull;
+    const void *cookie = nullptr;
+    int cookieSize = 0;
+    if (p_pCodecProps->GetProperty(pIOPropMagicCookie, &type, &cookie, &cookieSize) != errNone ||
+        type != propTypeUInt8 || cookieSize <= 0) {
+        g_Log(logLevelError, "VAAPI :: Fragmented MP4 needs the codec configuration record");
+        return errNoParam;
+    }
+
+    if (!common.GetWidth() || !common.GetHeight() || !common.GetFrameRateNum() || !common.GetFrameRateDen())
+        return errNoParam;
+
+    m_track.fourcc = fourcc;
+    m_track.width = common.GetWidth();
+    m_track.height = common.GetHeight();
+    m_track.timescale = common.GetFrameRateNum();
+    m_frameTicks = common.GetFrameRateDen();
+    const uint8_t *record = static_cast<const uint8_t *>(cookie);
+    m_track.configRecord.assign(record, record + cookieSize);
+
+    m_track.hasColour = p_pCodecProps->GetINT16(pIOPropColorPrimaries, m_track.primaries) &&
+        p_pCodecProps->GetINT16(pIOTransferCharacteristics, m_track.trc) &&
+        p_pCodecProps->GetINT16(pIOColorMatrix, m_track.matrix);
+    m_track.fullRange = common.IsFullRange();
+    m_track.cmaf = m_segmented;
+
+    if (m_segmented) {
+        m_segmentStop = false;
+        m_segmentFailed = false;
+        m_segmentSeconds.clear();
+        m_segmentThread = std::thread(&FragmentedMP4Container::SegmentThread, this);
+    } else {
+        m_journal = CheckpointJournal::Find(m_path);
+        const CheckpointJournal::Checkpoint *resume = m_journal ? m_journal->GetResume() : nullptr;
+        if (!m_file.Open(m_path, AsyncFileWriter::DefaultBlockSize, AsyncFileWriter::DefaultBlockCount, false,
+                         resume ? resume->offset : 0))
+            return errFail;
+
+        // Continue the timeline and fragment numbering after the moov and
+        // fragments that were kept.
+        if (resume) {
+            m_started = true;
+            m_firstDts = resume->firstDts;
+            m_fragmentStart = resume->decodeTime;
+            m_lastDts = resume->decodeTime;
+            m_sequence = resume->sequence;
+        }
+    }
+
+    m_hasTrack = true;
+    *p_pTrack = new FragmentedMP4Track(this);
+    return errNone;
+}
+
+StatusCode FragmentedMP4Container::WriteSample(HostBufferRef *p_pBuf)
+{
+    if (!p_pBuf) {
+        m_ended = true;
+        return errNone;
+    }
+    if (m_failed)
+        return errFail;
+
+    int64_t pts = 0;
+    int64_t dts = 0;
+    uint8_t isKeyFrame = 0;
+    if (!p_pBuf->GetINT64(pIOPropPTS, pts))
+        return errNoParam;
+    if (!p_pBuf->GetINT64(pIOPropDTS, dts))
+        dts = pts;
+    p_pBuf->GetUINT8(pIOPropIsKeyFrame, isKeyFrame);
+
+    char *data = nullptr;
+    size_t size = 0;
+    if (!p_pBuf->LockBuffer(&data, &size))
+        return errAlloc;
+
+    // Timestamps count frames, the track counts timescale ticks.
+    if (!m_started) {
+        m_track.mediaTime = (pts - dts) * m_frameTicks;
+        m_firstDts = dts;
+        m_lastDts = 0;
+
+        m_header.clear();
+        BuildMp4InitSegment(m_track, m_header);
+        if (m_segmented)
+            m_failed = !QueueSegmentFile({ m_baseName + "_init.mp4", m_header, {}, 0.0 });
+        else
+            m_failed = !m_file.Write(m_header.data(), m_header.size());
+        m_started = true;
+    }
+
+    int64_t decodeTime = (dts - m_firstDts) * m_frameTicks;
+    if (!m_samples.empty()) {
+        m_samples.back().duration = static_cast<uint32_t>(decodeTime - m_lastDts);
+
+        // Half a frame of slack for GOPs rounded to whole frames.
+        uint64_t elapsed = decodeTime - m_fragmentStart + m_frameTicks / 2;
+        uint64_t target = uint64_t(m_segmented ? SegmentSeconds : FragmentSeconds) * m_track.timescale;
+        if ((isKeyFrame && elapsed >= target) ||
+            (!m_segmented && elapsed >= uint64_t(MaxFragmentSeconds) * m_track.timescale)) {
+            m_failed = m_failed || !WriteFragment();
+            m_fragmentStart = decodeTime;
+
+            // With closed GOPs the file up to a keyframe fragment stands on its own.
+            if (m_journal && isKeyFrame && pts >= m_nextCheckpointPts && !m_failed) {
+                CheckpointJournal::Checkpoint checkpoint = {};
+                checkpoint.offset = m_file.GetSize();
+                checkpoint.pts = pts;
+                checkpoint.firstDts = m_firstDts;
+                checkpoint.decodeTime = decodeTime;
+                checkpoint.sequence = m_sequence;
+                m_failed = !m_file.Sync() || !m_journal->Commit(checkpoint);
+                m_nextCheckpointPts = pts + int64_t(CheckpointJournal::IntervalSeconds) * m_track.timescale /
+                    std::max(m_frameTicks, 1u);
+            }
+        }
+    }
+    m_lastDts = decodeTime;
+
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+    Mp4Sample sample;
+    sample.duration = m_frameTicks;
+    sample.ctsOffset = static_cast<int32_t>((pts - dts) * m_frameTicks);
+    sample.isKeyFrame = isKeyFrame;
+    if (m_track.fourcc == FOURCC_AV1) {
+        // The encoder leaves the temporal delimiters in for this copy to skip.
+        size_t offset = GetAV1TemporalDelimiterSize(bytes, size);
+        m_payload.insert(m_payload.end(), bytes + offset, bytes + size);
+        sample.size = size - offset;
+    } else {
+        sample.size = AppendLengthPrefixedNALs(m_track.fourcc, bytes, size, m_payload);
+    }
+    m_samples.push_back(sample);
+
+    p_pBuf->UnlockBuffer();
+    return m_failed ? errFail : errNone;
+}
+
+bool FragmentedMP4Container::WriteFragment()
+{
+    if (m_samples.empty())
+        return true;
+
+    m_header.clear();
+    if (m_segmented)
+        BuildMp4SegmentType(m_header);
+    BuildMp4FragmentHeader(++m_sequence, m_fragmentStart, m_samples, m_payload.size(), m_header);
+
+    bool ok;
+    if (m_segmented) {
+        uint64_t ticks = 0;
+        for (const Mp4Sample &sample : m_samples)
+            ticks += sample.duration;
+
+        char name[32];
+        snprintf(name, sizeof(name), "_%05u.m4s", m_sequence);
+        ok = QueueSegmentFile({ m_baseName + name, m_header, std::move(m_payload),
+                                static_cast<double>(ticks) / m_track.timescale });
+    } else {
+        ok = m_file.Write(m_header.data(), m_header.size()) && m_file.Write(m_payload.data(), m_payload.size());
+    }
+
+    m_samples.clear();
+    m_payload.clear();
+    return ok;
+}
+
+bool FragmentedMP4Container::QueueSegmentFile(SegmentFile file)
+{
+    std::unique_lock<std::mutex> guard(m_segmentLock);
+    m_segmentCond.wait(guard, [this] { return m_segmentQueue.size() < MaxQueuedSegments || m_segmentFailed; });
+    if (m_segmentFailed)
+        return false;
+    m_segmentQueue.push_back(std::move(file));
+    m_segmentCond.notify_all();
+    return true;
+}
+
+bool FragmentedMP4Container::StopSegmentThread()
+{
+    if (!m_segmentThread.joinable())
+        return true;
+
+    {
+        std::lock_guard<std::mutex> guard(m_segmentLock);
+        m_segmentStop = true;
+    }
+    m_segmentCond.notify_all();
+    m_segmentThread.join();
+    return !m_segmentFailed;
+}
+
+void FragmentedMP4Container::SegmentThread()
+{
+    std::unique_lock<std::mutex> guard(m_segmentLock);
+    while (true) {
+        m_segmentCond.wait(guard, [this] { return m_segmentStop || !m_segmentQueue.empty(); });
+        if (m_segmentQueue.empty())
+            break;
+
+        SegmentFile file = std::move(m_segmentQueue.front());
+        m_segmentQueue.pop_front();
+        guard.unlock();
+
+        // The playlist only lists a segment once its file is complete.
+        bool ok;
+        if (file.name.empty()) {
+            ok = WritePlaylist(true);
+        } else {
+            ok = WriteFile(file);
+            if (ok && file.seconds > 0.0) {
+                m_segmentSeconds.push_back(file.seconds);
+                ok = WritePlaylist(false);
+            }
+        }
+
+        guard.lock();
+        // Whatever is still queued is dropped with the failure.
+        if (!ok) {
+            m_segmentFailed = true;
+            m_segmentQueue.clear();
+        }
+        m_segmentCond.notify_all();
+    }
+}
+
+bool FragmentedMP4Container::WriteFile(const SegmentFile &file)
+{
+    std::string path = (std::filesystem::path(m_dir) / file.name).string();
+    FILE *out = fopen(path.c_str(), "wb");
+    if (!out) {
+        g_Log(logLevelError, "VAAPI :: Failed to create %s", path.c_str());
+        return false;
+    }
+
+    bool ok = fwrite(file.header.data(), 1, file.header.size(), out) == file.header.size() &&
+        fwrite(file.payload.data(), 1, file.payload.size(), out) == file.payload.size();
+    ok = fclose(out) == 0 && ok;
+    if (!ok)
+        g_Log(logLevelError, "VAAPI :: Failed to write %s", path.c_str());
+    return ok;
+}
+
+bool FragmentedMP4Container::WritePlaylist(bool ended)
+{
+    double longest = 0.0;
+    for (double seconds : m_segmentSeconds)
+        longest = std::max(longest, seconds);
+
+    // Players may read it at any time, so it's replaced rather than rewritten.
+    std::string tmpPath = m_path + ".tmp";
+    FILE *file = fopen(tmpPath.c_str(), "w");
+    if (!file) {
+        g_Log(logLevelError, "VAAPI :: Failed to write playlist %s", tmpPath.c_str());
+        return false;
+    }
+
+    fprintf(file, "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:0\n"
+                  "#EXT-X-PLAYLIST-TYPE:EVENT\n#EXT-X-INDEPENDENT-SEGMENTS\n#EXT-X-MAP:URI=\"%s_init.mp4\"\n",
+            static_cast<int>(std::ceil(longest)), m_baseName.c_str());
+    for (size_t i = 0; i < m_segmentSeconds.size(); i++)
+        fprintf(file, "#EXTINF:%.6f,\n%s_%05zu.m4s\n", m_segmentSeconds[i], m_baseName.c_str(), i + 1);
+    if (ended)
+        fprintf(file, "#EXT-X-ENDLIST\n");
+
+    bool ok = fclose(file) == 0;
+    if (!ok || rename(tmpPath.c_str(), m_path.c_str()) != 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to replace %s", m_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+StatusCode FragmentedMP4Container::DoClose()
+{
+    if (m_segmented) {
+        if (!m_started)
+            return StopSegmentThread() ? errNone : errFail;
+        bool ok = !m_failed && WriteFragment() && QueueSegmentFile({ std::string(), {}, {}, 0.0 });
+        ok = StopSegmentThread() && ok;
+        g_Log(logLevelInfo, "VAAPI :: Wrote %u CMAF segments", m_sequence);
+        m_started = false;
+        return ok ? errNone : errFail;
+    }
+
+    if (!m_file.IsOpen())
+        return errNone;
+
+    // The last sample keeps the duration of one frame.
+    bool ok = !m_failed && WriteFragment();
+    ok = m_file.Close() && ok;
+    // Only a render that got to its end has nothing left to resume.
+    if (ok && m_ended && m_journal)
+        m_journal->Remove();
+
+    g_Log(logLevelInfo, "VAAPI :: Fragmented MP4 closed after %u fragments", m_sequence);
+    return ok ? errNone : errFail;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_file_writer.h"
+#include "checkpoint.h"
+#include "mp4_boxes.h"
+#include "wrapper/plugin_api.h"
+
+using namespace IOPlugin;
+
+// Fragmented MP4 with a single video track. The moov only describes the
+// track and is written before the first sample; samples go out in moof/mdat
+// fragments of about a second each, so closing the file only flushes the
+// last fragment instead of rewriting a sample table.
+//
+// The segmented variant writes the init segment and each fragment to files
+// of their own next to an HLS playlist, which is rewritten after every
+// segment. Segments are cut at keyframes only, so each one is a
+// self-contained CMAF segment. Those files and the playlist are written by
+// a thread of their own, so the encoder only waits when it gets ahead of
+// the disk by several segments.
+class FragmentedMP4Container : public IPluginContainerRef
+{
+public:
+    // Segment length the encoder aligns its GOP to.
+    static constexpr uint32_t SegmentSeconds = 2;
+
+    static FragmentedMP4Container *Create(const uint8_t *uuid);
+    static StatusCode Register(HostListRef *p_pList);
+    // Entries that select the single file and the segmented container in a
+    // codec's pIOPropContainerList.
+    static const std::string &GetId();
+    static const std::string &GetSegmentedId();
+
+    // Called by the track, p_pBuf is NULL at the end of the stream.
+    StatusCode WriteSample(HostBufferRef *p_pBuf);
+
+private:
+    explicit FragmentedMP4Container(bool segmented);
+    ~FragmentedMP4Container();
+
+    StatusCode DoInit(HostPropertyCollectionRef *p_pProps) override;
+    StatusCode DoOpen(HostPropertyCollectionRef *p_pProps) override;
+    StatusCode DoAddTrack(HostPropertyCollectionRef *p_pProps, HostPropertyCollectionRef *p_pCodecProps,
+                          IPluginTrackBase **p_pTrack) override;
+    StatusCode DoClose() override;
+
+    // Segmented only: a file to write on the segment thread, with the
+    // playlist replaced after it. No name only ends the playlist.
+    struct SegmentFile
+    {
+        std::string name;
+        std::vector<uint8_t> header;
+        std::vector<uint8_t> payload;
+        double seconds; // 0 for the init segment
+    };
+
+    bool WriteFragment();
+    // Segmented only.
+    bool QueueSegmentFile(SegmentFile file);
+    // Waits for the queued files, returns false if any write failed.
+    bool StopSegmentThread();
+    void SegmentThread();
+    bool WriteFile(const SegmentFile &file);
+    bool WritePlaylist(bool ended);
+
+    const bool m_segmented;
+    std::string m_path;
+    AsyncFileWriter m_file;
+    bool m_hasTrack = false;
+    bool m_started = false;
+    bool m_ended = false;
+    bool m_failed = false;
+
+    // Single file only.
+    std::shared_ptr<CheckpointJournal> m_journal;
+    int64_t m_nextCheckpointPts = INT64_MIN;
+
+    Mp4TrackInfo m_track = {};
+    uint32_t m_frameTicks = 0; // sample duration in timescale units
+
+    int64_t m_firstDts = 0;
+    int64_t m_lastDts = 0; // ticks
+    uint64_t m_fragmentStart = 0;
+    uint32_t m_sequence = 0;
+    std::vector<Mp4Sample> m_samples;
+    std::vector<uint8_t> m_payload;
+    std::vector<uint8_t> m_header;
+
+    // Segmented only: output names relative to the playlist.
+    std::string m_dir;
+    std::string m_baseName;
+    std::thread m_segmentThread;
+    std::mutex m_segmentLock;
+    std::condition_variable m_segmentCond;
+    std::deque<SegmentFile> m_segmentQueue;
+    bool m_segmentStop = false;
+    bool m_segmentFailed = false;
+    // Segment thread only.
+    std::vector<double> m_segmentSeconds;
+};
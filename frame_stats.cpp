@@ -0,0 +1,149 @@
+#include "frame_stats.h"
+
+#include <algorithm>
+
+#include "wrapper/host_api.h"
+
+static constexpr size_t RingSize = 8192;
+
+FrameStatsWriter::~FrameStatsWriter()
+{
+    Close();
+}
+
+bool FrameStatsWriter::Open(const std::string &path)
+{
+    m_file = fopen(path.c_str(), "w");
+    if (!m_file) {
+        g_Log(logLevelError, "VAAPI :: Failed to open frame statistics %s", path.c_str());
+        return false;
+    }
+
+    setvbuf(m_file, nullptr, _IOFBF, 1 << 20);
+    fputs("pts,dts,size,key,type,qp,latency_us\n", m_file);
+
+    m_ring.resize(RingSize);
+    m_stop = false;
+    m_head = 0;
+    m_tail = 0;
+    m_thread = std::thread(&FrameStatsWriter::WriterThread, this);
+    return true;
+}
+
+void FrameStatsWriter::Push(const FrameStatsRow &row)
+{
+    if (!m_file)
+        return;
+
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail.load(std::memory_order_acquire) >= m_ring.size()) {
+        m_dropped++;
+        return;
+    }
+
+    m_ring[head % m_ring.size()] = row;
+    m_head.store(head + 1, std::memory_order_release);
+
+    // Taking the lock orders the store before the writer's check, so the
+    // wakeup can't be lost.
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+    }
+    m_cond.notify_one();
+}
+
+void FrameStatsWriter::Close()
+{
+    if (!m_file)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_cond.notify_one();
+    if (m_thread.joinable())
+        m_thread.join();
+
+    fclose(m_file);
+    m_file = nullptr;
+
+    if (m_dropped)
+        g_Log(logLevelWarn, "VAAPI :: Dropped %llu frame statistics rows", static_cast<unsigned long long>(m_dropped));
+}
+
+void FrameStatsWriter::WriterThread()
+{
+    while (true) {
+        bool stop;
+        {
+            std::unique_lock<std::mutex> guard(m_lock);
+            m_cond.wait(guard, [this] {
+                return m_stop || m_head.load(std::memory_order_relaxed) != m_tail.load(std::memory_order_relaxed);
+            });
+            stop = m_stop;
+        }
+
+        uint64_t head = m_head.load(std::memory_order_acquire);
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        for (; tail != head; ++tail) {
+            WriteRow(m_ring[tail % m_ring.size()]);
+            m_tail.store(tail + 1, std::memory_order_release);
+        }
+
+        if (stop)
+            break;
+    }
+}
+
+void FrameStatsWriter::WriteRow(const FrameStatsRow &row)
+{
+    fprintf(m_file, "%lld,%lld,%u,%u,", static_cast<long long>(row.pts), static_cast<long long>(row.dts),
+            row.size, row.isKeyFrame);
+    fputc(row.pictType, m_file);
+    fputc(',', m_file);
+    if (row.qp >= 0.0f)
+        fprintf(m_file, "%.2f", row.qp);
+    fprintf(m_file, ",%llu\n", static_cast<unsigned long long>(row.latencyUs));
+}
+
+uint32_t LatencyHistogram::GetBucket(uint64_t us)
+{
+    if (us < (1u << SubBits))
+        return static_cast<uint32_t>(us);
+    uint32_t exponent = 63 - __builtin_clzll(us);
+    uint32_t sub = (us >> (exponent - SubBits)) & ((1u << SubBits) - 1);
+    return (exponent - SubBits + 1) << SubBits | sub;
+}
+
+uint64_t LatencyHistogram::GetUpperBound(uint32_t bucket)
+{
+    if (bucket < (1u << SubBits))
+        return bucket;
+    uint32_t exponent = (bucket >> SubBits) + SubBits - 1;
+    uint64_t sub = bucket & ((1u << SubBits) - 1);
+    uint32_t shift = exponent - SubBits;
+    return (((1ull << SubBits) + sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::Add(uint64_t us)
+{
+    m_buckets[GetBucket(us)]++;
+    m_count++;
+    m_max = std::max(m_max, us);
+}
+
+uint64_t LatencyHistogram::GetPercentile(double p) const
+{
+    if (!m_count)
+        return 0;
+
+    uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * m_count + 0.5));
+    uint64_t seen = 0;
+    for (uint32_t bucket = 0; bucket < m_buckets.size(); bucket++) {
+        seen += m_buckets[bucket];
+        if (seen >= rank)
+            return std::min(GetUpperBound(bucket), m_max);
+    }
+    return m_max;
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct FrameStatsRow
+{
+    int64_t pts;
+    int64_t dts;
+    uint32_t size;
+    uint8_t isKeyFrame;
+    char pictType; // 'I', 'P' or 'B'
+    float qp; // negative when the plugin didn't pick the frame's QP
+    uint64_t latencyUs;
+};
+
+// Remembers a value per PTS, such as when it was submitted to the encoder,
+// in a fixed table so the per-frame path never allocates. Entries are
+// overwritten once more frames than the table size are in flight.
+template <typename T>
+class PtsTable
+{
+public:
+    void Set(int64_t pts, T value)
+    {
+        Slot &slot = m_slots[static_cast<uint64_t>(pts) % m_slots.size()];
+        slot.pts = pts;
+        slot.value = value;
+    }
+
+    bool Get(int64_t pts, T &value) const
+    {
+        const Slot &slot = m_slots[static_cast<uint64_t>(pts) % m_slots.size()];
+        if (slot.pts != pts)
+            return false;
+        value = slot.value;
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        int64_t pts = INT64_MIN;
+        T value = {};
+    };
+    std::array<Slot, 512> m_slots;
+};
+
+using PtsClock = PtsTable<uint64_t>;
+
+// Log-linear histogram of latencies in microseconds, 16 linear buckets per
+// power of two, so percentiles are within about 6% of the true value.
+class LatencyHistogram
+{
+public:
+    void Add(uint64_t us);
+    // p in 0..1, returns the upper bound of the bucket holding it.
+    uint64_t GetPercentile(double p) const;
+
+    uint64_t GetCount() const
+    {
+        return m_count;
+    }
+    uint64_t GetMax() const
+    {
+        return m_max;
+    }
+
+private:
+    static constexpr uint32_t SubBits = 4;
+
+    static uint32_t GetBucket(uint64_t us);
+    static uint64_t GetUpperBound(uint32_t bucket);
+
+    std::array<uint64_t, 64 << SubBits> m_buckets = {};
+    uint64_t m_count = 0;
+    uint64_t m_max = 0;
+};
+
+// Per-frame CSV sidecar. Push() copies the row into a preallocated
+// single-producer ring and wakes a background thread that drains it into a
+// buffered file.
+class FrameStatsWriter
+{
+public:
+    ~FrameStatsWriter();
+
+    bool Open(const std::string &path);
+    void Push(const FrameStatsRow &row);
+    void Close();
+
+private:
+    void WriterThread();
+    void WriteRow(const FrameStatsRow &row);
+
+    FILE *m_file = nullptr;
+    std::vector<FrameStatsRow> m_ring;
+    std::atomic<uint64_t> m_head = 0;
+    std::atomic<uint64_t> m_tail = 0;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    bool m_stop = false;
+    uint64_t m_dropped = 0;
+    std::thread m_thread;
+};
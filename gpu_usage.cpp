@@ -0,0 +1,212 @@
+#include "gpu_usage.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+static uint64_t SteadyNs()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+static bool ReadFile(const std::string &path, std::string &text)
+{
+    std::ifstream file(path);
+    if (!file)
+        return false;
+    std::stringstream stream;
+    stream << file.rdbuf();
+    text = stream.str();
+    return true;
+}
+
+FdinfoUsageSource::FdinfoUsageSource(const std::string &path)
+    : m_path(path)
+{
+}
+
+bool FdinfoUsageSource::Parse(const std::string &text, Counters &counters)
+{
+    static const char *busyKeys[] = { "drm-engine-enc", "drm-engine-video", "drm-engine-vcn" };
+    static const char CapacityKey[] = "drm-engine-capacity-";
+
+    counters = Counters();
+
+    // Engine classes that counted, and how many engines each has. A class
+    // without a drm-engine-capacity line has a single engine.
+    std::vector<std::pair<std::string, uint64_t>> classes;
+    auto addClass = [&classes](const std::string &name) {
+        for (auto &engineClass : classes) {
+            if (engineClass.first == name)
+                return;
+        }
+        classes.emplace_back(name, 1);
+    };
+    std::vector<std::pair<std::string, uint64_t>> capacities;
+
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string key = line.substr(0, colon);
+        uint64_t value = strtoull(line.c_str() + colon + 1, nullptr, 10);
+
+        if (key.rfind(CapacityKey, 0) == 0) {
+            capacities.emplace_back(key.substr(sizeof(CapacityKey) - 1), value);
+        } else if (key.rfind("drm-cycles-vcs", 0) == 0) {
+            counters.busy += value;
+            addClass(key.substr(strlen("drm-cycles-")));
+        } else if (key.rfind("drm-total-cycles-vcs", 0) == 0) {
+            counters.total += value;
+        } else {
+            for (const char *busyKey : busyKeys) {
+                // Matches enc, enc_1, video, video1 and so on, but not video-enhance.
+                size_t len = strlen(busyKey);
+                if (key.rfind(busyKey, 0) == 0 && (key.size() == len || isdigit(key[len]) || key[len] == '_')) {
+                    counters.busy += value;
+                    addClass(key.substr(strlen("drm-engine-")));
+                    break;
+                }
+            }
+        }
+    }
+
+    for (auto &engineClass : classes) {
+        for (const auto &capacity : capacities) {
+            if (capacity.first == engineClass.first && capacity.second)
+                engineClass.second = capacity.second;
+        }
+        counters.engines += engineClass.second;
+    }
+
+    return counters.engines > 0;
+}
+
+bool FdinfoUsageSource::Sample(uint64_t timeNs, double &utilization)
+{
+    std::string text;
+    Counters counters;
+    if (!ReadFile(m_path, text) || !Parse(text, counters))
+        return false;
+
+    bool haveDelta = m_havePrevious;
+    if (haveDelta) {
+        uint64_t busy = counters.busy - m_previous.busy;
+        uint64_t total = counters.total ? counters.total - m_previous.total : timeNs - m_previousTime;
+        utilization = total ? static_cast<double>(busy) / (static_cast<double>(total) * counters.engines) : 0.0;
+    }
+
+    m_previous = counters;
+    m_previousTime = timeNs;
+    m_havePrevious = true;
+    return haveDelta;
+}
+
+SysfsUsageSource::SysfsUsageSource(const std::string &path)
+    : m_path(path)
+{
+}
+
+bool SysfsUsageSource::Sample(uint64_t timeNs, double &utilization)
+{
+    std::string text;
+    if (!ReadFile(m_path, text) || text.empty())
+        return false;
+    utilization = std::min(100L, std::max(0L, strtol(text.c_str(), nullptr, 10))) / 100.0;
+    return true;
+}
+
+EngineUsageSampler::~EngineUsageSampler()
+{
+    Stop();
+}
+
+std::vector<int> EngineUsageSampler::ListDeviceFds(const std::string &devicePath)
+{
+    std::vector<int> fds;
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator("/proc/self/fd", ec)) {
+        std::filesystem::path target = std::filesystem::read_symlink(entry.path(), ec);
+        if (!ec && target == devicePath)
+            fds.push_back(atoi(entry.path().filename().c_str()));
+    }
+    return fds;
+}
+
+std::unique_ptr<EngineUsageSource> EngineUsageSampler::CreateSource(const std::string &devicePath, int fd)
+{
+    if (fd >= 0) {
+        std::string path = "/proc/self/fdinfo/" + std::to_string(fd);
+        std::string text;
+        FdinfoUsageSource::Counters counters;
+        if (ReadFile(path, text) && FdinfoUsageSource::Parse(text, counters))
+            return std::make_unique<FdinfoUsageSource>(path);
+    }
+
+    struct stat st;
+    if (stat(devicePath.c_str(), &st) == 0) {
+        std::string path = "/sys/dev/char/" + std::to_string(major(st.st_rdev)) + ":" +
+            std::to_string(minor(st.st_rdev)) + "/device/gpu_busy_percent";
+        if (access(path.c_str(), R_OK) == 0)
+            return std::make_unique<SysfsUsageSource>(path);
+    }
+
+    return nullptr;
+}
+
+void EngineUsageSampler::Start(std::unique_ptr<EngineUsageSource> source)
+{
+    Stop();
+    if (!source)
+        return;
+
+    m_source = std::move(source);
+    m_stop = false;
+    m_samples = 0;
+    m_sum = 0.0;
+    m_peak = 0.0;
+    m_thread = std::thread(&EngineUsageSampler::SamplerThread, this);
+}
+
+void EngineUsageSampler::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+const char *EngineUsageSampler::GetSourceName() const
+{
+    return m_source ? m_source->GetName() : "none";
+}
+
+void EngineUsageSampler::SamplerThread()
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    double utilization = 0.0;
+    m_source->Sample(SteadyNs(), utilization);
+
+    while (!m_cond.wait_for(guard, std::chrono::milliseconds(250), [this] { return m_stop; })) {
+        if (!m_source->Sample(SteadyNs(), utilization))
+            continue;
+        m_samples++;
+        m_sum += utilization;
+        m_peak = std::max(m_peak, utilization);
+    }
+}
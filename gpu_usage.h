@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+
+// A source of encode engine utilization. Sample() returns the busy fraction
+// (0..1) since the previous call, or false when the counters can't be read.
+class EngineUsageSource
+{
+public:
+    virtual ~EngineUsageSource() = default;
+
+    virtual bool Sample(uint64_t timeNs, double &utilization) = 0;
+    virtual const char *GetName() const = 0;
+};
+
+// DRM fdinfo (Documentation/gpu/drm-usage-stats.rst) of the plugin's own
+// device fd. Uses drm-engine-<enc|video|vcn> busy nanoseconds or xe style
+// drm-cycles-vcs/drm-total-cycles-vcs pairs. Busy time is summed over all
+// instances of those engines and divided by their count, so two engines
+// that are both fully busy read as 1.
+class FdinfoUsageSource : public EngineUsageSource
+{
+public:
+    struct Counters
+    {
+        uint64_t busy = 0;
+        uint64_t total = 0; // 0 when busy is in nanoseconds
+        uint32_t engines = 0;
+    };
+
+    explicit FdinfoUsageSource(const std::string &path);
+
+    bool Sample(uint64_t timeNs, double &utilization) override;
+    const char *GetName() const override
+    {
+        return "fdinfo";
+    }
+
+    static bool Parse(const std::string &text, Counters &counters);
+
+private:
+    std::string m_path;
+    bool m_havePrevious = false;
+    Counters m_previous;
+    uint64_t m_previousTime = 0;
+};
+
+// Driver sysfs file holding an instantaneous busy percentage, such as
+// amdgpu's device/gpu_busy_percent. Covers the whole GPU, not just the
+// encode engine.
+class SysfsUsageSource : public EngineUsageSource
+{
+public:
+    explicit SysfsUsageSource(const std::string &path);
+
+    bool Sample(uint64_t timeNs, double &utilization) override;
+    const char *GetName() const override
+    {
+        return "sysfs";
+    }
+
+private:
+    std::string m_path;
+};
+
+class EngineUsageSampler
+{
+public:
+    ~EngineUsageSampler();
+
+    // Lists the fds of this process that point at devicePath.
+    static std::vector<int> ListDeviceFds(const std::string &devicePath);
+    // Picks fdinfo of the given fd, falling back to the device's sysfs counters.
+    static std::unique_ptr<EngineUsageSource> CreateSource(const std::string &devicePath, int fd);
+
+    void Start(std::unique_ptr<EngineUsageSource> source);
+    void Stop();
+
+    const char *GetSourceName() const;
+    bool HasSamples() const
+    {
+        return m_samples > 0;
+    }
+    double GetAverage() const
+    {
+        return m_samples ? m_sum / m_samples : 0.0;
+    }
+    double GetPeak() const
+    {
+        return m_peak;
+    }
+
+private:
+    void SamplerThread();
+
+    std::unique_ptr<EngineUsageSource> m_source;
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    bool m_stop = false;
+    uint64_t m_samples = 0;
+    double m_sum = 0.0;
+    double m_peak = 0.0;
+};
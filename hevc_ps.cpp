@@ -0,0 +1,398 @@
+#include "hevc_ps.h"
+
+#include <algorithm>
+
+#include "bit_reader.h"
+
+std::vector<uint8_t> HEVCNalToRBSP(const uint8_t *nal, size_t size)
+{
+    std::vector<uint8_t> rbsp;
+    rbsp.reserve(size);
+    uint32_t zeros = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (zeros >= 2 && nal[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nal[i] ? 0 : zeros + 1;
+        rbsp.push_back(nal[i]);
+    }
+    return rbsp;
+}
+
+static void ReadProfileTierLevel(BitReader &reader, uint32_t maxSubLayersMinus1, HEVCConfigInfo &info)
+{
+    info.profileSpace = reader.ReadBits(2);
+    info.tierFlag = reader.ReadBit();
+    info.profileIdc = reader.ReadBits(5);
+    info.profileCompatibilityFlags = reader.ReadBits(32);
+    info.constraintIndicatorFlags = uint64_t(reader.ReadBits(16)) << 32 | reader.ReadBits(32);
+    info.levelIdc = reader.ReadBits(8);
+
+    bool profilePresent[8] = {};
+    bool levelPresent[8] = {};
+    for (uint32_t i = 0; i < maxSubLayersMinus1; i++) {
+        profilePresent[i] = reader.ReadBit();
+        levelPresent[i] = reader.ReadBit();
+    }
+    if (maxSubLayersMinus1 > 0)
+        reader.Skip((8 - maxSubLayersMinus1) * 2);
+    for (uint32_t i = 0; i < maxSubLayersMinus1; i++) {
+        if (profilePresent[i])
+            reader.Skip(88);
+        if (levelPresent[i])
+            reader.Skip(8);
+    }
+}
+
+static void SkipScalingListData(BitReader &reader)
+{
+    for (uint32_t sizeId = 0; sizeId < 4; sizeId++) {
+        for (uint32_t matrixId = 0; matrixId < 6; matrixId += sizeId == 3 ? 3 : 1) {
+            if (!reader.ReadBit()) { // scaling_list_pred_mode_flag
+                reader.ReadUE();
+                continue;
+            }
+            uint32_t coefficients = std::min(64u, 1u << (4 + (sizeId << 1)));
+            if (sizeId > 1)
+                reader.ReadSE();
+            for (uint32_t i = 0; i < coefficients && !reader.IsOverrun(); i++)
+                reader.ReadSE();
+        }
+    }
+}
+
+// Returns NumDeltaPocs of the set, which a predicted set after it needs.
+static uint32_t SkipShortTermRefPicSet(BitReader &reader, uint32_t index, const std::vector<uint32_t> &numDeltaPocs)
+{
+    if (index && reader.ReadBit()) { // inter_ref_pic_set_prediction_flag
+        reader.Skip(1); // delta_rps_sign
+        reader.ReadUE();
+        // In the SPS a set can only be predicted from the one before it.
+        uint32_t count = 0;
+        for (uint32_t j = 0; j <= numDeltaPocs[index - 1] && !reader.IsOverrun(); j++) {
+            bool usedByCurrPic = reader.ReadBit();
+            if (usedByCurrPic || reader.ReadBit())
+                count++;
+        }
+        return count;
+    }
+
+    uint32_t negative = reader.ReadUE();
+    uint32_t positive = reader.ReadUE();
+    if (negative > 16 || positive > 16) {
+        reader.Invalidate();
+        return 0;
+    }
+    for (uint32_t i = 0; i < negative + positive; i++) {
+        reader.ReadUE();
+        reader.Skip(1);
+    }
+    return negative + positive;
+}
+
+// Keeps the first CPB's values, SchedSelIdx 0.
+static void ReadSubLayerHrdParameters(BitReader &reader, uint32_t cpbCount, bool subPicParams, HEVCHrdInfo &hrd)
+{
+    for (uint32_t i = 0; i < cpbCount && !reader.IsOverrun(); i++) {
+        uint32_t bitRateValueMinus1 = reader.ReadUE();
+        uint32_t cpbSizeValueMinus1 = reader.ReadUE();
+        if (subPicParams) {
+            reader.ReadUE();
+            reader.ReadUE();
+        }
+        bool cbr = reader.ReadBit();
+        if (i == 0) {
+            hrd.bitRate = uint64_t(bitRateValueMinus1 + 1) << (6 + hrd.bitRateScale);
+            hrd.cpbSize = uint64_t(cpbSizeValueMinus1 + 1) << (4 + hrd.cpbSizeScale);
+            hrd.cbr = cbr;
+        }
+    }
+}
+
+// Ends up with the values of the highest sub-layer, NAL over VCL.
+static void ReadHrdParameters(BitReader &reader, uint32_t maxSubLayersMinus1, HEVCHrdInfo &hrd)
+{
+    bool nalHrd = reader.ReadBit();
+    bool vclHrd = reader.ReadBit();
+    bool subPicParams = false;
+    if (nalHrd || vclHrd) {
+        subPicParams = reader.ReadBit();
+        if (subPicParams)
+            reader.Skip(8 + 5 + 1 + 5);
+        hrd.bitRateScale = reader.ReadBits(4);
+        hrd.cpbSizeScale = reader.ReadBits(4);
+        if (subPicParams)
+            reader.Skip(4);
+        reader.Skip(5 + 5 + 5);
+    }
+
+    for (uint32_t i = 0; i <= maxSubLayersMinus1; i++) {
+        bool fixedPicRate = reader.ReadBit() || reader.ReadBit(); // general, else within CVS
+        bool lowDelay = false;
+        if (fixedPicRate)
+            reader.ReadUE();
+        else
+            lowDelay = reader.ReadBit();
+        uint32_t cpbCount = lowDelay ? 1 : reader.ReadUE() + 1;
+        if (cpbCount > 32) {
+            reader.Invalidate();
+            return;
+        }
+        hrd.lowDelay = lowDelay;
+        HEVCHrdInfo vcl = hrd;
+        if (nalHrd)
+            ReadSubLayerHrdParameters(reader, cpbCount, subPicParams, hrd);
+        if (vclHrd)
+            ReadSubLayerHrdParameters(reader, cpbCount, subPicParams, nalHrd ? vcl : hrd);
+    }
+}
+
+static void ReadVui(BitReader &reader, uint32_t maxSubLayersMinus1, HEVCConfigInfo &info, HEVCHrdInfo &hrd)
+{
+    if (reader.ReadBit() && reader.ReadBits(8) == 255) // aspect_ratio_idc, EXTENDED_SAR
+        reader.Skip(32);
+    if (reader.ReadBit()) // overscan_info_present_flag
+        reader.Skip(1);
+    if (reader.ReadBit()) { // video_signal_type_present_flag
+        reader.Skip(3 + 1);
+        if (reader.ReadBit())
+            reader.Skip(24);
+    }
+    if (reader.ReadBit()) { // chroma_loc_info_present_flag
+        reader.ReadUE();
+        reader.ReadUE();
+    }
+    reader.Skip(3); // neutral_chroma_indication, field_seq, frame_field_info_present
+    if (reader.ReadBit()) { // default_display_window_flag
+        for (int i = 0; i < 4; i++)
+            reader.ReadUE();
+    }
+    if (reader.ReadBit()) { // vui_timing_info_present_flag
+        reader.Skip(64);
+        if (reader.ReadBit())
+            reader.ReadUE();
+        hrd.present = reader.ReadBit(); // vui_hrd_parameters_present_flag
+        if (hrd.present)
+            ReadHrdParameters(reader, maxSubLayersMinus1, hrd);
+    }
+    if (reader.ReadBit()) { // bitstream_restriction_flag
+        reader.Skip(3);
+        info.minSpatialSegmentationIdc = std::min<uint32_t>(reader.ReadUE(), 4095);
+    }
+}
+
+bool ParseHEVCVPS(const uint8_t *nal, size_t size, HEVCConfigInfo &info)
+{
+    std::vector<uint8_t> rbsp = HEVCNalToRBSP(nal, size);
+    BitReader reader(rbsp.data(), rbsp.size());
+    reader.Skip(16 + 4 + 2 + 6); // NAL header, vps id, base layer flags, vps_max_layers_minus1
+    uint32_t maxSubLayers = reader.ReadBits(3) + 1;
+    if (reader.IsOverrun())
+        return false;
+
+    info.numTemporalLayers = std::max<uint8_t>(info.numTemporalLayers, maxSubLayers);
+    return true;
+}
+
+bool ParseHEVCSPS(const uint8_t *nal, size_t size, HEVCConfigInfo &info, HEVCHrdInfo *hrdOut)
+{
+    std::vector<uint8_t> rbsp = HEVCNalToRBSP(nal, size);
+    BitReader reader(rbsp.data(), rbsp.size());
+    reader.Skip(16 + 4); // NAL header, sps_video_parameter_set_id
+    uint32_t maxSubLayersMinus1 = reader.ReadBits(3);
+    info.temporalIdNested = reader.ReadBit();
+    info.numTemporalLayers = std::max<uint8_t>(info.numTemporalLayers, maxSubLayersMinus1 + 1);
+    ReadProfileTierLevel(reader, maxSubLayersMinus1, info);
+
+    reader.ReadUE(); // sps_seq_parameter_set_id
+    info.chromaFormatIdc = std::min<uint32_t>(reader.ReadUE(), 3);
+    if (info.chromaFormatIdc == 3)
+        reader.Skip(1);
+    reader.ReadUE(); // pic_width_in_luma_samples
+    reader.ReadUE();
+    if (reader.ReadBit()) { // conformance_window_flag
+        for (int i = 0; i < 4; i++)
+            reader.ReadUE();
+    }
+    info.bitDepthLuma = std::min<uint32_t>(reader.ReadUE(), 8) + 8;
+    info.bitDepthChroma = std::min<uint32_t>(reader.ReadUE(), 8) + 8;
+    uint32_t log2MaxPocLsb = reader.ReadUE() + 4;
+
+    bool subLayerOrderingInfo = reader.ReadBit();
+    for (uint32_t i = subLayerOrderingInfo ? 0 : maxSubLayersMinus1; i <= maxSubLayersMinus1; i++) {
+        reader.ReadUE();
+        reader.ReadUE();
+        reader.ReadUE();
+    }
+    for (int i = 0; i < 6; i++) // coding and transform block sizes, hierarchy depths
+        reader.ReadUE();
+
+    if (reader.ReadBit() && reader.ReadBit()) // scaling_list_enabled_flag, sps_scaling_list_data_present_flag
+        SkipScalingListData(reader);
+    reader.Skip(2); // amp_enabled_flag, sample_adaptive_offset_enabled_flag
+    if (reader.ReadBit()) { // pcm_enabled_flag
+        reader.Skip(4 + 4);
+        reader.ReadUE();
+        reader.ReadUE();
+        reader.Skip(1);
+    }
+
+    uint32_t shortTermRefPicSets = reader.ReadUE();
+    if (shortTermRefPicSets > 64)
+        return false;
+    std::vector<uint32_t> numDeltaPocs(shortTermRefPicSets);
+    for (uint32_t i = 0; i < shortTermRefPicSets && !reader.IsOverrun(); i++)
+        numDeltaPocs[i] = SkipShortTermRefPicSet(reader, i, numDeltaPocs);
+
+    if (reader.ReadBit()) { // long_term_ref_pics_present_flag
+        uint32_t longTermRefPics = reader.ReadUE();
+        if (longTermRefPics > 32)
+            return false;
+        for (uint32_t i = 0; i < longTermRefPics; i++)
+            reader.Skip(log2MaxPocLsb + 1);
+    }
+    reader.Skip(2); // sps_temporal_mvp_enabled_flag, strong_intra_smoothing_enabled_flag
+
+    info.minSpatialSegmentationIdc = 0;
+    HEVCHrdInfo hrd;
+    if (reader.ReadBit())
+        ReadVui(reader, maxSubLayersMinus1, info, hrd);
+    if (hrdOut)
+        *hrdOut = hrd;
+
+    return !reader.IsOverrun();
+}
+
+bool ParseHEVCPPS(const uint8_t *nal, size_t size, HEVCConfigInfo &info)
+{
+    std::vector<uint8_t> rbsp = HEVCNalToRBSP(nal, size);
+    BitReader reader(rbsp.data(), rbsp.size());
+    reader.Skip(16);
+    reader.ReadUE(); // pps_pic_parameter_set_id
+    reader.ReadUE();
+    reader.Skip(1 + 1 + 3 + 1 + 1); // dependent slices, output flag, extra bits, sign hiding, cabac init
+    reader.ReadUE(); // num_ref_idx_l0_default_active_minus1
+    reader.ReadUE();
+    reader.ReadSE(); // init_qp_minus26
+    reader.Skip(2); // constrained_intra_pred_flag, transform_skip_enabled_flag
+    if (reader.ReadBit()) // cu_qp_delta_enabled_flag
+        reader.ReadUE();
+    reader.ReadSE(); // pps_cb_qp_offset
+    reader.ReadSE();
+    reader.Skip(4); // chroma QP offsets present, weighted pred, weighted bipred, transquant bypass
+    bool tiles = reader.ReadBit();
+    bool entropyCodingSync = reader.ReadBit();
+    if (reader.IsOverrun())
+        return false;
+
+    info.tilesEnabled = info.tilesEnabled || tiles;
+    info.entropyCodingSync = info.entropyCodingSync || entropyCodingSync;
+    return true;
+}
+
+uint8_t GetHEVCParallelismType(const HEVCConfigInfo &info)
+{
+    // The type says how the min_spatial_segmentation_idc restriction is
+    // met, so it means nothing without one.
+    if (!info.minSpatialSegmentationIdc || (info.tilesEnabled && info.entropyCodingSync))
+        return 0;
+    if (info.entropyCodingSync)
+        return 3;
+    if (info.tilesEnabled)
+        return 2;
+    return 1;
+}
+
+bool BuildHEVCConfigRecord(const uint8_t *data, size_t size, uint32_t frameRateNum, uint32_t frameRateDen,
+                           std::vector<uint8_t> &record)
+{
+    if (!data || size < 6)
+        return false;
+
+    // VPS, SPS and PPS, in the order the arrays go into the record.
+    std::vector<std::vector<uint8_t>> arrays[3];
+    size_t offset = 0;
+    while (offset + 4 < size) {
+        size_t startCodeSize = 0;
+        if (data[offset] == 0 && data[offset + 1] == 0 && data[offset + 2] == 1)
+            startCodeSize = 3;
+        else if (data[offset] == 0 && data[offset + 1] == 0 && data[offset + 2] == 0 && data[offset + 3] == 1)
+            startCodeSize = 4;
+        if (!startCodeSize) {
+            offset++;
+            continue;
+        }
+
+        size_t start = offset + startCodeSize;
+        size_t end = size;
+        for (size_t i = start; i + 3 < size; i++) {
+            if (data[i] == 0 && data[i + 1] == 0 && (data[i + 2] == 1 || (data[i + 2] == 0 && data[i + 3] == 1))) {
+                end = i;
+                break;
+            }
+        }
+        offset = end;
+        if (end <= start)
+            continue;
+
+        uint8_t type = data[start] >> 1 & 0x3F;
+        if (type >= 32 && type <= 34)
+            arrays[type - 32].emplace_back(data + start, data + end);
+    }
+
+    const std::vector<std::vector<uint8_t>> &vpsList = arrays[0];
+    const std::vector<std::vector<uint8_t>> &spsList = arrays[1];
+    const std::vector<std::vector<uint8_t>> &ppsList = arrays[2];
+    if (vpsList.empty() || spsList.empty() || ppsList.empty())
+        return false;
+
+    HEVCConfigInfo info;
+    for (const std::vector<uint8_t> &vps : vpsList)
+        ParseHEVCVPS(vps.data(), vps.size(), info);
+    if (!ParseHEVCSPS(spsList[0].data(), spsList[0].size(), info))
+        return false;
+    for (const std::vector<uint8_t> &pps : ppsList)
+        ParseHEVCPPS(pps.data(), pps.size(), info);
+
+    record.clear();
+    record.push_back(1); // configurationVersion
+    record.push_back(info.profileSpace << 6 | info.tierFlag << 5 | info.profileIdc);
+    for (int i = 3; i >= 0; i--)
+        record.push_back(info.profileCompatibilityFlags >> (i * 8) & 0xFF);
+    for (int i = 5; i >= 0; i--)
+        record.push_back(info.constraintIndicatorFlags >> (i * 8) & 0xFF);
+    record.push_back(info.levelIdc);
+
+    // Reserved bits are all ones.
+    record.push_back(0xF0 | info.minSpatialSegmentationIdc >> 8);
+    record.push_back(info.minSpatialSegmentationIdc & 0xFF);
+    record.push_back(0xFC | GetHEVCParallelismType(info));
+    record.push_back(0xFC | info.chromaFormatIdc);
+    record.push_back(0xF8 | ((info.bitDepthLuma - 8) & 0x07));
+    record.push_back(0xF8 | ((info.bitDepthChroma - 8) & 0x07));
+
+    // In frames per 256 seconds.
+    uint32_t avgFrameRate = 0;
+    if (frameRateNum > 0 && frameRateDen > 0)
+        avgFrameRate = std::min<uint64_t>((uint64_t(frameRateNum) * 256 + frameRateDen / 2) / frameRateDen, 0xFFFF);
+    record.push_back(avgFrameRate >> 8 & 0xFF);
+    record.push_back(avgFrameRate & 0xFF);
+
+    // constantFrameRate 1, numTemporalLayers, temporalIdNested, lengthSizeMinusOne 3.
+    record.push_back(1 << 6 | (info.numTemporalLayers & 0x07) << 3 | info.temporalIdNested << 2 | 3);
+
+    record.push_back(3); // numOfArrays
+    for (uint8_t type = 32; type <= 34; type++) {
+        const std::vector<std::vector<uint8_t>> &nals = arrays[type - 32];
+        record.push_back(0x80 | type); // array_completeness
+        record.push_back(nals.size() >> 8 & 0xFF); // numNalus
+        record.push_back(nals.size() & 0xFF);
+        for (const std::vector<uint8_t> &nal : nals) {
+            record.push_back(nal.size() >> 8 & 0xFF);
+            record.push_back(nal.size() & 0xFF);
+            record.insert(record.end(), nal.begin(), nal.end());
+        }
+    }
+    return true;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What the hvcC record needs from the HEVC parameter sets, merged across
+// the VPS, SPS and PPS it is parsed from.
+struct HEVCConfigInfo
+{
+    uint8_t profileSpace = 0;
+    uint8_t tierFlag = 0;
+    uint8_t profileIdc = 0;
+    uint32_t profileCompatibilityFlags = 0;
+    uint64_t constraintIndicatorFlags = 0; // 48 bits
+    uint8_t levelIdc = 0;
+    uint16_t minSpatialSegmentationIdc = 0;
+    uint8_t chromaFormatIdc = 1;
+    uint8_t bitDepthLuma = 8;
+    uint8_t bitDepthChroma = 8;
+    uint8_t numTemporalLayers = 1;
+    uint8_t temporalIdNested = 0;
+    bool tilesEnabled = false;
+    bool entropyCodingSync = false;
+};
+
+// The SPS VUI's HRD parameters, for the first CPB of the highest sub-layer.
+struct HEVCHrdInfo
+{
+    bool present = false; // vui_hrd_parameters_present_flag
+    uint8_t bitRateScale = 0;
+    uint8_t cpbSizeScale = 0;
+    bool lowDelay = false;
+    uint64_t bitRate = 0; // bits per second
+    uint64_t cpbSize = 0; // bits
+    bool cbr = false;
+};
+
+// NAL unit payload without the emulation prevention bytes.
+std::vector<uint8_t> HEVCNalToRBSP(const uint8_t *nal, size_t size);
+
+// Each takes a whole NAL unit, header included.
+bool ParseHEVCVPS(const uint8_t *nal, size_t size, HEVCConfigInfo &info);
+bool ParseHEVCSPS(const uint8_t *nal, size_t size, HEVCConfigInfo &info, HEVCHrdInfo *hrd = nullptr);
+bool ParseHEVCPPS(const uint8_t *nal, size_t size, HEVCConfigInfo &info);
+
+// hvcC parallelismType: 0 mixed or unknown, 1 slices, 2 tiles, 3 wavefront.
+uint8_t GetHEVCParallelismType(const HEVCConfigInfo &info);
+
+// Builds an hvcC record from Annex B VPS, SPS and PPS NAL units, such as the
+// encoder's extradata. The average frame rate is left at 0 without one.
+bool BuildHEVCConfigRecord(const uint8_t *data, size_t size, uint32_t frameRateNum, uint32_t frameRateDen,
+                           std::vector<uint8_t> &record);
@@ -0,0 +1,126 @@
+#include "keyframe_index.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#include "wrapper/host_api.h"
+
+static_assert(sizeof(KeyframeIndexWriter::Header) == 32, "index header layout");
+static_assert(sizeof(KeyframeIndexWriter::Entry) == 24, "index entry layout");
+
+static constexpr uint16_t IndexVersion = 1;
+
+std::mutex KeyframeIndexWriter::s_lock;
+std::map<std::string, std::weak_ptr<KeyframeIndexWriter>> KeyframeIndexWriter::s_writers;
+
+KeyframeIndexWriter::~KeyframeIndexWriter()
+{
+    Close();
+
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto it = s_writers.find(m_outputPath);
+    if (it != s_writers.end() && it->second.expired())
+        s_writers.erase(it);
+}
+
+std::shared_ptr<KeyframeIndexWriter> KeyframeIndexWriter::Create(const std::string &outputPath, bool everyFrame)
+{
+    std::shared_ptr<KeyframeIndexWriter> writer(new KeyframeIndexWriter());
+    writer->m_outputPath = outputPath;
+    writer->m_everyFrame = everyFrame;
+
+    std::lock_guard<std::mutex> guard(s_lock);
+    s_writers[outputPath] = writer;
+    return writer;
+}
+
+std::shared_ptr<KeyframeIndexWriter> KeyframeIndexWriter::Find(const std::string &outputPath)
+{
+    std::lock_guard<std::mutex> guard(s_lock);
+    auto it = s_writers.find(outputPath);
+    return it != s_writers.end() ? it->second.lock() : nullptr;
+}
+
+bool KeyframeIndexWriter::Open(uint32_t timeBaseNum, uint32_t timeBaseDen, uint64_t resumeOffset)
+{
+    Close();
+
+    std::string path = m_outputPath + ".idx";
+
+    Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "VKIX", 4);
+    header.version = IndexVersion;
+    header.entrySize = sizeof(Entry);
+    header.flags = m_everyFrame ? HeaderEveryFrame : 0;
+    header.timeBaseNum = timeBaseNum;
+    header.timeBaseDen = timeBaseDen;
+
+    if (resumeOffset) {
+        m_file = fopen(path.c_str(), "r+b");
+        if (m_file && Resume(header, resumeOffset))
+            return true;
+        if (m_file)
+            fclose(m_file);
+    }
+
+    m_file = fopen(path.c_str(), "wb");
+    if (!m_file || fwrite(&header, sizeof(header), 1, m_file) != 1) {
+        g_Log(logLevelError, "VAAPI :: Failed to open keyframe index %s", path.c_str());
+        Close();
+        return false;
+    }
+    return true;
+}
+
+// Drops the entries at or past the resume offset, as long as the existing
+// index was written the same way.
+bool KeyframeIndexWriter::Resume(const Header &header, uint64_t resumeOffset)
+{
+    Header existing;
+    if (fread(&existing, sizeof(existing), 1, m_file) != 1 || memcmp(&existing, &header, sizeof(header)) != 0)
+        return false;
+
+    fseek(m_file, 0, SEEK_END);
+    size_t count = (ftell(m_file) - sizeof(Header)) / sizeof(Entry);
+
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        Entry entry;
+        fseek(m_file, sizeof(Header) + mid * sizeof(Entry), SEEK_SET);
+        if (fread(&entry, sizeof(entry), 1, m_file) != 1)
+            return false;
+        if (entry.offset < resumeOffset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    long end = sizeof(Header) + low * sizeof(Entry);
+    fflush(m_file);
+    if (ftruncate(fileno(m_file), end) != 0)
+        return false;
+    return fseek(m_file, end, SEEK_SET) == 0;
+}
+
+void KeyframeIndexWriter::Add(int64_t pts, uint64_t offset, uint32_t size, bool isKeyFrame)
+{
+    if (!m_file || (!isKeyFrame && !m_everyFrame))
+        return;
+
+    Entry entry = { pts, offset, size, isKeyFrame ? static_cast<uint32_t>(EntryKeyFrame) : 0u };
+    fwrite(&entry, sizeof(entry), 1, m_file);
+    // Readers following a render in progress see whole GOPs.
+    if (isKeyFrame)
+        fflush(m_file);
+}
+
+void KeyframeIndexWriter::Close()
+{
+    if (m_file) {
+        fclose(m_file);
+        m_file = nullptr;
+    }
+}
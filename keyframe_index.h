@@ -0,0 +1,81 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Random access index written next to an elementary stream output. The
+// file is a 32-byte header followed by 24-byte entries in decode order,
+// all little-endian, so readers can mmap it and binary search by offset,
+// or by PTS within the keyframes. Entries are appended as packets are
+// written and flushed at every keyframe; the entry count follows from the
+// file size.
+//
+// Only elementary stream outputs have one. The encoder asks for it from the
+// settings, and the container opens it once it knows the time base and
+// whether the render resumes, as with CheckpointJournal.
+class KeyframeIndexWriter
+{
+public:
+    struct Header
+    {
+        char magic[4]; // "VKIX"
+        uint16_t version;
+        uint16_t entrySize;
+        uint32_t flags;
+        // PTS units: timeBaseNum / timeBaseDen seconds.
+        uint32_t timeBaseNum;
+        uint32_t timeBaseDen;
+        uint8_t reserved[12];
+    };
+
+    struct Entry
+    {
+        int64_t pts;
+        uint64_t offset; // of the packet in the output, including its framing
+        uint32_t size;
+        uint32_t flags;
+    };
+
+    enum
+    {
+        HeaderEveryFrame = 1, // not only keyframes are listed
+    };
+
+    enum
+    {
+        EntryKeyFrame = 1,
+    };
+
+    ~KeyframeIndexWriter();
+
+    // Encoder side: asks for an index of the stream rendered to outputPath
+    // and makes it available to the container.
+    static std::shared_ptr<KeyframeIndexWriter> Create(const std::string &outputPath, bool everyFrame);
+    // Container side: the index the encoder asked for, if any.
+    static std::shared_ptr<KeyframeIndexWriter> Find(const std::string &outputPath);
+
+    // Writes <outputPath>.idx. A non-zero resumeOffset keeps the entries of
+    // an existing index below it.
+    bool Open(uint32_t timeBaseNum, uint32_t timeBaseDen, uint64_t resumeOffset);
+    void Add(int64_t pts, uint64_t offset, uint32_t size, bool isKeyFrame);
+    void Close();
+
+private:
+    KeyframeIndexWriter() = default;
+    KeyframeIndexWriter(const KeyframeIndexWriter &) = delete;
+    KeyframeIndexWriter &operator=(const KeyframeIndexWriter &) = delete;
+
+    bool Resume(const Header &header, uint64_t resumeOffset);
+
+    std::string m_outputPath;
+    FILE *m_file = nullptr;
+    bool m_everyFrame = false;
+
+    static std::mutex s_lock;
+    static std::map<std::string, std::weak_ptr<KeyframeIndexWriter>> s_writers;
+};
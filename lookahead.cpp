@@ -0,0 +1,268 @@
+#include "lookahead.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "wrapper/host_api.h"
+
+// A cut needs the histogram to move this much (0..1) and the SAD to jump
+// well above the running average of the shot.
+static constexpr float CutHistDelta = 0.35f;
+static constexpr float CutSadRatio = 2.5f;
+static constexpr float CutMinSad = 8.0f;
+static constexpr uint32_t MinCutDistance = 8;
+
+// Average block SAD of moderate motion, which gets no QP offset.
+static constexpr double NeutralSad = 3.0;
+static constexpr double OffsetScale = 1.5;
+static constexpr int MaxQPOffset = 4;
+
+static uint64_t SteadyNs()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+Lookahead::~Lookahead()
+{
+    Stop();
+}
+
+bool Lookahead::Start(uint32_t width, uint32_t height, uint32_t depth, uint32_t window, uint32_t budgetUs)
+{
+    Stop();
+
+    m_blocksX = width / 8;
+    m_blocksY = height / 8;
+    if (!m_blocksX || !m_blocksY || !window)
+        return false;
+
+    m_is16Bit = depth != 8;
+    m_window = window;
+    m_budgetNs = budgetUs * UINT64_C(1000);
+    m_slots.assign(window + 2, Slot());
+    for (Slot &slot : m_slots)
+        slot.plane.resize(m_blocksX * m_blocksY);
+    m_previous.assign(m_blocksX * m_blocksY, 0);
+    m_rowStep = 1;
+    m_costNs = 0.0;
+    m_costFrames = 0;
+
+    Reset();
+    m_stop = false;
+    m_thread = std::thread(&Lookahead::WorkerThread, this);
+    return true;
+}
+
+void Lookahead::Stop()
+{
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_stop = true;
+    }
+    m_cond.notify_all();
+    if (m_thread.joinable())
+        m_thread.join();
+}
+
+void Lookahead::Reset()
+{
+    std::lock_guard<std::mutex> guard(m_lock);
+    m_pushed = 0;
+    m_analyzed = 0;
+    m_popped = 0;
+    m_averageSad = 0.0;
+    m_sinceCut = 0;
+}
+
+void Lookahead::Downscale(const uint8_t *luma, size_t pitch, bool is16Bit, uint32_t rowStep,
+                          uint8_t *out, uint32_t blocksX, uint32_t blocksY)
+{
+    uint32_t rows = 8 / rowStep;
+    for (uint32_t by = 0; by < blocksY; by++) {
+        const uint8_t *block = luma + by * 8 * pitch;
+        uint8_t *dst = out + by * blocksX;
+        uint32_t bx = 0;
+
+#if defined(__SSE2__)
+        // Two blocks at a time: reduce 16 samples per row to bytes, then
+        // PSADBW against zero sums each 8-byte half.
+        const __m128i zero = _mm_setzero_si128();
+        for (; bx + 2 <= blocksX; bx += 2) {
+            __m128i sum = zero;
+            for (uint32_t y = 0; y < 8; y += rowStep) {
+                const uint8_t *row = block + y * pitch + bx * 8 * (is16Bit ? 2 : 1);
+                __m128i bytes;
+                if (is16Bit) {
+                    __m128i lo = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row)), 8);
+                    __m128i hi = _mm_srli_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(row + 16)), 8);
+                    bytes = _mm_packus_epi16(lo, hi);
+                } else {
+                    bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row));
+                }
+                sum = _mm_add_epi64(sum, _mm_sad_epu8(bytes, zero));
+            }
+            dst[bx] = static_cast<uint8_t>(_mm_cvtsi128_si32(sum) / (rows * 8));
+            dst[bx + 1] = static_cast<uint8_t>(_mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum)) / (rows * 8));
+        }
+#endif
+
+        for (; bx < blocksX; bx++) {
+            uint32_t sum = 0;
+            for (uint32_t y = 0; y < 8; y += rowStep) {
+                if (is16Bit) {
+                    const uint16_t *row = reinterpret_cast<const uint16_t *>(block + y * pitch) + bx * 8;
+                    for (uint32_t x = 0; x < 8; x++)
+                        sum += row[x] >> 8;
+                } else {
+                    const uint8_t *row = block + y * pitch + bx * 8;
+                    for (uint32_t x = 0; x < 8; x++)
+                        sum += row[x];
+                }
+            }
+            dst[bx] = static_cast<uint8_t>(sum / (rows * 8));
+        }
+    }
+}
+
+void Lookahead::Push(const uint8_t *luma, size_t pitch)
+{
+    uint64_t start = SteadyNs();
+
+    uint64_t index;
+    uint32_t rowStep;
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        index = m_pushed;
+        rowStep = m_rowStep;
+    }
+
+    Slot &slot = m_slots[index % m_slots.size()];
+    Downscale(luma, pitch, m_is16Bit, rowStep, slot.plane.data(), m_blocksX, m_blocksY);
+    slot.first = index == 0;
+
+    {
+        std::lock_guard<std::mutex> guard(m_lock);
+        m_costNs += SteadyNs() - start;
+        m_pushed++;
+    }
+    m_cond.notify_all();
+}
+
+void Lookahead::Analyze(Slot &slot)
+{
+    std::array<uint32_t, HistogramBins> hist = {};
+    uint64_t sad = 0;
+    size_t count = slot.plane.size();
+
+    for (size_t i = 0; i < count; i++) {
+        uint8_t value = slot.plane[i];
+        hist[value * HistogramBins / 256]++;
+        sad += std::abs(value - m_previous[i]);
+    }
+
+    if (slot.first) {
+        slot.sad = 0.0f;
+        slot.histDelta = 0.0f;
+    } else {
+        uint64_t histDiff = 0;
+        for (uint32_t bin = 0; bin < HistogramBins; bin++)
+            histDiff += std::abs(static_cast<int64_t>(hist[bin]) - m_previousHist[bin]);
+        slot.sad = static_cast<float>(sad) / count;
+        slot.histDelta = static_cast<float>(histDiff) / (2 * count);
+    }
+
+    std::copy(slot.plane.begin(), slot.plane.end(), m_previous.begin());
+    m_previousHist = hist;
+}
+
+void Lookahead::WorkerThread()
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    while (true) {
+        m_cond.wait(guard, [this] { return m_stop || m_analyzed < m_pushed; });
+        if (m_stop)
+            break;
+
+        Slot &slot = m_slots[m_analyzed % m_slots.size()];
+        guard.unlock();
+        uint64_t start = SteadyNs();
+        Analyze(slot);
+        uint64_t cost = SteadyNs() - start;
+        guard.lock();
+
+        // m_costNs decays once per frame, so it settles at ten times the
+        // per-frame cost of both stages. That decides how many rows the next
+        // frames sample, re-evaluated once it settled after each change.
+        m_costNs = m_costNs * 0.9 + cost;
+        if (m_budgetNs && ++m_costFrames >= 30) {
+            double perFrame = m_costNs / 10.0;
+            uint32_t rowStep = m_rowStep;
+            if (perFrame > m_budgetNs && m_rowStep < 8)
+                m_rowStep *= 2;
+            else if (perFrame < m_budgetNs / 4 && m_rowStep > 1)
+                m_rowStep /= 2;
+            if (m_rowStep != rowStep) {
+                m_costFrames = 0;
+                g_Log(logLevelInfo, "VAAPI :: Lookahead cost %.0f us per frame, sampling every %u rows",
+                      perFrame / 1000.0, m_rowStep);
+            }
+        }
+
+        m_analyzed++;
+        m_cond.notify_all();
+    }
+}
+
+bool Lookahead::Pop(Decision &decision, bool drain)
+{
+    std::unique_lock<std::mutex> guard(m_lock);
+    if (m_popped == m_pushed)
+        return false;
+
+    uint64_t needed = m_popped + m_window + 1;
+    if (needed > m_pushed) {
+        if (!drain)
+            return false;
+        needed = m_pushed;
+    }
+    m_cond.wait(guard, [&] { return m_analyzed >= needed; });
+
+    const Slot &slot = m_slots[m_popped % m_slots.size()];
+    decision.sceneCut = !slot.first && m_sinceCut >= MinCutDistance && slot.histDelta > CutHistDelta &&
+        slot.sad > std::max<double>(CutMinSad, CutSadRatio * m_averageSad);
+
+    if (slot.first || decision.sceneCut) {
+        m_sinceCut = 0;
+        m_averageSad = NeutralSad;
+    } else {
+        m_sinceCut++;
+        m_averageSad = m_averageSad * 0.9 + slot.sad * 0.1;
+    }
+
+    // Motion over the rest of the shot within the window: static shots are
+    // referenced for longer, so they get the bits.
+    double futureSad = 0.0;
+    uint32_t futureFrames = 0;
+    for (uint64_t i = m_popped + 1; i < needed; i++) {
+        const Slot &next = m_slots[i % m_slots.size()];
+        if (next.histDelta > CutHistDelta && next.sad > CutMinSad)
+            break;
+        futureSad += next.sad;
+        futureFrames++;
+    }
+
+    decision.qpOffset = 0;
+    if (futureFrames) {
+        double offset = OffsetScale * std::log2((futureSad / futureFrames + 0.5) / NeutralSad);
+        decision.qpOffset = std::clamp(static_cast<int>(std::lround(offset)), -MaxQPOffset, MaxQPOffset);
+    }
+
+    m_popped++;
+    return true;
+}
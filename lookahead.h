@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Scene cut and motion analysis over a bounded window of upcoming frames.
+// Push() downscales the luma plane to 8x8 block averages on the caller's
+// thread; a worker thread then computes SAD and histogram deltas against
+// the previous frame. Pop() hands out decisions in input order once the
+// window after a frame has been analyzed.
+class Lookahead
+{
+public:
+    struct Decision
+    {
+        bool sceneCut;
+        int qpOffset; // in H.264 QP steps, negative for static content
+    };
+
+    ~Lookahead();
+
+    // depth is 8 for NV12 luma, anything else for P010.
+    bool Start(uint32_t width, uint32_t height, uint32_t depth, uint32_t window, uint32_t budgetUs);
+    void Stop();
+    // Forgets all frames, for a new encoding pass.
+    void Reset();
+
+    // At most GetWindow() + 1 frames may be pushed and not yet popped.
+    void Push(const uint8_t *luma, size_t pitch);
+    // Returns false when the oldest frame still waits for its window, or
+    // when nothing is queued. With drain the window may be cut short.
+    bool Pop(Decision &decision, bool drain);
+
+    uint32_t GetWindow() const
+    {
+        return m_window;
+    }
+
+    // 8x8 block averages of every rowStep-th row. Exposed for benchmarking.
+    static void Downscale(const uint8_t *luma, size_t pitch, bool is16Bit, uint32_t rowStep,
+                          uint8_t *out, uint32_t blocksX, uint32_t blocksY);
+
+private:
+    static constexpr uint32_t HistogramBins = 64;
+
+    struct Slot
+    {
+        std::vector<uint8_t> plane;
+        bool first = false;
+        float sad = 0.0f;
+        float histDelta = 0.0f;
+    };
+
+    void WorkerThread();
+    void Analyze(Slot &slot);
+
+    uint32_t m_blocksX = 0;
+    uint32_t m_blocksY = 0;
+    bool m_is16Bit = false;
+    uint32_t m_window = 0;
+    uint64_t m_budgetNs = 0;
+    std::vector<Slot> m_slots;
+
+    std::thread m_thread;
+    std::mutex m_lock;
+    std::condition_variable m_cond;
+    bool m_stop = false;
+    uint64_t m_pushed = 0;
+    uint64_t m_analyzed = 0;
+    uint64_t m_popped = 0;
+
+    // Cost control: rows sampled per 8x8 block shrink when over budget.
+    uint32_t m_rowStep = 1;
+    double m_costNs = 0.0;
+    uint32_t m_costFrames = 0;
+
+    // Worker only.
+    std::vector<uint8_t> m_previous;
+    std::array<uint32_t, HistogramBins> m_previousHist = {};
+
+    // Pop() only.
+    double m_averageSad = 0.0;
+    uint32_t m_sinceCut = 0;
+};
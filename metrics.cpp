@@ -0,0 +1,216 @@
+#include "metrics.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "wrapper/host_api.h"
+
+namespace {
+
+struct Entry
+{
+    std::shared_ptr<EncoderMetrics> metrics;
+    std::string device; // escaped label values
+    std::string codec;
+    uint32_t id;
+    uint64_t lastFrames = 0;
+    std::chrono::steady_clock::time_point lastTime;
+    double fps = 0.0;
+};
+
+struct Exporter
+{
+    // Serializes starting and joining the thread, lock guards everything else.
+    std::mutex lifecycle;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::thread thread;
+    std::vector<Entry> entries;
+    uint32_t nextId = 0;
+    bool stop = false;
+};
+
+Exporter s_exporter;
+
+const char *MetricsDir()
+{
+    static const char *dir = getenv("DVCP_VAAPI_METRICS_DIR");
+    return dir && *dir ? dir : nullptr;
+}
+
+std::chrono::seconds MetricsInterval()
+{
+    const char *interval = getenv("DVCP_VAAPI_METRICS_INTERVAL");
+    int seconds = interval ? atoi(interval) : 0;
+    return std::chrono::seconds(seconds > 0 ? seconds : 5);
+}
+
+std::string MetricsPath()
+{
+    return std::string(MetricsDir()) + "/dvcp_vaapi_" + std::to_string(getpid()) + ".prom";
+}
+
+// Label values may hold anything, the exposition format escapes these three.
+std::string EscapeLabel(const std::string &value)
+{
+    std::string escaped;
+    escaped.reserve(value.size());
+    for (char c : value) {
+        switch (c) {
+            case '\\': escaped += "\\\\"; break;
+            case '"': escaped += "\\\""; break;
+            case '\n': escaped += "\\n"; break;
+            default: escaped += c; break;
+        }
+    }
+    return escaped;
+}
+
+void WriteMetric(FILE *file, const char *name, const char *type, const char *help,
+                 const std::vector<Entry> &entries, double (*value)(const Entry &))
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    for (const Entry &entry : entries) {
+        fprintf(file, "%s{encoder=\"%u\",device=\"%s\",codec=\"%s\"} %.17g\n", name, entry.id,
+                entry.device.c_str(), entry.codec.c_str(), value(entry));
+    }
+}
+
+double Load(const std::atomic<uint64_t> &counter)
+{
+    return static_cast<double>(counter.load(std::memory_order_relaxed));
+}
+
+// Called with the exporter lock held.
+void WriteFile(std::vector<Entry> &entries)
+{
+    auto now = std::chrono::steady_clock::now();
+    for (Entry &entry : entries) {
+        uint64_t frames = entry.metrics->framesIn.load(std::memory_order_relaxed);
+        double elapsed = std::chrono::duration<double>(now - entry.lastTime).count();
+        if (elapsed > 0.0)
+            entry.fps = (frames - entry.lastFrames) / elapsed;
+        entry.lastFrames = frames;
+        entry.lastTime = now;
+    }
+
+    std::string path = MetricsPath();
+    std::string tmpPath = path + ".tmp";
+    FILE *file = fopen(tmpPath.c_str(), "w");
+    if (!file) {
+        g_Log(logLevelError, "VAAPI :: Failed to write metrics to %s", tmpPath.c_str());
+        return;
+    }
+
+    WriteMetric(file, "dvcp_vaapi_frames_in_total", "counter", "Frames received from the host.", entries,
+                [](const Entry &e) { return Load(e.metrics->framesIn); });
+    WriteMetric(file, "dvcp_vaapi_packets_out_total", "counter", "Packets sent to the host.", entries,
+                [](const Entry &e) { return Load(e.metrics->packetsOut); });
+    WriteMetric(file, "dvcp_vaapi_bytes_out_total", "counter", "Encoded bytes sent to the host.", entries,
+                [](const Entry &e) { return Load(e.metrics->bytesOut); });
+    WriteMetric(file, "dvcp_vaapi_keyframes_total", "counter", "Keyframes sent to the host.", entries,
+                [](const Entry &e) { return Load(e.metrics->keyframes); });
+    WriteMetric(file, "dvcp_vaapi_errors_total", "counter", "Encode errors.", entries,
+                [](const Entry &e) { return Load(e.metrics->errors); });
+    WriteMetric(file, "dvcp_vaapi_fps", "gauge", "Frames per second since the previous update.", entries,
+                [](const Entry &e) { return e.fps; });
+    WriteMetric(file, "dvcp_vaapi_queue_depth", "gauge", "Frames submitted to the encoder without a packet yet.", entries,
+                [](const Entry &e) { return static_cast<double>(e.metrics->inFlight.load(std::memory_order_relaxed)); });
+
+    fprintf(file, "# HELP dvcp_vaapi_stage_seconds_total Time spent in each encode stage.\n"
+                  "# TYPE dvcp_vaapi_stage_seconds_total counter\n");
+    for (const Entry &entry : entries) {
+        const std::pair<const char *, const std::atomic<uint64_t> *> stages[] = {
+            {"upload", &entry.metrics->uploadNs},
+            {"submit", &entry.metrics->submitNs},
+            {"output", &entry.metrics->outputNs},
+        };
+        for (const auto &stage : stages) {
+            fprintf(file, "dvcp_vaapi_stage_seconds_total{encoder=\"%u\",device=\"%s\",codec=\"%s\",stage=\"%s\"} %.9f\n",
+                    entry.id, entry.device.c_str(), entry.codec.c_str(), stage.first,
+                    Load(*stage.second) / 1e9);
+        }
+    }
+
+    fclose(file);
+    if (rename(tmpPath.c_str(), path.c_str()) != 0)
+        g_Log(logLevelError, "VAAPI :: Failed to replace %s", path.c_str());
+}
+
+void ExporterThread()
+{
+    const auto interval = MetricsInterval();
+    std::unique_lock<std::mutex> guard(s_exporter.lock);
+    while (true) {
+        s_exporter.cond.wait_for(guard, interval, [] { return s_exporter.stop; });
+        if (s_exporter.stop)
+            break;
+        WriteFile(s_exporter.entries);
+    }
+
+    // Nothing left to report, a stale file would look like a stuck render.
+    unlink(MetricsPath().c_str());
+}
+
+} // namespace
+
+bool MetricsExporter::IsEnabled()
+{
+    return MetricsDir() != nullptr;
+}
+
+void MetricsExporter::Register(const std::shared_ptr<EncoderMetrics> &metrics)
+{
+    if (!IsEnabled())
+        return;
+
+    std::lock_guard<std::mutex> lifecycle(s_exporter.lifecycle);
+    std::lock_guard<std::mutex> guard(s_exporter.lock);
+    Entry entry;
+    entry.metrics = metrics;
+    entry.device = EscapeLabel(metrics->device);
+    entry.codec = EscapeLabel(metrics->codec);
+    entry.id = s_exporter.nextId++;
+    entry.lastTime = std::chrono::steady_clock::now();
+    s_exporter.entries.push_back(entry);
+
+    if (!s_exporter.thread.joinable()) {
+        s_exporter.stop = false;
+        s_exporter.thread = std::thread(ExporterThread);
+    }
+}
+
+void MetricsExporter::Unregister(const std::shared_ptr<EncoderMetrics> &metrics)
+{
+    if (!IsEnabled())
+        return;
+
+    std::lock_guard<std::mutex> lifecycle(s_exporter.lifecycle);
+    std::thread thread;
+    {
+        std::lock_guard<std::mutex> guard(s_exporter.lock);
+        auto &entries = s_exporter.entries;
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+            if (it->metrics == metrics) {
+                entries.erase(it);
+                break;
+            }
+        }
+        if (!entries.empty())
+            return;
+
+        // The exporter thread removes the file on its way out.
+        s_exporter.stop = true;
+        thread = std::move(s_exporter.thread);
+    }
+    s_exporter.cond.notify_all();
+    if (thread.joinable())
+        thread.join();
+}
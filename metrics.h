@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+// Counters updated by an encoder on its own thread; the exporter only reads
+// them, so relaxed atomics are enough.
+struct EncoderMetrics
+{
+    std::string device;
+    std::string codec;
+
+    std::atomic<uint64_t> framesIn = 0;
+    std::atomic<uint64_t> packetsOut = 0;
+    std::atomic<uint64_t> bytesOut = 0;
+    std::atomic<uint64_t> keyframes = 0;
+    std::atomic<uint64_t> errors = 0;
+    // Frames sent to libavcodec without a packet back yet, in either pass.
+    std::atomic<int64_t> inFlight = 0;
+
+    std::atomic<uint64_t> uploadNs = 0;
+    std::atomic<uint64_t> submitNs = 0;
+    std::atomic<uint64_t> outputNs = 0;
+};
+
+// Prometheus textfile exporter, enabled by pointing DVCP_VAAPI_METRICS_DIR at
+// the node_exporter textfile directory. A background thread atomically
+// rewrites dvcp_vaapi_<pid>.prom every DVCP_VAAPI_METRICS_INTERVAL seconds
+// (default 5) while at least one encoder is registered, and removes it once
+// the last one is gone.
+class MetricsExporter
+{
+public:
+    static bool IsEnabled();
+    static void Register(const std::shared_ptr<EncoderMetrics> &metrics);
+    static void Unregister(const std::shared_ptr<EncoderMetrics> &metrics);
+};
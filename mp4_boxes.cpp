@@ -0,0 +1,367 @@
+#include "mp4_boxes.h"
+
+#include <string.h>
+
+#include "codec_traits.h"
+
+static constexpr uint32_t TrackId = 1;
+
+// trun sample flags: sample_depends_on and sample_is_non_sync_sample.
+static constexpr uint32_t SyncSampleFlags = 0x02000000;
+static constexpr uint32_t NonSyncSampleFlags = 0x01010000;
+
+void BoxWriter::U8(uint8_t value)
+{
+    m_out.push_back(value);
+}
+
+void BoxWriter::U16(uint16_t value)
+{
+    U8(value >> 8);
+    U8(value);
+}
+
+void BoxWriter::U24(uint32_t value)
+{
+    U8(value >> 16);
+    U16(value);
+}
+
+void BoxWriter::U32(uint32_t value)
+{
+    U16(value >> 16);
+    U16(value);
+}
+
+void BoxWriter::U64(uint64_t value)
+{
+    U32(value >> 32);
+    U32(value);
+}
+
+void BoxWriter::FourCC(const char *code)
+{
+    Bytes(code, 4);
+}
+
+void BoxWriter::Bytes(const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    m_out.insert(m_out.end(), bytes, bytes + size);
+}
+
+void BoxWriter::Zeros(size_t count)
+{
+    m_out.insert(m_out.end(), count, 0);
+}
+
+size_t BoxWriter::Begin(const char *type)
+{
+    size_t start = m_out.size();
+    U32(0);
+    FourCC(type);
+    return start;
+}
+
+size_t BoxWriter::BeginFull(const char *type, uint8_t version, uint32_t flags)
+{
+    size_t start = Begin(type);
+    U8(version);
+    U24(flags);
+    return start;
+}
+
+void BoxWriter::End(size_t start)
+{
+    uint32_t size = m_out.size() - start;
+    m_out[start] = size >> 24;
+    m_out[start + 1] = size >> 16;
+    m_out[start + 2] = size >> 8;
+    m_out[start + 3] = size;
+}
+
+static void WriteMatrix(BoxWriter &box)
+{
+    static const uint32_t unity[9] = { 0x10000, 0, 0, 0, 0x10000, 0, 0, 0, 0x40000000 };
+    for (uint32_t value : unity)
+        box.U32(value);
+}
+
+static void WriteSampleEntry(BoxWriter &box, const Mp4TrackInfo &track)
+{
+    const char *entryType = nullptr;
+    const char *configType = nullptr;
+    switch (track.fourcc) {
+        case FOURCC_AVC: entryType = "avc1"; configType = "avcC"; break;
+        case FOURCC_HEVC: entryType = "hvc1"; configType = "hvcC"; break;
+        default: entryType = "av01"; configType = "av1C"; break;
+    }
+
+    size_t entry = box.Begin(entryType);
+    box.Zeros(6);
+    box.U16(1); // data_reference_index
+    box.Zeros(16);
+    box.U16(track.width);
+    box.U16(track.height);
+    box.U32(0x00480000); // 72 dpi
+    box.U32(0x00480000);
+    box.U32(0);
+    box.U16(1); // frame_count
+    box.Zeros(32); // compressorname
+    box.U16(0x0018);
+    box.U16(0xFFFF);
+
+    size_t config = box.Begin(configType);
+    box.Bytes(track.configRecord.data(), track.configRecord.size());
+    box.End(config);
+
+    if (track.hasColour) {
+        size_t colr = box.Begin("colr");
+        box.FourCC("nclx");
+        box.U16(track.primaries);
+        box.U16(track.trc);
+        box.U16(track.matrix);
+        box.U8(track.fullRange ? 0x80 : 0);
+        box.End(colr);
+    }
+
+    box.End(entry);
+}
+
+void BuildMp4InitSegment(const Mp4TrackInfo &track, std::vector<uint8_t> &out)
+{
+    BoxWriter box(out);
+
+    size_t ftyp = box.Begin("ftyp");
+    box.FourCC("iso6");
+    box.U32(0);
+    box.FourCC("iso6");
+    box.FourCC("isom");
+    box.FourCC("mp41");
+    if (track.fourcc == FOURCC_AV1)
+        box.FourCC("av01");
+    if (track.cmaf)
+        box.FourCC("cmfc");
+    box.End(ftyp);
+
+    size_t moov = box.Begin("moov");
+
+    size_t mvhd = box.BeginFull("mvhd", 0, 0);
+    box.U32(0); // creation_time
+    box.U32(0); // modification_time
+    box.U32(track.timescale);
+    box.U32(0); // duration, given by the fragments
+    box.U32(0x00010000); // rate
+    box.U16(0x0100); // volume
+    box.Zeros(10);
+    WriteMatrix(box);
+    box.Zeros(24);
+    box.U32(TrackId + 1); // next_track_ID
+    box.End(mvhd);
+
+    size_t trak = box.Begin("trak");
+
+    size_t tkhd = box.BeginFull("tkhd", 0, 0x000003); // enabled, in movie
+    box.U32(0);
+    box.U32(0);
+    box.U32(TrackId);
+    box.U32(0);
+    box.U32(0); // duration
+    box.Zeros(8);
+    box.U16(0); // layer
+    box.U16(0); // alternate_group
+    box.U16(0); // volume
+    box.U16(0);
+    WriteMatrix(box);
+    box.U32(track.width << 16);
+    box.U32(track.height << 16);
+    box.End(tkhd);
+
+    // Reordered streams start decoding before the first presented frame.
+    if (track.mediaTime) {
+        size_t edts = box.Begin("edts");
+        size_t elst = box.BeginFull("elst", 0, 0);
+        box.U32(1);
+        box.U32(0); // segment_duration, the whole track
+        box.U32(track.mediaTime);
+        box.U32(0x00010000); // media_rate
+        box.End(elst);
+        box.End(edts);
+    }
+
+    size_t mdia = box.Begin("mdia");
+
+    size_t mdhd = box.BeginFull("mdhd", 0, 0);
+    box.U32(0);
+    box.U32(0);
+    box.U32(track.timescale);
+    box.U32(0);
+    box.U16(0x55C4); // 'und'
+    box.U16(0);
+    box.End(mdhd);
+
+    size_t hdlr = box.BeginFull("hdlr", 0, 0);
+    box.U32(0);
+    box.FourCC("vide");
+    box.Zeros(12);
+    box.Bytes("VideoHandler", 13);
+    box.End(hdlr);
+
+    size_t minf = box.Begin("minf");
+
+    size_t vmhd = box.BeginFull("vmhd", 0, 1);
+    box.Zeros(8);
+    box.End(vmhd);
+
+    size_t dinf = box.Begin("dinf");
+    size_t dref = box.BeginFull("dref", 0, 0);
+    box.U32(1);
+    size_t url = box.BeginFull("url ", 0, 1); // media in the same file
+    box.End(url);
+    box.End(dref);
+    box.End(dinf);
+
+    size_t stbl = box.Begin("stbl");
+    size_t stsd = box.BeginFull("stsd", 0, 0);
+    box.U32(1);
+    WriteSampleEntry(box, track);
+    box.End(stsd);
+    for (const char *type : { "stts", "stsc", "stco" }) {
+        size_t empty = box.BeginFull(type, 0, 0);
+        box.U32(0);
+        box.End(empty);
+    }
+    size_t stsz = box.BeginFull("stsz", 0, 0);
+    box.U32(0);
+    box.U32(0);
+    box.End(stsz);
+    box.End(stbl);
+
+    box.End(minf);
+    box.End(mdia);
+    box.End(trak);
+
+    size_t mvex = box.Begin("mvex");
+    size_t trex = box.BeginFull("trex", 0, 0);
+    box.U32(TrackId);
+    box.U32(1); // default_sample_description_index
+    box.U32(0);
+    box.U32(0);
+    box.U32(NonSyncSampleFlags);
+    box.End(trex);
+    box.End(mvex);
+
+    box.End(moov);
+}
+
+void BuildMp4SegmentType(std::vector<uint8_t> &out)
+{
+    BoxWriter box(out);
+    size_t styp = box.Begin("styp");
+    box.FourCC("cmfs");
+    box.U32(0);
+    box.FourCC("cmfs");
+    box.FourCC("msdh"); // no sidx, so not msix
+    box.End(styp);
+}
+
+void BuildMp4FragmentHeader(uint32_t sequence, uint64_t baseDecodeTime, const std::vector<Mp4Sample> &samples,
+                            uint64_t payloadSize, std::vector<uint8_t> &out)
+{
+    BoxWriter box(out);
+    size_t moof = box.Begin("moof");
+
+    size_t mfhd = box.BeginFull("mfhd", 0, 0);
+    box.U32(sequence);
+    box.End(mfhd);
+
+    size_t traf = box.Begin("traf");
+
+    size_t tfhd = box.BeginFull("tfhd", 0, 0x020000); // default-base-is-moof
+    box.U32(TrackId);
+    box.End(tfhd);
+
+    size_t tfdt = box.BeginFull("tfdt", 1, 0);
+    box.U64(baseDecodeTime);
+    box.End(tfdt);
+
+    // data offset, duration, size, flags and composition offset per sample
+    size_t trun = box.BeginFull("trun", 1, 0x000F01);
+    box.U32(samples.size());
+    size_t dataOffset = out.size();
+    box.U32(0);
+    for (const Mp4Sample &sample : samples) {
+        box.U32(sample.duration);
+        box.U32(sample.size);
+        box.U32(sample.isKeyFrame ? SyncSampleFlags : NonSyncSampleFlags);
+        box.U32(static_cast<uint32_t>(sample.ctsOffset));
+    }
+    box.End(trun);
+
+    box.End(traf);
+    box.End(moof);
+
+    bool largeSize = payloadSize + 8 > UINT32_MAX;
+    uint32_t headerSize = largeSize ? 16 : 8;
+
+    uint32_t offset = out.size() - moof + headerSize;
+    out[dataOffset] = offset >> 24;
+    out[dataOffset + 1] = offset >> 16;
+    out[dataOffset + 2] = offset >> 8;
+    out[dataOffset + 3] = offset;
+
+    if (largeSize) {
+        box.U32(1);
+        box.FourCC("mdat");
+        box.U64(payloadSize + headerSize);
+    } else {
+        box.U32(payloadSize + headerSize);
+        box.FourCC("mdat");
+    }
+}
+
+static bool IsParameterSet(uint32_t fourcc, const uint8_t *nal)
+{
+    if (fourcc == FOURCC_HEVC) {
+        uint8_t type = (nal[0] >> 1) & 0x3F;
+        return type >= 32 && type <= 34;
+    }
+    uint8_t type = nal[0] & 0x1F;
+    return type == 7 || type == 8;
+}
+
+size_t AppendLengthPrefixedNALs(uint32_t fourcc, const uint8_t *data, size_t size, std::vector<uint8_t> &out)
+{
+    size_t before = out.size();
+
+    // Start of the first NAL after a start code, or size if there is none.
+    auto nextNal = [&](size_t pos) {
+        for (; pos + 3 <= size; pos++) {
+            if (data[pos] == 0 && data[pos + 1] == 0 && data[pos + 2] == 1)
+                return pos + 3;
+        }
+        return size;
+    };
+
+    size_t start = nextNal(0);
+    while (start < size) {
+        size_t next = nextNal(start);
+        size_t end = next == size ? size : next - 3;
+        // The zero byte of a 4-byte start code belongs to the next one.
+        while (end > start && data[end - 1] == 0)
+            end--;
+
+        if (end > start && !IsParameterSet(fourcc, data + start)) {
+            uint32_t length = end - start;
+            uint8_t prefix[4] = {
+                static_cast<uint8_t>(length >> 24), static_cast<uint8_t>(length >> 16),
+                static_cast<uint8_t>(length >> 8), static_cast<uint8_t>(length),
+            };
+            out.insert(out.end(), prefix, prefix + 4);
+            out.insert(out.end(), data + start, data + end);
+        }
+        start = next;
+    }
+
+    return out.size() - before;
+}
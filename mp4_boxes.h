@@ -0,0 +1,73 @@
+#pragma once
+
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Big-endian ISO BMFF serialization into a growing byte vector.
+class BoxWriter
+{
+public:
+    explicit BoxWriter(std::vector<uint8_t> &out)
+        : m_out(out)
+    {
+    }
+
+    void U8(uint8_t value);
+    void U16(uint16_t value);
+    void U24(uint32_t value);
+    void U32(uint32_t value);
+    void U64(uint64_t value);
+    void FourCC(const char *code);
+    void Bytes(const void *data, size_t size);
+    void Zeros(size_t count);
+
+    // Opens a box and returns its start, for End() to patch the size into
+    // once the contents are written.
+    size_t Begin(const char *type);
+    size_t BeginFull(const char *type, uint8_t version, uint32_t flags);
+    void End(size_t start);
+
+private:
+    std::vector<uint8_t> &m_out;
+};
+
+struct Mp4TrackInfo
+{
+    uint32_t fourcc; // sample entry type, FOURCC_AVC, FOURCC_HEVC or FOURCC_AV1
+    uint32_t width;
+    uint32_t height;
+    uint32_t timescale;
+    int64_t mediaTime; // presentation time of the first sample after the edit
+    std::vector<uint8_t> configRecord;
+    bool hasColour;
+    int16_t primaries;
+    int16_t trc;
+    int16_t matrix;
+    bool fullRange;
+    bool cmaf; // adds the CMAF brand, for files split at keyframes only
+};
+
+struct Mp4Sample
+{
+    uint32_t duration;
+    uint32_t size;
+    int32_t ctsOffset; // presentation minus decode time
+    bool isKeyFrame;
+};
+
+// ftyp and a moov that only describes the track; the samples all live in
+// fragments, so the header never needs to be revisited.
+void BuildMp4InitSegment(const Mp4TrackInfo &track, std::vector<uint8_t> &out);
+// styp that opens each separately stored CMAF segment.
+void BuildMp4SegmentType(std::vector<uint8_t> &out);
+// moof for the samples of one fragment followed by the mdat header, so the
+// payload can be written right after it.
+void BuildMp4FragmentHeader(uint32_t sequence, uint64_t baseDecodeTime, const std::vector<Mp4Sample> &samples,
+                            uint64_t payloadSize, std::vector<uint8_t> &out);
+
+// Appends an Annex B access unit with 4-byte NAL lengths instead of start
+// codes, skipping the parameter sets that are in the sample entry already.
+// Returns the number of bytes appended.
+size_t AppendLengthPrefixedNALs(uint32_t fourcc, const uint8_t *data, size_t size, std::vector<uint8_t> &out);
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+
+// Validates packet timestamps in decode order before they go to the host:
+// DTS has to rise strictly, and no frame may be presented before it is
+// decoded, or the MP4 sample table would be invalid.
+class PacketOrder
+{
+public:
+    enum Result
+    {
+        orderOk,
+        orderDtsNotIncreasing,
+        orderDtsAfterPts,
+    };
+
+    void Reset()
+    {
+        m_haveDts = false;
+    }
+
+    Result Check(int64_t pts, int64_t dts)
+    {
+        if (dts > pts)
+            return orderDtsAfterPts;
+        if (m_haveDts && dts <= m_lastDts)
+            return orderDtsNotIncreasing;
+
+        m_lastDts = dts;
+        m_haveDts = true;
+        return orderOk;
+    }
+
+    int64_t GetLastDts() const
+    {
+        return m_lastDts;
+    }
+
+    static const char *Describe(Result result)
+    {
+        switch (result) {
+            case orderOk: return "ok";
+            case orderDtsNotIncreasing: return "DTS not above the previous packet's";
+            case orderDtsAfterPts: return "DTS after PTS";
+        }
+        return "invalid";
+    }
+
+private:
+    int64_t m_lastDts = 0;
+    bool m_haveDts = false;
+};
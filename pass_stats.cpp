@@ -0,0 +1,159 @@
+#include "pass_stats.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "wrapper/host_api.h"
+
+static constexpr size_t GrowFrames = 65536;
+
+// x264 style curve compression: a frame twice as complex as average gets
+// 2^(1 - QComp) times the quantizer step, and keyframes get IPRatio more bits.
+static constexpr double QComp = 0.6;
+static constexpr double IPRatio = 1.4;
+
+PassStatsFile::~PassStatsFile()
+{
+    Close();
+}
+
+bool PassStatsFile::Open(const std::string &dir)
+{
+    Close();
+
+    std::string path = (dir.empty() ? std::string("/tmp") : dir) + "/.dvcp-vaapi-pass-XXXXXX";
+    m_fd = mkstemp(path.data());
+    if (m_fd < 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to create first pass statistics in %s", dir.c_str());
+        return false;
+    }
+    unlink(path.c_str());
+
+    if (!Grow()) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void PassStatsFile::Close()
+{
+    if (m_frames)
+        munmap(m_frames, m_capacity * sizeof(Frame));
+    if (m_fd >= 0)
+        close(m_fd);
+
+    m_fd = -1;
+    m_frames = nullptr;
+    m_capacity = 0;
+    m_count = 0;
+    m_cursor = 0;
+}
+
+bool PassStatsFile::Grow()
+{
+    size_t capacity = m_capacity + GrowFrames;
+    if (ftruncate(m_fd, capacity * sizeof(Frame)) != 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to grow first pass statistics to %zu frames", capacity);
+        return false;
+    }
+
+    void *frames = m_frames
+        ? mremap(m_frames, m_capacity * sizeof(Frame), capacity * sizeof(Frame), MREMAP_MAYMOVE)
+        : mmap(nullptr, capacity * sizeof(Frame), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (frames == MAP_FAILED) {
+        g_Log(logLevelError, "VAAPI :: Failed to map first pass statistics");
+        return false;
+    }
+
+    m_frames = static_cast<Frame *>(frames);
+    m_capacity = capacity;
+    return true;
+}
+
+bool PassStatsFile::Append(int64_t pts, uint32_t bytes, bool isKeyFrame)
+{
+    if (m_fd < 0 || (m_count == m_capacity && !Grow()))
+        return false;
+
+    Frame &frame = m_frames[m_count++];
+    frame.pts = pts;
+    frame.bytes = bytes;
+    frame.qp = 0;
+    frame.isKeyFrame = isKeyFrame;
+    frame.reserved = 0;
+    return true;
+}
+
+int PassStatsFile::Plan(const PlanParams &params)
+{
+    if (!m_count)
+        return params.analysisQP;
+
+    std::sort(m_frames, m_frames + m_count, [](const Frame &a, const Frame &b) { return a.pts < b.pts; });
+    m_cursor = 0;
+
+    double logSum = 0.0;
+    size_t logCount = 0;
+    for (size_t i = 0; i < m_count; i++) {
+        if (!m_frames[i].isKeyFrame) {
+            logSum += std::log2(std::max<uint32_t>(m_frames[i].bytes, 1));
+            logCount++;
+        }
+    }
+    double logMean = logCount ? logSum / logCount : 0.0;
+
+    auto offset = [&](const Frame &frame) {
+        if (frame.isKeyFrame)
+            return -params.qpPerDoubling * std::log2(IPRatio);
+        return (1.0 - QComp) * params.qpPerDoubling * (std::log2(std::max<uint32_t>(frame.bytes, 1)) - logMean);
+    };
+    auto frameQP = [&](const Frame &frame, double base) {
+        return std::clamp(base + offset(frame), static_cast<double>(params.minQP), static_cast<double>(params.maxQP));
+    };
+    auto predict = [&](double base) {
+        double bytes = 0.0;
+        for (size_t i = 0; i < m_count; i++)
+            bytes += m_frames[i].bytes * std::exp2((params.analysisQP - frameQP(m_frames[i], base)) / params.qpPerDoubling);
+        return bytes;
+    };
+
+    // Predicted size only falls as the base QP rises, so bisect for the target.
+    double low = params.minQP - params.maxQP;
+    double high = 2.0 * params.maxQP;
+    for (int i = 0; i < 40; i++) {
+        double mid = (low + high) / 2;
+        if (predict(mid) > params.targetBytes)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    for (size_t i = 0; i < m_count; i++)
+        m_frames[i].qp = static_cast<int16_t>(std::lround(frameQP(m_frames[i], high)));
+
+    int base = std::clamp(static_cast<int>(std::lround(high)), params.minQP, params.maxQP);
+    g_Log(logLevelInfo, "VAAPI :: Second pass plan for %zu frames: base QP %d, predicted %.0f of %.0f bytes",
+          m_count, base, predict(high), params.targetBytes);
+    return base;
+}
+
+const PassStatsFile::Frame *PassStatsFile::Find(int64_t pts)
+{
+    // Frames come back in order, so the next one is almost always the match.
+    if (m_cursor < m_count && m_frames[m_cursor].pts == pts)
+        return &m_frames[m_cursor++];
+
+    const Frame *end = m_frames + m_count;
+    const Frame *frame = std::lower_bound(static_cast<const Frame *>(m_frames), end, pts,
+                                          [](const Frame &a, int64_t value) { return a.pts < value; });
+    if (frame == end || frame->pts != pts)
+        return nullptr;
+    m_cursor = frame - m_frames + 1;
+    return frame;
+}
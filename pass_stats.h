@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// First pass results of a two-pass encode, one fixed-size record per frame
+// in an unlinked memory-mapped file, so long timelines cost page cache
+// rather than heap. The mapping grows in chunks as frames are appended.
+class PassStatsFile
+{
+public:
+    struct Frame
+    {
+        int64_t pts;
+        uint32_t bytes;
+        int16_t qp; // planned second pass QP
+        uint8_t isKeyFrame;
+        uint8_t reserved;
+    };
+
+    struct PlanParams
+    {
+        double targetBytes;
+        int analysisQP; // QP the first pass was encoded with
+        int minQP;
+        int maxQP;
+        double qpPerDoubling; // QP change that halves the frame size
+    };
+
+    PassStatsFile() = default;
+    ~PassStatsFile();
+
+    // Creates the backing file in dir.
+    bool Open(const std::string &dir);
+    void Close();
+    bool IsOpen() const
+    {
+        return m_fd >= 0;
+    }
+
+    bool Append(int64_t pts, uint32_t bytes, bool isKeyFrame);
+
+    // Sorts the frames into presentation order and assigns each one a QP so
+    // the whole encode lands on targetBytes. Returns the base QP the
+    // per-frame QPs are offsets from.
+    int Plan(const PlanParams &params);
+
+    // Returns nullptr for frames the first pass didn't see.
+    const Frame *Find(int64_t pts);
+
+    size_t GetCount() const
+    {
+        return m_count;
+    }
+
+private:
+    PassStatsFile(const PassStatsFile &) = delete;
+    PassStatsFile &operator=(const PassStatsFile &) = delete;
+
+    bool Grow();
+
+    int m_fd = -1;
+    Frame *m_frames = nullptr;
+    size_t m_capacity = 0;
+    size_t m_count = 0;
+    size_t m_cursor = 0;
+};
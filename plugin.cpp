@@ -1,4 +1,6 @@
 #include "plugin.h"
+#include "es_container.h"
+#include "fmp4_container.h"
 #include "vaapi_encoder.h"
 
 StatusCode g_HandleGetInfo(HostPropertyCollectionRef* p_pProps)
@@ -12,6 +14,18 @@ StatusCode g_HandleGetInfo(HostPropertyCollectionRef* p_pProps)
 
 StatusCode g_HandleCreateObj(unsigned char *p_pUUID, ObjectRef *p_ppObj)
 {
+    FragmentedMP4Container *container = FragmentedMP4Container::Create(p_pUUID);
+    if (container) {
+        *p_ppObj = container;
+        return errNone;
+    }
+
+    ElementaryStreamContainer *stream = ElementaryStreamContainer::Create(p_pUUID);
+    if (stream) {
+        *p_ppObj = stream;
+        return errNone;
+    }
+
     VAAPIEncoder *enc = VAAPIEncoder::Create(p_pUUID);
     if (enc) {
         *p_ppObj = enc;
@@ -40,7 +54,10 @@ StatusCode g_ListCodecs(HostListRef *p_pList)
 
 StatusCode g_ListContainers(HostListRef *p_pList)
 {
-    return errNone;
+    StatusCode err = FragmentedMP4Container::Register(p_pList);
+    if (err != errNone)
+        return err;
+    return ElementaryStreamContainer::Register(p_pList);
 }
 
 StatusCode g_GetEncoderSettings(unsigned char *p_pUUID, HostPropertyCollectionRef *p_pValues, HostListRef *p_pSettingsList)
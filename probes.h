@@ -0,0 +1,24 @@
+#pragma once
+
+// USDT probes under the "dvcp_vaapi" provider. Every probe needs a matching
+// VAAPI_PROBE_SEMAPHORE() definition. The durations passed to them are
+// measured for the metrics anyway, so the probes don't gate any work.
+#ifdef HAVE_SDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define VAAPI_PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short dvcp_vaapi_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+#define VAAPI_PROBE0(name) DTRACE_PROBE(dvcp_vaapi, name)
+#define VAAPI_PROBE1(name, a1) DTRACE_PROBE1(dvcp_vaapi, name, a1)
+#define VAAPI_PROBE2(name, a1, a2) DTRACE_PROBE2(dvcp_vaapi, name, a1, a2)
+#define VAAPI_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(dvcp_vaapi, name, a1, a2, a3)
+#define VAAPI_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(dvcp_vaapi, name, a1, a2, a3, a4)
+#else
+#define VAAPI_PROBE_SEMAPHORE(name) static_assert(true)
+#define VAAPI_PROBE0(name) do {} while (0)
+#define VAAPI_PROBE1(name, a1) do {} while (0)
+#define VAAPI_PROBE2(name, a1, a2) do {} while (0)
+#define VAAPI_PROBE3(name, a1, a2, a3) do {} while (0)
+#define VAAPI_PROBE4(name, a1, a2, a3, a4) do {} while (0)
+#endif
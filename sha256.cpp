@@ -0,0 +1,223 @@
+#include "sha256.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static inline uint32_t Rotr(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+static void ProcessBlocksPortable(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    for (; blocks; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++)
+            w[i] = uint32_t(data[i * 4]) << 24 | data[i * 4 + 1] << 16 | data[i * 4 + 2] << 8 | data[i * 4 + 3];
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = Rotr(w[i - 15], 7) ^ Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Rotr(w[i - 2], 17) ^ Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+            uint32_t t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(__x86_64__)
+// Four rounds per SHA256RNDS2 pair. The message schedule is kept in four
+// registers of four words each and extended with SHA256MSG1/MSG2.
+__attribute__((target("sha,sse4.1")))
+static void ProcessBlocksShaNI(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // The instructions want the state as ABEF and CDGH.
+    __m128i tmp = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state));
+    __m128i state1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4));
+    tmp = _mm_shuffle_epi32(tmp, 0xB1); // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+    for (; blocks; blocks--, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msg[4];
+        for (int i = 0; i < 4; i++)
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i * 16)), byteSwap);
+
+        // Unrolled, so the schedule stays in registers.
+#pragma GCC unroll 16
+        for (int i = 0; i < 16; i++) {
+            __m128i current = msg[i & 3];
+            __m128i words = _mm_add_epi32(current, _mm_loadu_si128(reinterpret_cast<const __m128i *>(K + i * 4)));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            words = _mm_shuffle_epi32(words, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, words);
+
+            // Finish the words of the next group, then start on the ones
+            // three groups ahead while the words they need are unchanged.
+            if (i >= 3 && i < 15) {
+                __m128i &next = msg[(i + 1) & 3];
+                next = _mm_add_epi32(next, _mm_alignr_epi8(current, msg[(i - 1) & 3], 4));
+                next = _mm_sha256msg2_epu32(next, current);
+            }
+            if (i >= 1 && i < 13)
+                msg[(i - 1) & 3] = _mm_sha256msg1_epu32(msg[(i - 1) & 3], current);
+        }
+
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8); // HGFE
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), state1);
+}
+#endif
+
+using ProcessBlocksFn = void (*)(uint32_t *state, const uint8_t *data, size_t blocks);
+
+static ProcessBlocksFn SelectProcessBlocks()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+        return ProcessBlocksShaNI;
+#endif
+    return ProcessBlocksPortable;
+}
+
+static const ProcessBlocksFn ProcessBlocks = SelectProcessBlocks();
+
+Sha256::Sha256()
+{
+    static const uint32_t initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(m_state, initial, sizeof(m_state));
+}
+
+bool Sha256::IsAccelerated()
+{
+    return ProcessBlocks != ProcessBlocksPortable;
+}
+
+void Sha256::Update(const void *data, size_t size)
+{
+    const uint8_t *bytes = static_cast<const uint8_t *>(data);
+    m_length += size;
+
+    if (m_blockSize) {
+        size_t count = size < 64 - m_blockSize ? size : 64 - m_blockSize;
+        memcpy(m_block + m_blockSize, bytes, count);
+        m_blockSize += count;
+        bytes += count;
+        size -= count;
+        if (m_blockSize < 64)
+            return;
+        ProcessBlocks(m_state, m_block, 1);
+        m_blockSize = 0;
+    }
+
+    if (size >= 64) {
+        ProcessBlocks(m_state, bytes, size / 64);
+        bytes += size / 64 * 64;
+        size %= 64;
+    }
+
+    memcpy(m_block, bytes, size);
+    m_blockSize = size;
+}
+
+// Big-endian state words and length, then the bytes of the partial block.
+std::vector<uint8_t> Sha256::Save() const
+{
+    std::vector<uint8_t> out;
+    for (uint32_t word : m_state) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            out.push_back(static_cast<uint8_t>(word >> shift));
+    }
+    for (int shift = 56; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(m_length >> shift));
+    out.insert(out.end(), m_block, m_block + m_blockSize);
+    return out;
+}
+
+bool Sha256::Restore(const uint8_t *data, size_t size)
+{
+    if (size < 40)
+        return false;
+
+    uint64_t length = 0;
+    for (int i = 0; i < 8; i++)
+        length = length << 8 | data[32 + i];
+    if (size != 40 + length % 64)
+        return false;
+
+    for (int i = 0; i < 8; i++)
+        m_state[i] = uint32_t(data[i * 4]) << 24 | data[i * 4 + 1] << 16 | data[i * 4 + 2] << 8 | data[i * 4 + 3];
+    m_length = length;
+    m_blockSize = size - 40;
+    memcpy(m_block, data + 40, m_blockSize);
+    return true;
+}
+
+Sha256::Digest Sha256::Final()
+{
+    uint64_t bits = m_length * 8;
+    uint8_t padding[72] = { 0x80 };
+    size_t padSize = (m_blockSize < 56 ? 56 : 120) - m_blockSize;
+    for (int i = 0; i < 8; i++)
+        padding[padSize + i] = static_cast<uint8_t>(bits >> (56 - i * 8));
+    Update(padding, padSize + 8);
+
+    Digest digest;
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = m_state[i] >> 24;
+        digest[i * 4 + 1] = m_state[i] >> 16;
+        digest[i * 4 + 2] = m_state[i] >> 8;
+        digest[i * 4 + 3] = m_state[i];
+    }
+    return digest;
+}
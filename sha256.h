@@ -0,0 +1,33 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Incremental SHA-256. Blocks go through the SHA extensions on CPUs that
+// have them and through portable code otherwise.
+class Sha256
+{
+public:
+    using Digest = std::array<uint8_t, 32>;
+
+    Sha256();
+
+    void Update(const void *data, size_t size);
+    Digest Final();
+
+    // The intermediate state, so a later process can continue the hash.
+    std::vector<uint8_t> Save() const;
+    bool Restore(const uint8_t *data, size_t size);
+
+    // Whether the SHA extensions are used.
+    static bool IsAccelerated();
+
+private:
+    uint32_t m_state[8];
+    uint8_t m_block[64];
+    size_t m_blockSize = 0;
+    uint64_t m_length = 0;
+};
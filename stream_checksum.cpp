@@ -0,0 +1,212 @@
+#include "stream_checksum.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "wrapper/host_api.h"
+
+// Enough for a few seconds of packets, so a slow moment of the hash thread
+// doesn't stall the encoder.
+static constexpr size_t RingSize = 256;
+
+static void PrintHex(FILE *file, const uint8_t *data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+        fprintf(file, "%02x", data[i]);
+    fputc('\n', file);
+}
+
+static bool ParseHex(const char *hex, std::vector<uint8_t> &out)
+{
+    out.clear();
+    for (; isxdigit(hex[0]) && isxdigit(hex[1]); hex += 2) {
+        char byte[3] = { hex[0], hex[1], 0 };
+        out.push_back(static_cast<uint8_t>(strtoul(byte, nullptr, 16)));
+    }
+    return *hex == '\n' || *hex == 0;
+}
+
+StreamChecksumWriter::~StreamChecksumWriter()
+{
+    Close();
+}
+
+bool StreamChecksumWriter::Open(const std::string &path, bool resumable, int64_t resumePts)
+{
+    m_stream = Sha256();
+    m_gop = Sha256();
+    m_gopPackets = 0;
+    m_gopBytes = 0;
+    m_packets = 0;
+    m_bytes = 0;
+
+    std::string kept;
+    bool resumed = resumePts != INT64_MIN && LoadResume(path, resumePts, kept);
+
+    m_file = fopen(path.c_str(), "w");
+    if (!m_file) {
+        g_Log(logLevelError, "VAAPI :: Failed to open checksums %s", path.c_str());
+        return false;
+    }
+
+    fputs("# SHA-256 of the encoded essence, not of the output file: gop <pts> <packets> <bytes> <digest>, "
+          "stream <packets> <bytes> <digest>\n",
+          m_file);
+    if (resumePts != INT64_MIN && !resumed) {
+        g_Log(logLevelWarn, "VAAPI :: No checksum state at the checkpoint, %s only covers the resumed part", path.c_str());
+        fprintf(m_file, "# resumed at pts %" PRId64 ", the digests cover the packets from there\n", resumePts);
+    }
+    fputs(kept.c_str(), m_file);
+
+    m_resumable = resumable;
+    m_ring.assign(RingSize, Packet());
+    m_head = 0;
+    m_tail = 0;
+    m_thread = std::thread(&StreamChecksumWriter::HashThread, this);
+
+    g_Log(logLevelInfo, "VAAPI :: Checksums to %s (%s)", path.c_str(),
+          Sha256::IsAccelerated() ? "SHA extensions" : "portable");
+    return true;
+}
+
+bool StreamChecksumWriter::LoadResume(const std::string &path, int64_t resumePts, std::string &kept)
+{
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+        return false;
+
+    // state <pts> <packets> <bytes> <hash state>, before the GOP at pts.
+    bool found = false;
+    char line[512];
+    while (!found && fgets(line, sizeof(line), file)) {
+        int64_t pts = 0;
+        uint64_t packets = 0;
+        uint64_t bytes = 0;
+        int length = 0;
+        if (!strncmp(line, "gop ", 4)) {
+            kept += line;
+        } else if (sscanf(line, "state %" SCNd64 " %" SCNu64 " %" SCNu64 " %n", &pts, &packets, &bytes, &length) == 3 &&
+                   length && pts == resumePts) {
+            std::vector<uint8_t> state;
+            found = ParseHex(line + length, state) && m_stream.Restore(state.data(), state.size());
+            m_packets = packets;
+            m_bytes = bytes;
+        }
+    }
+    fclose(file);
+
+    if (!found) {
+        m_stream = Sha256();
+        m_packets = 0;
+        m_bytes = 0;
+        kept.clear();
+    }
+    return found;
+}
+
+StreamChecksumWriter::Packet &StreamChecksumWriter::Acquire()
+{
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    uint64_t tail = m_tail.load(std::memory_order_acquire);
+    while (head - tail >= m_ring.size()) {
+        m_tail.wait(tail, std::memory_order_acquire);
+        tail = m_tail.load(std::memory_order_acquire);
+    }
+    return m_ring[head % m_ring.size()];
+}
+
+void StreamChecksumWriter::Push(const uint8_t *data, size_t size, int64_t pts, bool isKeyFrame)
+{
+    if (!m_file)
+        return;
+
+    // The slot keeps its capacity, so this only allocates for the first
+    // rounds through the ring.
+    Packet &packet = Acquire();
+    packet.data.assign(data, data + size);
+    packet.pts = pts;
+    packet.isKeyFrame = isKeyFrame;
+    packet.end = false;
+
+    m_head.fetch_add(1, std::memory_order_release);
+    m_head.notify_one();
+}
+
+void StreamChecksumWriter::Close()
+{
+    if (!m_file)
+        return;
+
+    Packet &packet = Acquire();
+    packet.data.clear();
+    packet.end = true;
+    m_head.fetch_add(1, std::memory_order_release);
+    m_head.notify_one();
+    m_thread.join();
+
+    fclose(m_file);
+    m_file = nullptr;
+    m_ring.clear();
+}
+
+void StreamChecksumWriter::HashThread()
+{
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    while (true) {
+        m_head.wait(tail, std::memory_order_acquire);
+
+        Packet &packet = m_ring[tail % m_ring.size()];
+        bool end = packet.end;
+        if (!end) {
+            if (packet.isKeyFrame) {
+                FinishGop();
+                if (m_resumable)
+                    SaveState(packet.pts);
+            }
+            if (!m_gopPackets)
+                m_gopPts = packet.pts;
+
+            m_gop.Update(packet.data.data(), packet.data.size());
+            m_stream.Update(packet.data.data(), packet.data.size());
+            m_gopPackets++;
+            m_gopBytes += packet.data.size();
+            m_packets++;
+            m_bytes += packet.data.size();
+        }
+
+        m_tail.store(++tail, std::memory_order_release);
+        m_tail.notify_one();
+        if (end)
+            break;
+    }
+
+    FinishGop();
+    fprintf(m_file, "stream %" PRIu64 " %" PRIu64 " ", m_packets, m_bytes);
+    Sha256::Digest digest = m_stream.Final();
+    PrintHex(m_file, digest.data(), digest.size());
+}
+
+void StreamChecksumWriter::FinishGop()
+{
+    if (!m_gopPackets)
+        return;
+
+    fprintf(m_file, "gop %" PRId64 " %" PRIu64 " %" PRIu64 " ", m_gopPts, m_gopPackets, m_gopBytes);
+    Sha256::Digest digest = m_gop.Final();
+    PrintHex(m_file, digest.data(), digest.size());
+    fflush(m_file);
+
+    m_gop = Sha256();
+    m_gopPackets = 0;
+    m_gopBytes = 0;
+}
+
+void StreamChecksumWriter::SaveState(int64_t pts)
+{
+    std::vector<uint8_t> state = m_stream.Save();
+    fprintf(m_file, "state %" PRId64 " %" PRIu64 " %" PRIu64 " ", pts, m_packets, m_bytes);
+    PrintHex(m_file, state.data(), state.size());
+    fflush(m_file);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "sha256.h"
+
+// SHA-256 of the encoded essence, the packets as handed to the container,
+// per GOP and for the whole stream, in a text sidecar. It isn't a digest of
+// the output file, which adds container framing. Push() copies the packet
+// into a preallocated single-producer ring that a background thread hashes,
+// so the digests are ready when the render ends without reading anything
+// back.
+//
+// A resumable sidecar also records the hash state at every keyframe, so a
+// render resumed at one continues the digests from there.
+class StreamChecksumWriter
+{
+public:
+    ~StreamChecksumWriter();
+
+    // resumePts is AV_NOPTS_VALUE unless the render continues a checkpoint.
+    bool Open(const std::string &path, bool resumable, int64_t resumePts);
+    // Waits while the ring is full, packets are never dropped.
+    void Push(const uint8_t *data, size_t size, int64_t pts, bool isKeyFrame);
+    void Close();
+
+private:
+    struct Packet
+    {
+        std::vector<uint8_t> data;
+        int64_t pts = 0;
+        bool isKeyFrame = false;
+        bool end = false;
+    };
+
+    Packet &Acquire();
+    // Reads the GOP lines before resumePts from an earlier sidecar and the
+    // state saved there.
+    bool LoadResume(const std::string &path, int64_t resumePts, std::string &kept);
+    void HashThread();
+    void FinishGop();
+    void SaveState(int64_t pts);
+
+    FILE *m_file = nullptr;
+    bool m_resumable = false;
+    std::vector<Packet> m_ring;
+    std::atomic<uint64_t> m_head = 0;
+    std::atomic<uint64_t> m_tail = 0;
+    std::thread m_thread;
+
+    // Hash thread only.
+    Sha256 m_stream;
+    Sha256 m_gop;
+    int64_t m_gopPts = 0;
+    uint64_t m_gopPackets = 0;
+    uint64_t m_gopBytes = 0;
+    uint64_t m_packets = 0;
+    uint64_t m_bytes = 0;
+};
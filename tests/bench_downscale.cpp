@@ -0,0 +1,75 @@
+#include "lookahead.h"
+
+#include <chrono>
+#include <stdio.h>
+#include <vector>
+
+#include "check.h"
+
+// Times Lookahead::Downscale over NV12 and P010 luma at the row steps the
+// cost control picks from, and checks it against a plain reference first.
+
+static void ReferenceDownscale(const uint8_t *luma, size_t pitch, bool is16Bit, uint32_t rowStep,
+                               uint8_t *out, uint32_t blocksX, uint32_t blocksY)
+{
+    uint32_t rows = 8 / rowStep;
+    for (uint32_t by = 0; by < blocksY; by++) {
+        for (uint32_t bx = 0; bx < blocksX; bx++) {
+            uint32_t sum = 0;
+            for (uint32_t y = by * 8; y < by * 8 + 8; y += rowStep) {
+                for (uint32_t x = bx * 8; x < bx * 8 + 8; x++) {
+                    if (is16Bit)
+                        sum += reinterpret_cast<const uint16_t *>(luma + y * pitch)[x] >> 8;
+                    else
+                        sum += luma[y * pitch + x];
+                }
+            }
+            out[by * blocksX + bx] = static_cast<uint8_t>(sum / (rows * 8));
+        }
+    }
+}
+
+static void Run(const char *name, uint32_t width, uint32_t height, bool is16Bit)
+{
+    size_t bpp = is16Bit ? 2 : 1;
+    size_t pitch = (width * bpp + 63) & ~size_t(63);
+    std::vector<uint8_t> luma(pitch * height);
+    uint32_t seed = 1;
+    for (uint8_t &byte : luma) {
+        seed = seed * 1664525 + 1013904223;
+        byte = static_cast<uint8_t>(seed >> 24);
+    }
+    if (is16Bit) {
+        // P010 keeps its 10 bits at the top of each sample.
+        for (size_t i = 0; i + 1 < luma.size(); i += 2)
+            luma[i] &= 0xc0;
+    }
+
+    uint32_t blocksX = width / 8;
+    uint32_t blocksY = height / 8;
+    std::vector<uint8_t> out(blocksX * blocksY);
+    std::vector<uint8_t> expected(out.size());
+
+    for (uint32_t rowStep = 1; rowStep <= 4; rowStep *= 2) {
+        Lookahead::Downscale(luma.data(), pitch, is16Bit, rowStep, out.data(), blocksX, blocksY);
+        ReferenceDownscale(luma.data(), pitch, is16Bit, rowStep, expected.data(), blocksX, blocksY);
+        CHECK(out == expected);
+
+        const int iterations = 200;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; i++)
+            Lookahead::Downscale(luma.data(), pitch, is16Bit, rowStep, out.data(), blocksX, blocksY);
+        double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / iterations;
+        double gbs = static_cast<double>(width) * height * bpp / rowStep / (us * 1000.0);
+        printf("%-5s %4ux%-4u rowStep %u: %8.1f us/frame, %5.2f GB/s of luma read\n", name, width, height, rowStep, us, gbs);
+    }
+}
+
+int main()
+{
+    Run("NV12", 1920, 1080, false);
+    Run("P010", 1920, 1080, true);
+    Run("NV12", 3840, 2160, false);
+    Run("P010", 3840, 2160, true);
+    return TestResult();
+}
@@ -0,0 +1,105 @@
+#include "async_file_writer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.h"
+
+// Writes the same packet sequence through AsyncFileWriter, as configured by
+// the elementary stream container and by default, and through buffered
+// fwrite(), each to a file on disk including fdatasync(). Set
+// DVCP_VAAPI_BENCH_DIR to measure a different filesystem than /var/tmp.
+
+static constexpr size_t TotalSize = 512 << 20;
+
+static double Seconds(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void Report(const char *name, double seconds)
+{
+    printf("%-32s %6.2f s, %7.1f MB/s\n", name, seconds, TotalSize / 1e6 / seconds);
+}
+
+static bool ReadBack(const std::string &path, const std::vector<uint8_t> &expected)
+{
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+    std::vector<uint8_t> data(expected.size() + 1);
+    size_t size = fread(data.data(), 1, data.size(), file);
+    fclose(file);
+    data.resize(size);
+    return data == expected;
+}
+
+int main()
+{
+    const char *dir = getenv("DVCP_VAAPI_BENCH_DIR");
+    std::string path = std::string(dir ? dir : "/var/tmp") + "/dvcp-vaapi-bench-" + std::to_string(getpid());
+
+    // Packet sizes of a 50 Mb/s stream at 25 fps with a keyframe every 50.
+    std::vector<uint8_t> pattern(2 << 20);
+    for (size_t i = 0; i < pattern.size(); i++)
+        pattern[i] = static_cast<uint8_t>(i * 131 + (i >> 13));
+    std::vector<size_t> packets;
+    for (size_t total = 0, n = 0; total < TotalSize; n++) {
+        size_t size = std::min(n % 50 ? 220000 + n * 7919 % 60000 : 1200000, TotalSize - total);
+        packets.push_back(size);
+        total += size;
+    }
+    std::vector<uint8_t> expected;
+    expected.reserve(TotalSize);
+    for (size_t size : packets)
+        expected.insert(expected.end(), pattern.begin(), pattern.begin() + size);
+
+    struct Config
+    {
+        const char *name;
+        size_t blockSize;
+        uint32_t blockCount;
+        bool direct;
+    };
+    const Config configs[] = {
+        { "AsyncFileWriter 2x2 MB O_DIRECT", 2 << 20, 2, true },
+        { "AsyncFileWriter 4x4 MB", AsyncFileWriter::DefaultBlockSize, AsyncFileWriter::DefaultBlockCount, false },
+    };
+    for (const Config &config : configs) {
+        auto start = std::chrono::steady_clock::now();
+        AsyncFileWriter writer;
+        bool ok = writer.Open(path, config.blockSize, config.blockCount, config.direct);
+        for (size_t size : packets)
+            ok = ok && writer.Write(pattern.data(), size);
+        ok = ok && writer.Sync();
+        // Patched like the IVF frame count.
+        writer.RewriteOnClose(4, "HEAD", 4);
+        ok = writer.Close() && ok;
+        Report(config.name, Seconds(start));
+        CHECK(ok);
+
+        std::vector<uint8_t> patched = expected;
+        std::copy_n("HEAD", 4, patched.begin() + 4);
+        CHECK(ReadBack(path, patched));
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    FILE *file = fopen(path.c_str(), "wb");
+    bool ok = file != nullptr;
+    for (size_t size : packets)
+        ok = ok && fwrite(pattern.data(), 1, size, file) == size;
+    ok = ok && fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+    ok = file && fclose(file) == 0 && ok;
+    Report("fwrite", Seconds(start));
+    CHECK(ok);
+    CHECK(ReadBack(path, expected));
+
+    unlink(path.c_str());
+    return TestResult();
+}
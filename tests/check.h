@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdio.h>
+
+// Assertions for the test executables. A failing CHECK reports itself and
+// the run carries on, so one invocation lists every broken case; main()
+// returns TestResult() for meson to pick up.
+inline int s_checkFailures = 0;
+
+#define CHECK(cond)                                                                \
+    do {                                                                           \
+        if (!(cond)) {                                                             \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            s_checkFailures++;                                                     \
+        }                                                                          \
+    } while (0)
+
+#define CHECK_NEAR(a, b, eps) CHECK((a) - (b) <= (eps) && (b) - (a) <= (eps))
+
+inline int TestResult()
+{
+    if (s_checkFailures)
+        fprintf(stderr, "%d checks failed\n", s_checkFailures);
+    return s_checkFailures ? 1 : 0;
+}
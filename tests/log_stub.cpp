@@ -0,0 +1,17 @@
+#include <stdarg.h>
+#include <stdio.h>
+
+#include "wrapper/host_api.h"
+
+// Stands in for the host's log, so modules can be tested without a host.
+void g_Log(uint32_t p_LogLevel, const char *p_pFmt, ...)
+{
+    if (p_LogLevel == logLevelInfo)
+        return;
+
+    va_list args;
+    va_start(args, p_pFmt);
+    vfprintf(stderr, p_pFmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
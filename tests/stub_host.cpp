@@ -0,0 +1,515 @@
+#include "stub_host.h"
+
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wrapper/plugin_api.h"
+
+static StubHost *s_host = nullptr;
+
+static size_t GetTypeSize(PropertyType type)
+{
+    switch (type) {
+        case propTypeInt8:
+        case propTypeUInt8:
+        case propTypeString:
+            return 1;
+        case propTypeInt16:
+        case propTypeUInt16:
+            return 2;
+        case propTypeInt32:
+        case propTypeUInt32:
+            return 4;
+        case propTypeInt64:
+        case propTypeUInt64:
+        case propTypeDouble:
+            return 8;
+        default:
+            return 0;
+    }
+}
+
+StubHost::StubHost()
+{
+    assert(!s_host);
+    s_host = this;
+    m_host.version = IOPlugin::version;
+    m_host.pHandleMessage = HandleMessage;
+    StatusCode err = pluginInit(&m_host, &m_plugin);
+    assert(err == errNone);
+    (void)err;
+}
+
+StubHost::~StubHost()
+{
+    for (auto &[obj, object] : m_objects)
+        delete object;
+    s_host = nullptr;
+}
+
+StubHost::Object *StubHost::Find(ObjectRef obj) const
+{
+    auto it = m_objects.find(obj);
+    return it != m_objects.end() ? it->second : nullptr;
+}
+
+ObjectRef StubHost::Create(ObjectKind kind)
+{
+    Object *object = new Object();
+    object->kind = kind;
+    m_objects[object] = object;
+    return object;
+}
+
+ObjectRef StubHost::CreateProps()
+{
+    return Create(kindProps);
+}
+
+ObjectRef StubHost::CreateBuffer(const void *data, size_t size)
+{
+    ObjectRef obj = Create(kindBuffer);
+    if (size)
+        Find(obj)->data.assign(static_cast<const uint8_t *>(data), static_cast<const uint8_t *>(data) + size);
+    return obj;
+}
+
+ObjectRef StubHost::CreateList()
+{
+    return Create(kindList);
+}
+
+ObjectRef StubHost::CreateCallback()
+{
+    return Create(kindCallback);
+}
+
+void StubHost::Retain(ObjectRef obj)
+{
+    Find(obj)->refs++;
+}
+
+void StubHost::Release(ObjectRef obj)
+{
+    Object *object = Find(obj);
+    if (--object->refs > 0)
+        return;
+
+    m_objects.erase(obj);
+    for (ObjectRef entry : object->entries)
+        Release(entry);
+    delete object;
+}
+
+void StubHost::SetProperty(ObjectRef obj, PropertyID id, PropertyType type, const void *value, int count)
+{
+    Object *object = Find(obj);
+    if (type == propTypeNull || !value) {
+        object->props.erase(id);
+        return;
+    }
+
+    Property &prop = object->props[id];
+    prop.type = type;
+    prop.count = count;
+    const uint8_t *bytes = static_cast<const uint8_t *>(value);
+    prop.value.assign(bytes, bytes + GetTypeSize(type) * count);
+}
+
+const std::vector<uint8_t> *StubHost::GetProperty(ObjectRef obj, PropertyID id, PropertyType *type) const
+{
+    const Object *object = Find(obj);
+    auto it = object->props.find(id);
+    if (it == object->props.end())
+        return nullptr;
+    if (type)
+        *type = it->second.type;
+    return &it->second.value;
+}
+
+std::vector<uint8_t> &StubHost::GetData(ObjectRef obj)
+{
+    return Find(obj)->data;
+}
+
+const std::vector<ObjectRef> &StubHost::GetEntries(ObjectRef list) const
+{
+    return Find(list)->entries;
+}
+
+void StubHost::SetTrack(ObjectRef track)
+{
+    m_track = track;
+}
+
+void StubHost::SetKeepSentBuffers(bool keep)
+{
+    m_keepSent = keep;
+    if (!keep) {
+        for (auto &[obj, data] : m_sent)
+            Release(obj);
+        m_sent.clear();
+    }
+}
+
+bool StubHost::SentBuffersUnchanged() const
+{
+    for (const auto &[obj, data] : m_sent) {
+        if (Find(obj)->data != data)
+            return false;
+    }
+    return true;
+}
+
+std::vector<StubHost::Packet> &StubHost::GetPackets()
+{
+    return m_packets;
+}
+
+size_t StubHost::GetLiveObjects() const
+{
+    return m_objects.size();
+}
+
+size_t StubHost::GetErrors() const
+{
+    return m_errors;
+}
+
+void StubHost::SetQuiet(bool quiet)
+{
+    m_quiet = quiet;
+}
+
+std::vector<StubHost::Codec> StubHost::ListCodecs()
+{
+    std::vector<Codec> codecs;
+    ObjectRef list = CreateList();
+    if (Send(msgPluginListCodecs, list) == errNone) {
+        for (ObjectRef entry : GetEntries(list)) {
+            Codec codec;
+            const std::vector<uint8_t> *uuid = GetProperty(entry, pIOPropUUID);
+            const std::vector<uint8_t> *group = GetProperty(entry, pIOPropGroup);
+            const std::vector<uint8_t> *name = GetProperty(entry, pIOPropName);
+            const std::vector<uint8_t> *fourcc = GetProperty(entry, pIOPropFourCC);
+            const std::vector<uint8_t> *depth = GetProperty(entry, pIOPropBitDepth);
+            if (!uuid || uuid->size() != 16)
+                continue;
+            codec.uuid = *uuid;
+            if (group)
+                codec.name.assign(group->begin(), group->end());
+            if (name)
+                codec.name.append(" ").append(name->begin(), name->end());
+            if (fourcc && fourcc->size() == sizeof(codec.fourcc))
+                memcpy(&codec.fourcc, fourcc->data(), sizeof(codec.fourcc));
+            if (depth && depth->size() == sizeof(codec.depth))
+                memcpy(&codec.depth, depth->data(), sizeof(codec.depth));
+            codecs.push_back(std::move(codec));
+        }
+    }
+    Release(list);
+    return codecs;
+}
+
+void StubHost::ReleasePluginObject(ObjectRef obj)
+{
+    int refs = 0;
+    Send(msgRelease, obj, &refs);
+}
+
+static std::vector<uint8_t> ParseHexId(const std::string &id)
+{
+    std::vector<uint8_t> bytes;
+    for (size_t i = 0; i + 1 < id.size(); i += 2)
+        bytes.push_back(static_cast<uint8_t>(std::stoi(id.substr(i, 2), nullptr, 16)));
+    return bytes;
+}
+
+// NV12, or P010 with the samples in the high bits, moving a little every frame.
+static void FillFrame(std::vector<uint8_t> &frame, uint32_t width, uint32_t height, uint32_t depth, int64_t pts)
+{
+    uint32_t bytes = depth > 8 ? 2 : 1;
+    frame.resize(width * height * 3 / 2 * bytes);
+    for (uint32_t y = 0; y < height * 3 / 2; y++) {
+        for (uint32_t x = 0; x < width; x++) {
+            uint32_t value = (x + y * 3 + pts * 5) & 0xFF;
+            size_t offset = (static_cast<size_t>(y) * width + x) * bytes;
+            if (bytes == 2) {
+                frame[offset] = static_cast<uint8_t>(value << 6 & 0xC0);
+                frame[offset + 1] = static_cast<uint8_t>(value >> 2 | (value & 0xC0));
+            } else {
+                frame[offset] = static_cast<uint8_t>(value);
+            }
+        }
+    }
+}
+
+StatusCode StubHost::RunRender(const Render &render)
+{
+    const uint32_t frameRate[] = { 30, 1 };
+    const int16_t bt709 = 1;
+    const uint8_t zero = 0;
+    const uint32_t mediaType = mediaVideo;
+
+    ObjectRef codec = nullptr;
+    StatusCode err = Send(msgCreate, render.codec->uuid.data(), &codec);
+    if (err != errNone)
+        return err;
+
+    ObjectRef initProps = CreateProps();
+    ObjectRef callback = CreateCallback();
+    ObjectRef openBuf = CreateBuffer();
+    SetProperty(openBuf, pIOPropContainerList, propTypeString, render.container.data(),
+                static_cast<int>(render.container.size()));
+    SetProperty(openBuf, pIOPropPath, propTypeString, render.path.data(), static_cast<int>(render.path.size()));
+    SetProperty(openBuf, pIOPropWidth, propTypeUInt32, &render.width, 1);
+    SetProperty(openBuf, pIOPropHeight, propTypeUInt32, &render.height, 1);
+    SetProperty(openBuf, pIOPropFrameRate, propTypeUInt32, frameRate, 2);
+    SetProperty(openBuf, pIOPropDataRange, propTypeUInt8, &zero, 1);
+    SetProperty(openBuf, pIOPropFieldOrder, propTypeUInt8, &zero, 1);
+    SetProperty(openBuf, pIOPropColorPrimaries, propTypeInt16, &bt709, 1);
+    SetProperty(openBuf, pIOTransferCharacteristics, propTypeInt16, &bt709, 1);
+    SetProperty(openBuf, pIOColorMatrix, propTypeInt16, &bt709, 1);
+    SetProperty(openBuf, "vaapi_device", propTypeInt32, &render.device, 1);
+    for (const auto &[key, value] : render.settings)
+        SetProperty(openBuf, key.c_str(), propTypeInt32, &value, 1);
+
+    ObjectRef container = nullptr;
+    ObjectRef track = nullptr;
+    ObjectRef containerProps = CreateProps();
+    ObjectRef trackProps = CreateProps();
+
+    err = Send(msgCodecInit, codec, initProps);
+    if (err == errNone)
+        err = Send(msgCodecSetCallback, codec, callback);
+    if (err == errNone)
+        err = Send(msgCodecOpen, codec, openBuf);
+
+    if (err == errNone && render.container != "mp4") {
+        std::vector<uint8_t> uuid = ParseHexId(render.container);
+        SetProperty(containerProps, pIOPropPath, propTypeString, render.path.data(), static_cast<int>(render.path.size()));
+        SetProperty(trackProps, pIOPropMediaType, propTypeUInt32, &mediaType, 1);
+        SetProperty(trackProps, pIOPropWidth, propTypeUInt32, &render.width, 1);
+        SetProperty(trackProps, pIOPropHeight, propTypeUInt32, &render.height, 1);
+        SetProperty(trackProps, pIOPropFrameRate, propTypeUInt32, frameRate, 2);
+        err = Send(msgCreate, uuid.data(), &container);
+        if (err == errNone)
+            err = Send(msgContainerInit, container, containerProps);
+        if (err == errNone)
+            err = Send(msgContainerOpen, container, containerProps);
+        if (err == errNone)
+            err = Send(msgContainerAddTrack, container, trackProps, openBuf, &track);
+        SetTrack(track);
+    }
+
+    std::vector<uint8_t> frame;
+    for (int64_t pts = 0; pts < render.frames && err == errNone; pts++) {
+        FillFrame(frame, render.width, render.height, render.codec->depth, pts);
+        ObjectRef frameBuf = CreateBuffer(frame.data(), frame.size());
+        SetProperty(frameBuf, pIOPropWidth, propTypeUInt32, &render.width, 1);
+        SetProperty(frameBuf, pIOPropHeight, propTypeUInt32, &render.height, 1);
+        SetProperty(frameBuf, pIOPropPTS, propTypeInt64, &pts, 1);
+        err = Send(msgCodecProcessData, codec, frameBuf);
+        if (err == errMoreData)
+            err = errNone;
+        Release(frameBuf);
+    }
+    if (err == errNone)
+        err = Send(msgCodecProcessData, codec, static_cast<ObjectRef>(nullptr));
+
+    if (track) {
+        StatusCode trackErr = Send(msgTrackWrite, track, static_cast<ObjectRef>(nullptr));
+        StatusCode closeErr = Send(msgContainerClose, container);
+        if (err == errNone)
+            err = trackErr != errNone ? trackErr : closeErr;
+        ReleasePluginObject(track);
+        SetTrack(nullptr);
+    }
+    if (container)
+        ReleasePluginObject(container);
+    ReleasePluginObject(codec);
+
+    Release(trackProps);
+    Release(containerProps);
+    Release(openBuf);
+    Release(callback);
+    Release(initProps);
+    return err;
+}
+
+StatusCode StubHost::ProcessData(ObjectRef buffer)
+{
+    Object *object = Find(buffer);
+    if (!object || object->kind != kindBuffer || object->locks)
+        return errInvalidParam;
+
+    Packet packet;
+    auto get = [object](PropertyID id, void *value, size_t size) {
+        auto it = object->props.find(id);
+        if (it != object->props.end() && it->second.value.size() == size)
+            memcpy(value, it->second.value.data(), size);
+    };
+    uint8_t isKeyFrame = 0;
+    get(pIOPropPTS, &packet.pts, sizeof(packet.pts));
+    get(pIOPropDTS, &packet.dts, sizeof(packet.dts));
+    get(pIOPropIsKeyFrame, &isKeyFrame, sizeof(isKeyFrame));
+    packet.isKeyFrame = isKeyFrame;
+    packet.data = object->data;
+    m_packets.push_back(std::move(packet));
+
+    if (m_keepSent) {
+        Retain(buffer);
+        m_sent.emplace_back(buffer, object->data);
+    }
+    return m_track ? Send(msgTrackWrite, m_track, buffer) : errNone;
+}
+
+StatusCode StubHost::HandleMessage(MessageID id, ...)
+{
+    StubHost *host = s_host;
+    va_list args;
+    va_start(args, id);
+
+    StatusCode err = errNone;
+    switch (id) {
+        case msgCreate: {
+            const unsigned char *uuid = va_arg(args, const unsigned char *);
+            ObjectRef *obj = va_arg(args, ObjectRef *);
+            if (!memcmp(uuid, UUID_PropertyCollection, 16))
+                *obj = host->CreateProps();
+            else if (!memcmp(uuid, UUID_PinnedBuffer, 16) || !memcmp(uuid, UUID_UnpinnedBuffer, 16))
+                *obj = host->CreateBuffer();
+            else
+                err = errUnsupported;
+            break;
+        }
+        case msgRetain:
+        case msgRelease: {
+            ObjectRef obj = va_arg(args, ObjectRef);
+            int *newRef = va_arg(args, int *);
+            Object *object = host->Find(obj);
+            if (!object) {
+                err = errInvalidParam;
+                break;
+            }
+            *newRef = id == msgRetain ? object->refs + 1 : object->refs - 1;
+            if (id == msgRetain)
+                host->Retain(obj);
+            else
+                host->Release(obj);
+            break;
+        }
+        case msgResolveLog: {
+            uint32_t level = va_arg(args, uint32_t);
+            const char *msg = va_arg(args, const char *);
+            if (level == logLevelError)
+                host->m_errors++;
+            if (level != logLevelInfo && !host->m_quiet)
+                fprintf(stderr, "%s\n", msg);
+            break;
+        }
+        case msgPropSet: {
+            ObjectRef obj = va_arg(args, ObjectRef);
+            PropertyID prop = va_arg(args, PropertyID);
+            PropertyType type = static_cast<PropertyType>(va_arg(args, int));
+            const void *value = va_arg(args, const void *);
+            int count = va_arg(args, int);
+            if (host->Find(obj))
+                host->SetProperty(obj, prop, type, value, count);
+            else
+                err = errInvalidParam;
+            break;
+        }
+        case msgPropGet: {
+            ObjectRef obj = va_arg(args, ObjectRef);
+            PropertyID prop = va_arg(args, PropertyID);
+            PropertyType *type = va_arg(args, PropertyType *);
+            const void **value = va_arg(args, const void **);
+            int *count = va_arg(args, int *);
+            Object *object = host->Find(obj);
+            if (!object) {
+                err = errInvalidParam;
+                break;
+            }
+            auto it = object->props.find(prop);
+            if (it == object->props.end()) {
+                err = errNoParam;
+                break;
+            }
+            *type = it->second.type;
+            *value = it->second.value.data();
+            *count = it->second.count;
+            break;
+        }
+        case msgPropClear: {
+            Object *object = host->Find(va_arg(args, ObjectRef));
+            if (object)
+                object->props.clear();
+            else
+                err = errInvalidParam;
+            break;
+        }
+        case msgListAppend: {
+            ObjectRef list = va_arg(args, ObjectRef);
+            ObjectRef entry = va_arg(args, ObjectRef);
+            Object *object = host->Find(list);
+            if (!object || object->kind != kindList || !host->Find(entry)) {
+                err = errInvalidParam;
+                break;
+            }
+            host->Retain(entry);
+            object->entries.push_back(entry);
+            break;
+        }
+        case msgBufferResize: {
+            Object *object = host->Find(va_arg(args, ObjectRef));
+            size_t size = va_arg(args, size_t);
+            // Data may move, a locked buffer can't be resized.
+            if (!object || object->kind != kindBuffer || object->locks)
+                err = errInvalidOperation;
+            else
+                object->data.resize(size);
+            break;
+        }
+        case msgBufferLock: {
+            Object *object = host->Find(va_arg(args, ObjectRef));
+            char **data = va_arg(args, char **);
+            size_t *size = va_arg(args, size_t *);
+            if (!object || object->kind != kindBuffer) {
+                err = errInvalidParam;
+                break;
+            }
+            object->locks++;
+            *data = reinterpret_cast<char *>(object->data.data());
+            *size = object->data.size();
+            break;
+        }
+        case msgBufferUnlock: {
+            Object *object = host->Find(va_arg(args, ObjectRef));
+            if (!object || !object->locks)
+                err = errInvalidOperation;
+            else
+                object->locks--;
+            break;
+        }
+        case msgCodecProcessData: {
+            ObjectRef callback = va_arg(args, ObjectRef);
+            ObjectRef buffer = va_arg(args, ObjectRef);
+            Object *object = host->Find(callback);
+            err = object && object->kind == kindCallback ? host->ProcessData(buffer) : errInvalidParam;
+            break;
+        }
+        case msgCodecAcceptFramePTS:
+            break;
+        default:
+            err = errUnsupported;
+            break;
+    }
+
+    va_end(args);
+    if (err != errNone && err != errUnsupported && err != errNoParam)
+        host->m_errors++;
+    return err;
+}
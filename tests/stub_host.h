@@ -0,0 +1,139 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "wrapper/host_api.h"
+
+// The host side of the IOPlugin API, in process, for tests that drive the
+// plugin's codecs and containers through pluginInit() the way Resolve does.
+// Property collections, buffers and lists are refcounted and counted, so a
+// test can check that the plugin gives back every reference it took. The
+// codec callback keeps a copy of each packet the plugin sends, and can hand
+// the packets on to one of the plugin's container tracks.
+class StubHost
+{
+public:
+    // A codec the plugin lists through msgPluginListCodecs.
+    struct Codec
+    {
+        std::vector<uint8_t> uuid;
+        std::string name; // group and name
+        uint32_t fourcc = 0;
+        uint32_t depth = 8;
+    };
+
+    // One render as Resolve runs it: the codec is opened, then the track is
+    // added to the container when the user picked one of the plugin's, the
+    // frames go in, the codec is flushed and everything is released.
+    struct Render
+    {
+        const Codec *codec = nullptr;
+        uint32_t width = 256;
+        uint32_t height = 144;
+        int frames = 8;
+        int32_t device = 128;
+        // "mp4" for the host's MP4, else the hex id of one of the plugin's containers.
+        std::string container = "mp4";
+        std::string path;
+        // vaapi_* settings on top of the defaults.
+        std::vector<std::pair<std::string, int32_t>> settings;
+    };
+
+    struct Packet
+    {
+        int64_t pts = 0;
+        int64_t dts = 0;
+        bool isKeyFrame = false;
+        std::vector<uint8_t> data;
+    };
+
+    // Only one at a time, the host API is a set of plain functions.
+    StubHost();
+    ~StubHost();
+
+    // Sends a message to the plugin, as its pHandleMessage takes it.
+    template <typename... Args>
+    StatusCode Send(MessageID id, Args... args)
+    {
+        return m_plugin.pHandleMessage(id, args...);
+    }
+
+    std::vector<Codec> ListCodecs();
+    // Leaves the packets the codec sent in GetPackets().
+    StatusCode RunRender(const Render &render);
+
+    // Each comes with one reference for the caller to Release().
+    ObjectRef CreateProps();
+    ObjectRef CreateBuffer(const void *data = nullptr, size_t size = 0);
+    ObjectRef CreateList();
+    ObjectRef CreateCallback();
+    void Release(ObjectRef obj);
+
+    void SetProperty(ObjectRef obj, PropertyID id, PropertyType type, const void *value, int count);
+    // nullptr when the property isn't set.
+    const std::vector<uint8_t> *GetProperty(ObjectRef obj, PropertyID id, PropertyType *type = nullptr) const;
+    std::vector<uint8_t> &GetData(ObjectRef obj);
+    const std::vector<ObjectRef> &GetEntries(ObjectRef list) const;
+
+    // Writes the callback's packets to a track of one of the plugin's
+    // containers, as the host does when the user picked one.
+    void SetTrack(ObjectRef track);
+    // Holds on to every buffer the plugin sends, as a host may, so tests
+    // can check the plugin doesn't write to them afterwards.
+    void SetKeepSentBuffers(bool keep);
+    bool SentBuffersUnchanged() const;
+
+    std::vector<Packet> &GetPackets();
+    size_t GetLiveObjects() const;
+    size_t GetErrors() const;
+    void SetQuiet(bool quiet);
+
+private:
+    struct Property
+    {
+        PropertyType type;
+        int count;
+        std::vector<uint8_t> value;
+    };
+
+    enum ObjectKind
+    {
+        kindProps,
+        kindBuffer,
+        kindList,
+        kindCallback,
+    };
+
+    struct Object
+    {
+        ObjectKind kind;
+        int refs = 1;
+        std::map<std::string, Property> props;
+        std::vector<uint8_t> data;
+        int locks = 0;
+        std::vector<ObjectRef> entries;
+    };
+
+    static StatusCode HandleMessage(MessageID id, ...);
+    Object *Find(ObjectRef obj) const;
+    ObjectRef Create(ObjectKind kind);
+    void Retain(ObjectRef obj);
+    StatusCode ProcessData(ObjectRef buffer);
+    void ReleasePluginObject(ObjectRef obj);
+
+    APIContext m_host = {};
+    APIContext m_plugin = {};
+    std::map<ObjectRef, Object *> m_objects;
+    std::vector<Packet> m_packets;
+    ObjectRef m_track = nullptr;
+    bool m_keepSent = false;
+    std::vector<std::pair<ObjectRef, std::vector<uint8_t>>> m_sent;
+    size_t m_errors = 0;
+    bool m_quiet = false;
+};
@@ -0,0 +1,193 @@
+#include "av1_obu.h"
+
+#include <vector>
+
+#include "check.h"
+
+// Sequence header OBUs written field by field from the AV1 spec, and the
+// av1C records ISO/IEC 14496-15 style muxers build from them.
+
+// Temporal delimiter, then a sequence header with a size field: main
+// profile 1920x1080 8-bit 4:2:0 at level 4.0, BT.709, order hints and
+// screen content tool selection, as VAAPI drivers write it.
+static const uint8_t Seq1080pObus[] = {
+    0x12, 0x00, 0x0a, 0x0e, 0x00, 0x00, 0x00, 0x42, 0xab, 0xbf, 0xc3, 0x73,
+    0x09, 0xe6, 0x40, 0x40, 0x40, 0x41,
+};
+
+// Extension header and no size field. 3840x2160 10-bit full range at level
+// 5.1 high tier with vertical chroma siting and no colour description.
+// Timing info with a decoder model, two operating points with buffer delays
+// and initial display delays, frame ids, forced screen content tools.
+static const uint8_t Seq2160pObu[] = {
+    0x0c, 0x18, 0x04, 0x00, 0x00, 0x0f, 0xa4, 0x00, 0x03, 0xa9, 0x83, 0xa4,
+    0x00, 0x00, 0x0f, 0xa4, 0x84, 0x84, 0x40, 0xdb, 0xbe, 0x89, 0x63, 0x22,
+    0x02, 0x91, 0x77, 0xdf, 0xf0, 0xdf, 0x55, 0xfc, 0xaa, 0x5a,
+};
+
+// Reduced still picture header, profile 1 with sRGB 4:4:4 at level 5.
+static const uint8_t SeqStillObu[] = {
+    0x0a, 0x0a, 0x39, 0x66, 0x7f, 0xfb, 0xfc, 0xa4, 0x04, 0x34, 0x00, 0x80,
+};
+
+static const uint8_t Seq1080pRecord[] = {
+    0x81, 0x08, 0x0c, 0x00, 0x0a, 0x0e, 0x00, 0x00, 0x00, 0x42, 0xab, 0xbf,
+    0xc3, 0x73, 0x09, 0xe6, 0x40, 0x40, 0x40, 0x41,
+};
+
+// The size field is added, the extension header kept.
+static const uint8_t Seq2160pRecord[] = {
+    0x81, 0x0d, 0xcd, 0x00, 0x0e, 0x18, 0x20, 0x04, 0x00, 0x00, 0x0f, 0xa4,
+    0x00, 0x03, 0xa9, 0x83, 0xa4, 0x00, 0x00, 0x0f, 0xa4, 0x84, 0x84, 0x40,
+    0xdb, 0xbe, 0x89, 0x63, 0x22, 0x02, 0x91, 0x77, 0xdf, 0xf0, 0xdf, 0x55,
+    0xfc, 0xaa, 0x5a,
+};
+
+static const uint8_t SeqStillRecord[] = {
+    0x81, 0x25, 0x00, 0x00, 0x0a, 0x0a, 0x39, 0x66, 0x7f, 0xfb, 0xfc, 0xa4,
+    0x04, 0x34, 0x00, 0x80,
+};
+
+// Encoder output, not written by hand: the first temporal unit of 128x64
+// AV1 sequences from libaom, rav1e and SVT-AV1, through the end of its
+// sequence header, and a whole later one holding only a frame header that
+// shows an earlier frame. The av1C libavif wrote next to each is the record
+// header the test expects, so the fields are read the way another muxer
+// reads them.
+struct Capture
+{
+    const char *encoder;
+    std::vector<uint8_t> packet;
+    uint8_t av1C[4]; // without configOBUs
+    uint8_t level;
+    uint8_t highBitDepth;
+    uint8_t colorRange;
+};
+
+static const Capture Captures[] = {
+    { "libaom 10-bit",
+      { 0x12, 0x00, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x03, 0x2f, 0xff, 0xcd, 0xaf, 0x94, 0x84 },
+      { 0x81, 0x00, 0x4c, 0x00 }, 0, 1, 1 },
+    { "rav1e 10-bit",
+      { 0x12, 0x00, 0x0a, 0x0d, 0x00, 0x00, 0x00, 0xf9, 0x97, 0xff, 0xe2, 0x10, 0xae, 0x81, 0x01, 0x01, 0x4a },
+      { 0x81, 0x1f, 0x4c, 0x00 }, 31, 1, 1 },
+    { "SVT-AV1 10-bit",
+      { 0x12, 0x00, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x03, 0x2f, 0xff, 0xcf, 0xbf, 0x9c, 0x04 },
+      { 0x81, 0x00, 0x4c, 0x00 }, 0, 1, 0 },
+    { "libaom 8-bit still picture",
+      { 0x12, 0x00, 0x0a, 0x06, 0x18, 0x19, 0x7f, 0xfe, 0xc0, 0x84 },
+      { 0x81, 0x00, 0x0c, 0x00 }, 0, 0, 1 },
+};
+
+// rav1e's third temporal unit.
+static const uint8_t ShowExistingFrame[] = { 0x12, 0x00, 0x1a, 0x01, 0xc8 };
+
+static void CheckRecord(const uint8_t *obus, size_t size, const uint8_t *expected, size_t expectedSize)
+{
+    std::vector<uint8_t> record;
+    CHECK(BuildAV1ConfigRecord(obus, size, record));
+    CHECK(record == std::vector<uint8_t>(expected, expected + expectedSize));
+
+    // An av1C passed in again comes back as it is.
+    std::vector<uint8_t> again;
+    CHECK(BuildAV1ConfigRecord(record.data(), record.size(), again));
+    CHECK(again == record);
+}
+
+static void TestSequenceHeaders()
+{
+    AV1SequenceHeader header;
+    CHECK(ParseAV1SequenceHeader(Seq1080pObus + 4, sizeof(Seq1080pObus) - 4, header));
+    CHECK(header.profile == 0 && header.level == 8 && header.tier == 0);
+    CHECK(header.highBitDepth == 0 && header.twelveBit == 0 && header.monochrome == 0);
+    CHECK(header.subsamplingX == 1 && header.subsamplingY == 1 && header.chromaSamplePosition == 0);
+    CHECK(header.colorPrimaries == 1 && header.transferCharacteristics == 1 && header.matrixCoefficients == 1);
+    CHECK(header.colorRange == 0);
+    CHECK(header.maxWidth == 1920 && header.maxHeight == 1080);
+
+    CHECK(ParseAV1SequenceHeader(Seq2160pObu + 2, sizeof(Seq2160pObu) - 2, header));
+    CHECK(header.profile == 0 && header.level == 13 && header.tier == 1);
+    CHECK(header.highBitDepth == 1 && header.twelveBit == 0 && header.monochrome == 0);
+    CHECK(header.subsamplingX == 1 && header.subsamplingY == 1 && header.chromaSamplePosition == 1);
+    CHECK(header.colorPrimaries == 2 && header.transferCharacteristics == 2 && header.matrixCoefficients == 2);
+    CHECK(header.colorRange == 1);
+    CHECK(header.maxWidth == 3840 && header.maxHeight == 2160);
+
+    CHECK(ParseAV1SequenceHeader(SeqStillObu + 2, sizeof(SeqStillObu) - 2, header));
+    CHECK(header.profile == 1 && header.level == 5 && header.tier == 0);
+    CHECK(header.subsamplingX == 0 && header.subsamplingY == 0 && header.colorRange == 1);
+    CHECK(header.maxWidth == 1024 && header.maxHeight == 768);
+
+    // Cut short inside the colour config.
+    CHECK(!ParseAV1SequenceHeader(Seq1080pObus + 4, 8, header));
+
+    CheckRecord(Seq1080pObus, sizeof(Seq1080pObus), Seq1080pRecord, sizeof(Seq1080pRecord));
+    CheckRecord(Seq2160pObu, sizeof(Seq2160pObu), Seq2160pRecord, sizeof(Seq2160pRecord));
+    CheckRecord(SeqStillObu, sizeof(SeqStillObu), SeqStillRecord, sizeof(SeqStillRecord));
+
+    // No sequence header, or a broken OBU before it.
+    std::vector<uint8_t> record;
+    const uint8_t delimiterOnly[] = { 0x12, 0x00 };
+    CHECK(!BuildAV1ConfigRecord(delimiterOnly, sizeof(delimiterOnly), record));
+    std::vector<uint8_t> forbidden(Seq1080pObus, Seq1080pObus + sizeof(Seq1080pObus));
+    forbidden[0] |= 0x80;
+    CHECK(!BuildAV1ConfigRecord(forbidden.data(), forbidden.size(), record));
+}
+
+static void TestCaptures()
+{
+    for (const Capture &capture : Captures) {
+        const std::vector<uint8_t> &packet = capture.packet;
+        AV1SequenceHeader header;
+        CHECK(ParseAV1SequenceHeader(packet.data() + 4, packet.size() - 4, header));
+        CHECK(header.profile == 0 && header.tier == 0 && header.level == capture.level);
+        CHECK(header.highBitDepth == capture.highBitDepth && header.twelveBit == 0 && header.monochrome == 0);
+        CHECK(header.subsamplingX == 1 && header.subsamplingY == 1 && header.chromaSamplePosition == 0);
+        CHECK(header.colorPrimaries == 2 && header.transferCharacteristics == 2 && header.matrixCoefficients == 2);
+        CHECK(header.colorRange == capture.colorRange);
+        CHECK(header.maxWidth == 128 && header.maxHeight == 64);
+
+        // The sequence header goes into configOBUs as it is, without the
+        // delimiter in front of it.
+        std::vector<uint8_t> expected(capture.av1C, capture.av1C + 4);
+        expected.insert(expected.end(), packet.begin() + 2, packet.end());
+        CheckRecord(packet.data(), packet.size(), expected.data(), expected.size());
+
+        CHECK(GetAV1TemporalDelimiterSize(packet.data(), packet.size()) == 2);
+    }
+
+    CHECK(GetAV1TemporalDelimiterSize(ShowExistingFrame, sizeof(ShowExistingFrame)) == 2);
+}
+
+static void TestTemporalDelimiters()
+{
+    // Frame OBU with a size field, three payload bytes.
+    const uint8_t frame[] = { 0x32, 0x03, 0x10, 0x20, 0x30 };
+    std::vector<uint8_t> packet(frame, frame + sizeof(frame));
+    CHECK(GetAV1TemporalDelimiterSize(packet.data(), packet.size()) == 0);
+
+    packet.insert(packet.begin(), { 0x12, 0x00 });
+    CHECK(GetAV1TemporalDelimiterSize(packet.data(), packet.size()) == 2);
+
+    // With an extension header, and two in a row.
+    packet.insert(packet.begin(), { 0x16, 0x08, 0x00 });
+    CHECK(GetAV1TemporalDelimiterSize(packet.data(), packet.size()) == 5);
+
+    // A packet that only holds a delimiter keeps it, a sample can't be empty.
+    CHECK(GetAV1TemporalDelimiterSize(packet.data() + 3, 2) == 0);
+
+    // The sequence header after the delimiter stays in the sample.
+    CHECK(GetAV1TemporalDelimiterSize(Seq1080pObus, sizeof(Seq1080pObus)) == 2);
+
+    // A size field past the end isn't trusted.
+    const uint8_t truncated[] = { 0x12, 0x05, 0x00 };
+    CHECK(GetAV1TemporalDelimiterSize(truncated, sizeof(truncated)) == 0);
+}
+
+int main()
+{
+    TestSequenceHeaders();
+    TestCaptures();
+    TestTemporalDelimiters();
+    return TestResult();
+}
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "stub_host.h"
+
+#include "check.h"
+
+// Encodes short renders with and without B-frames on every codec the render
+// node opens, and checks the packets the encoder hands to the host through
+// its callback: decode order strictly rising, never decoded after it is
+// shown, and every frame sent exactly once. Needs a render node with a VAAPI
+// encoder and is skipped without one.
+
+static constexpr int SkipExitCode = 77;
+static constexpr int Frames = 30;
+
+static int FindRenderNode()
+{
+    for (int device = 128; device < 140; device++) {
+        if (access(("/dev/dri/renderD" + std::to_string(device)).c_str(), R_OK | W_OK) == 0)
+            return device;
+    }
+    return -1;
+}
+
+static bool CheckOrder(const std::vector<StubHost::Packet> &packets, const std::string &name, int32_t bFrames)
+{
+    bool ok = packets.size() == Frames;
+    std::vector<int> shown(Frames);
+    bool reordered = false;
+    for (size_t i = 0; i < packets.size(); i++) {
+        const StubHost::Packet &packet = packets[i];
+        if (i > 0 && packet.dts <= packets[i - 1].dts)
+            ok = false;
+        if (packet.pts < packet.dts || packet.pts < 0 || packet.pts >= Frames)
+            ok = false;
+        else
+            shown[packet.pts]++;
+        if (i > 0 && packet.pts < packets[i - 1].pts)
+            reordered = true;
+    }
+    for (int count : shown) {
+        if (count != 1)
+            ok = false;
+    }
+    // The first packet is the one the decoder starts from.
+    if (packets.empty() || !packets[0].isKeyFrame)
+        ok = false;
+    // Without B-frames the packets come out as the frames went in.
+    if (bFrames == 0 && reordered)
+        ok = false;
+
+    if (!ok) {
+        fprintf(stderr, "%s with %d B-frames sent %zu packets:\n", name.c_str(), bFrames, packets.size());
+        for (const StubHost::Packet &packet : packets)
+            fprintf(stderr, "  pts %ld dts %ld%s\n", static_cast<long>(packet.pts), static_cast<long>(packet.dts),
+                    packet.isKeyFrame ? " key" : "");
+    }
+    return ok;
+}
+
+int main()
+{
+    int device = FindRenderNode();
+    if (device < 0) {
+        printf("No render node, skipping\n");
+        return SkipExitCode;
+    }
+
+    char dir[] = "/tmp/dvcp-vaapi-order-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    StubHost host;
+    host.SetQuiet(true);
+    int opened = 0;
+    for (StubHost::Codec &codec : host.ListCodecs()) {
+        for (int32_t bFrames : { 0, 2 }) {
+            StubHost::Render render;
+            render.codec = &codec;
+            render.device = device;
+            render.frames = Frames;
+            render.path = std::string(dir) + "/order.mp4";
+            render.settings = { { "vaapi_bframes", bFrames } };
+
+            // The packets are kept the way a host may keep them, the encoder
+            // must not reuse their memory for later packets.
+            host.SetKeepSentBuffers(true);
+            StatusCode err = host.RunRender(render);
+            host.SetKeepSentBuffers(false);
+            if (err != errNone) {
+                // Not every device has every codec or depth.
+                host.GetPackets().clear();
+                continue;
+            }
+            opened++;
+            CHECK(CheckOrder(host.GetPackets(), codec.name, bFrames));
+            CHECK(host.SentBuffersUnchanged());
+            host.GetPackets().clear();
+        }
+    }
+
+    std::filesystem::remove_all(dir);
+    if (opened == 0) {
+        printf("No codec opens on renderD%d, skipping\n", device);
+        return SkipExitCode;
+    }
+    return TestResult();
+}
@@ -0,0 +1,147 @@
+#include "gpu_usage.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "check.h"
+
+// i915: one busy counter per engine class, with the class size on a
+// separate capacity line.
+static const char I915Fdinfo[] =
+    "pos:\t0\n"
+    "flags:\t02100002\n"
+    "drm-driver:\ti915\n"
+    "drm-client-id:\t42\n"
+    "drm-engine-render:\t25662044495 ns\n"
+    "drm-engine-copy:\t0 ns\n"
+    "drm-engine-video:\t1500000000 ns\n"
+    "drm-engine-capacity-video:\t2\n"
+    "drm-engine-video-enhance:\t900000000 ns\n";
+
+// amdgpu: encode and decode rings as separate classes.
+static const char AmdgpuFdinfo[] =
+    "drm-driver:\tamdgpu\n"
+    "drm-pdev:\t0000:03:00.0\n"
+    "drm-engine-gfx:\t1000 ns\n"
+    "drm-engine-dec:\t5000 ns\n"
+    "drm-engine-enc:\t300000000 ns\n"
+    "drm-engine-enc_1:\t100000000 ns\n";
+
+// xe: busy cycles against the GPU timestamp, per class.
+static const char XeFdinfo[] =
+    "drm-driver:\txe\n"
+    "drm-cycles-rcs:\t777\n"
+    "drm-total-cycles-rcs:\t1000000\n"
+    "drm-cycles-vcs:\t600000\n"
+    "drm-total-cycles-vcs:\t1000000\n"
+    "drm-engine-capacity-vcs:\t2\n";
+
+static const char NoEncodeFdinfo[] =
+    "drm-driver:\ti915\n"
+    "drm-engine-render:\t100 ns\n";
+
+static void TestParse()
+{
+    FdinfoUsageSource::Counters counters;
+
+    CHECK(FdinfoUsageSource::Parse(I915Fdinfo, counters));
+    CHECK(counters.busy == 1500000000);
+    CHECK(counters.total == 0);
+    CHECK(counters.engines == 2);
+
+    CHECK(FdinfoUsageSource::Parse(AmdgpuFdinfo, counters));
+    CHECK(counters.busy == 400000000);
+    CHECK(counters.engines == 2);
+
+    CHECK(FdinfoUsageSource::Parse(XeFdinfo, counters));
+    CHECK(counters.busy == 600000);
+    CHECK(counters.total == 1000000);
+    CHECK(counters.engines == 2);
+
+    CHECK(!FdinfoUsageSource::Parse(NoEncodeFdinfo, counters));
+    CHECK(!FdinfoUsageSource::Parse("", counters));
+}
+
+static bool WriteText(const std::string &path, const std::string &text)
+{
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file)
+        return false;
+    fputs(text.c_str(), file);
+    fclose(file);
+    return true;
+}
+
+// Both video engines fully busy for a second reads as 1, one of them as 0.5.
+static void TestSampleNanoseconds(const std::string &path)
+{
+    auto fdinfo = [](uint64_t busyNs) {
+        return "drm-engine-video:\t" + std::to_string(busyNs) + " ns\ndrm-engine-capacity-video:\t2\n";
+    };
+
+    FdinfoUsageSource source(path);
+    double utilization = -1.0;
+
+    CHECK(WriteText(path, fdinfo(1000000000)));
+    CHECK(!source.Sample(10000000000, utilization));
+
+    CHECK(WriteText(path, fdinfo(3000000000)));
+    CHECK(source.Sample(11000000000, utilization));
+    CHECK_NEAR(utilization, 1.0, 1e-9);
+
+    CHECK(WriteText(path, fdinfo(4000000000)));
+    CHECK(source.Sample(12000000000, utilization));
+    CHECK_NEAR(utilization, 0.5, 1e-9);
+}
+
+static void TestSampleCycles(const std::string &path)
+{
+    auto fdinfo = [](uint64_t busy, uint64_t total) {
+        return "drm-cycles-vcs:\t" + std::to_string(busy) + "\ndrm-total-cycles-vcs:\t" + std::to_string(total) +
+            "\ndrm-engine-capacity-vcs:\t2\n";
+    };
+
+    FdinfoUsageSource source(path);
+    double utilization = -1.0;
+
+    CHECK(WriteText(path, fdinfo(0, 1000)));
+    CHECK(!source.Sample(0, utilization));
+
+    CHECK(WriteText(path, fdinfo(1500, 2000)));
+    CHECK(source.Sample(1, utilization));
+    CHECK_NEAR(utilization, 0.75, 1e-9);
+}
+
+static void TestSysfs(const std::string &path)
+{
+    SysfsUsageSource source(path);
+    double utilization = -1.0;
+
+    CHECK(WriteText(path, "37\n"));
+    CHECK(source.Sample(0, utilization));
+    CHECK_NEAR(utilization, 0.37, 1e-9);
+
+    CHECK(WriteText(path, "250\n"));
+    CHECK(source.Sample(0, utilization));
+    CHECK_NEAR(utilization, 1.0, 1e-9);
+}
+
+int main()
+{
+    char dir[] = "/tmp/dvcp-vaapi-test-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string path = std::string(dir) + "/fdinfo";
+
+    TestParse();
+    TestSampleNanoseconds(path);
+    TestSampleCycles(path);
+    TestSysfs(path);
+
+    remove(path.c_str());
+    remove(dir);
+    return TestResult();
+}
@@ -0,0 +1,346 @@
+#include "hevc_ps.h"
+
+#include <vector>
+
+#include "check.h"
+
+// Parameter sets written field by field from the H.265 syntax tables, with
+// emulation prevention bytes inserted where the RBSP has 00 00 0x. The
+// hvcC records were put together from the same field values.
+
+// Main 10, level 5.1, one sub-layer. The SPS has explicit and predicted
+// scaling lists, four short-term RPS of which two are inter predicted, a
+// long-term picture, and a VUI with extended SAR, NAL and VCL HRD with
+// sub-picture parameters and three CPBs, and min_spatial_segmentation_idc
+// 200. The PPS enables wavefronts.
+static const uint8_t VpsMain10[] = {
+    0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x02, 0x20, 0x00, 0x00, 0x03, 0x00,
+    0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x99, 0x95, 0xc0, 0x90,
+};
+
+static const uint8_t SpsMain10[] = {
+    0x42, 0x01, 0x01, 0x02, 0x20, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x99, 0xa0, 0x03, 0xc0, 0x80, 0x11, 0x07,
+    0xca, 0xd9, 0x65, 0x79, 0x24, 0x4b, 0x69, 0xc8, 0x9c, 0x89, 0xc8, 0x9c,
+    0x85, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x2a, 0x72, 0x27, 0x22, 0x72,
+    0x27, 0x25, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39,
+    0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39,
+    0x13, 0x90, 0xa9, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89,
+    0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89,
+    0xc8, 0x9c, 0x85, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4,
+    0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4,
+    0x4e, 0x44, 0xe4, 0x26, 0x10, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e,
+    0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e,
+    0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x28, 0x41, 0x39, 0x13, 0x91, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x90, 0xa1, 0x04, 0xe4, 0x4e, 0x44,
+    0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44,
+    0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x48, 0x41, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x90, 0xb1, 0x57,
+    0xf9, 0xad, 0x39, 0x53, 0x48, 0x1f, 0xff, 0x00, 0x01, 0x00, 0x01, 0x6a,
+    0x12, 0x20, 0x13, 0x6c, 0x79, 0x60, 0x00, 0x00, 0x7d, 0x20, 0x00, 0x1d,
+    0x4c, 0x1f, 0x8b, 0x9e, 0x72, 0x31, 0xbd, 0xee, 0x18, 0x00, 0x13, 0x88,
+    0x40, 0x00, 0xea, 0x62, 0x06, 0x50, 0x19, 0x20, 0x00, 0x27, 0x11, 0x00,
+    0x01, 0xd4, 0xc8, 0x0c, 0xa0, 0x32, 0x60, 0x00, 0x4e, 0x23, 0x00, 0x03,
+    0xa9, 0x98, 0x19, 0x40, 0x64, 0x80, 0x00, 0x9c, 0x42, 0x00, 0x07, 0x53,
+    0x10, 0x32, 0x80, 0xc9, 0x00, 0x01, 0x38, 0x88, 0x00, 0x0e, 0xa6, 0x40,
+    0x65, 0x01, 0x93, 0x00, 0x02, 0x71, 0x18, 0x00, 0x1d, 0x4c, 0xc0, 0xca,
+    0x03, 0x25, 0x60, 0x32, 0x5a, 0x08, 0x04, 0x10,
+};
+
+static const uint8_t PpsMain10[] = {
+    0x44, 0x01, 0xc1, 0x62, 0x4a, 0x29, 0x81, 0x89,
+};
+
+static const uint8_t HvccMain10[] = {
+    0x01, 0x02, 0x20, 0x00, 0x00, 0x00, 0x90, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x99, 0xf0, 0xc8, 0xff, 0xfd, 0xfa, 0xfa, 0x3b, 0xf1, 0x4f, 0x03, 0xa0,
+    0x00, 0x01, 0x00, 0x18, 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x02, 0x20,
+    0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00,
+    0x99, 0x95, 0xc0, 0x90, 0xa1, 0x00, 0x01, 0x01, 0x4c, 0x42, 0x01, 0x01,
+    0x02, 0x20, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00,
+    0x03, 0x00, 0x99, 0xa0, 0x03, 0xc0, 0x80, 0x11, 0x07, 0xca, 0xd9, 0x65,
+    0x79, 0x24, 0x4b, 0x69, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x85, 0x4e, 0x44,
+    0xe4, 0x4e, 0x44, 0xe4, 0x2a, 0x72, 0x27, 0x22, 0x72, 0x27, 0x25, 0x39,
+    0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39,
+    0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x90, 0xa9,
+    0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89,
+    0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x89, 0xc8, 0x9c, 0x85,
+    0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4,
+    0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4,
+    0x26, 0x10, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e,
+    0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e,
+    0x44, 0xe4, 0x28, 0x41, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x90, 0xa1, 0x04, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44,
+    0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x44,
+    0xe4, 0x4e, 0x44, 0xe4, 0x4e, 0x48, 0x41, 0x39, 0x13, 0x91, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x91, 0x39, 0x13,
+    0x91, 0x39, 0x13, 0x91, 0x39, 0x13, 0x90, 0xb1, 0x57, 0xf9, 0xad, 0x39,
+    0x53, 0x48, 0x1f, 0xff, 0x00, 0x01, 0x00, 0x01, 0x6a, 0x12, 0x20, 0x13,
+    0x6c, 0x79, 0x60, 0x00, 0x00, 0x7d, 0x20, 0x00, 0x1d, 0x4c, 0x1f, 0x8b,
+    0x9e, 0x72, 0x31, 0xbd, 0xee, 0x18, 0x00, 0x13, 0x88, 0x40, 0x00, 0xea,
+    0x62, 0x06, 0x50, 0x19, 0x20, 0x00, 0x27, 0x11, 0x00, 0x01, 0xd4, 0xc8,
+    0x0c, 0xa0, 0x32, 0x60, 0x00, 0x4e, 0x23, 0x00, 0x03, 0xa9, 0x98, 0x19,
+    0x40, 0x64, 0x80, 0x00, 0x9c, 0x42, 0x00, 0x07, 0x53, 0x10, 0x32, 0x80,
+    0xc9, 0x00, 0x01, 0x38, 0x88, 0x00, 0x0e, 0xa6, 0x40, 0x65, 0x01, 0x93,
+    0x00, 0x02, 0x71, 0x18, 0x00, 0x1d, 0x4c, 0xc0, 0xca, 0x03, 0x25, 0x60,
+    0x32, 0x5a, 0x08, 0x04, 0x10, 0xa2, 0x00, 0x01, 0x00, 0x08, 0x44, 0x01,
+    0xc1, 0x62, 0x4a, 0x29, 0x81, 0x89,
+};
+
+// Main, high tier level 4.1, two temporal sub-layers with sub-layer profile
+// and level. The SPS uses default scaling lists and PCM, and an HRD that
+// is fixed rate for one sub-layer and low delay for the other. Two PPS, one
+// with 2x2 tiles.
+static const uint8_t VpsTwoLayers[] = {
+    0x40, 0x01, 0x0c, 0x02, 0xff, 0xff, 0x21, 0x60, 0x00, 0x00, 0x03, 0x00,
+    0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x7b, 0xc0, 0x00, 0x01,
+    0x60, 0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03,
+    0x00, 0x5a, 0x95, 0xca, 0xe0, 0x48,
+};
+
+static const uint8_t SpsTwoLayers[] = {
+    0x42, 0x01, 0x02, 0x21, 0x60, 0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x7b, 0xc0, 0x00, 0x01, 0x60, 0x00, 0x00,
+    0x03, 0x00, 0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x5a, 0xa0,
+    0x02, 0x80, 0x80, 0x2d, 0x17, 0x11, 0x6e, 0x4e, 0x6e, 0xf4, 0x4b, 0xac,
+    0x07, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00, 0x03, 0x00, 0x64,
+    0xc0, 0x07, 0xbd, 0xfc, 0x00, 0x09, 0xc4, 0x20, 0x00, 0x75, 0x31, 0x10,
+    0x00, 0x27, 0x10, 0x80, 0x01, 0xd4, 0xc5, 0x40, 0x65, 0xc2, 0x01, 0x04,
+};
+
+static const uint8_t PpsTiles[] = {
+    0x44, 0x01, 0xc1, 0x62, 0x4a, 0x29, 0x82, 0x4b, 0x89,
+};
+
+static const uint8_t PpsPlain[] = {
+    0x44, 0x01, 0x50, 0x58, 0x92, 0x8a, 0x60, 0x22, 0x40,
+};
+
+static const uint8_t HvccTwoLayers[] = {
+    0x01, 0x21, 0x60, 0x00, 0x00, 0x00, 0xb0, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x7b, 0xf0, 0x64, 0xfe, 0xfd, 0xf8, 0xf8, 0x32, 0x00, 0x53, 0x03, 0xa0,
+    0x00, 0x01, 0x00, 0x2a, 0x40, 0x01, 0x0c, 0x02, 0xff, 0xff, 0x21, 0x60,
+    0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00,
+    0x7b, 0xc0, 0x00, 0x01, 0x60, 0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x5a, 0x95, 0xca, 0xe0, 0x48, 0xa1, 0x00,
+    0x01, 0x00, 0x54, 0x42, 0x01, 0x02, 0x21, 0x60, 0x00, 0x00, 0x03, 0x00,
+    0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x7b, 0xc0, 0x00, 0x01,
+    0x60, 0x00, 0x00, 0x03, 0x00, 0xb0, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03,
+    0x00, 0x5a, 0xa0, 0x02, 0x80, 0x80, 0x2d, 0x17, 0x11, 0x6e, 0x4e, 0x6e,
+    0xf4, 0x4b, 0xac, 0x07, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00,
+    0x03, 0x00, 0x64, 0xc0, 0x07, 0xbd, 0xfc, 0x00, 0x09, 0xc4, 0x20, 0x00,
+    0x75, 0x31, 0x10, 0x00, 0x27, 0x10, 0x80, 0x01, 0xd4, 0xc5, 0x40, 0x65,
+    0xc2, 0x01, 0x04, 0xa2, 0x00, 0x02, 0x00, 0x09, 0x44, 0x01, 0xc1, 0x62,
+    0x4a, 0x29, 0x82, 0x4b, 0x89, 0x00, 0x09, 0x44, 0x01, 0x50, 0x58, 0x92,
+    0x8a, 0x60, 0x22, 0x40,
+};
+
+// Encoder output, not written by hand: the parameter sets x265 wrote for
+// 128x64 Main Still Picture 8-bit and RExt 10-bit pictures, and the hvcC
+// libheif built from them. libheif writes the record with different choices
+// where the format leaves them to the muxer: it zeroes the constraint
+// flags, marks the frame rate as not constant and the arrays as not
+// complete. The test makes the same three choices ours does on libheif's
+// record, so every field read from the parameter sets is checked against
+// another muxer.
+static const uint8_t VpsX265Main[] = {
+    0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x03, 0x70, 0x00, 0x00, 0x03, 0x00,
+    0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x1e, 0xba, 0x02, 0x40,
+};
+
+static const uint8_t SpsX265Main[] = {
+    0x42, 0x01, 0x01, 0x03, 0x70, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x1e, 0xa0, 0x10, 0x20, 0x41, 0x65, 0xba,
+    0x92, 0x4a, 0x6b, 0x9b, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00,
+    0x03, 0x00, 0x02, 0x10,
+};
+
+static const uint8_t PpsX265[] = {
+    0x44, 0x01, 0xc1, 0x72, 0xb0, 0x22, 0x40,
+};
+
+static const uint8_t HeifX265Main[] = {
+    0x01, 0x03, 0x70, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x1e, 0xf0, 0x00, 0xfc, 0xfd, 0xf8, 0xf8, 0x00, 0x00, 0x0f, 0x03, 0x20,
+    0x00, 0x01, 0x00, 0x18, 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x03, 0x70,
+    0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00,
+    0x1e, 0xba, 0x02, 0x40, 0x21, 0x00, 0x01, 0x00, 0x28, 0x42, 0x01, 0x01,
+    0x03, 0x70, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00, 0x03, 0x00, 0x00,
+    0x03, 0x00, 0x1e, 0xa0, 0x10, 0x20, 0x41, 0x65, 0xba, 0x92, 0x4a, 0x6b,
+    0x9b, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02,
+    0x10, 0x22, 0x00, 0x01, 0x00, 0x07, 0x44, 0x01, 0xc1, 0x72, 0xb0, 0x22,
+    0x40,
+};
+
+static const uint8_t VpsX265Main10[] = {
+    0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x04, 0x08, 0x00, 0x00, 0x03, 0x00,
+    0x9d, 0xb8, 0x00, 0x00, 0x03, 0x00, 0x00, 0x1e, 0xba, 0x02, 0x40,
+};
+
+static const uint8_t SpsX265Main10[] = {
+    0x42, 0x01, 0x01, 0x04, 0x08, 0x00, 0x00, 0x03, 0x00, 0x9d, 0xb8, 0x00,
+    0x00, 0x03, 0x00, 0x00, 0x1e, 0xa0, 0x10, 0x20, 0x41, 0x36, 0x5b, 0xa9,
+    0x24, 0xa6, 0xb9, 0xb0, 0x20, 0x00, 0x00, 0x03, 0x00, 0x20, 0x00, 0x00,
+    0x03, 0x00, 0x21,
+};
+
+static const uint8_t HeifX265Main10[] = {
+    0x01, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x1e, 0xf0, 0x00, 0xfc, 0xfd, 0xfa, 0xfa, 0x00, 0x00, 0x0f, 0x03, 0x20,
+    0x00, 0x01, 0x00, 0x17, 0x40, 0x01, 0x0c, 0x01, 0xff, 0xff, 0x04, 0x08,
+    0x00, 0x00, 0x03, 0x00, 0x9d, 0xb8, 0x00, 0x00, 0x03, 0x00, 0x00, 0x1e,
+    0xba, 0x02, 0x40, 0x21, 0x00, 0x01, 0x00, 0x27, 0x42, 0x01, 0x01, 0x04,
+    0x08, 0x00, 0x00, 0x03, 0x00, 0x9d, 0xb8, 0x00, 0x00, 0x03, 0x00, 0x00,
+    0x1e, 0xa0, 0x10, 0x20, 0x41, 0x36, 0x5b, 0xa9, 0x24, 0xa6, 0xb9, 0xb0,
+    0x20, 0x00, 0x00, 0x03, 0x00, 0x20, 0x00, 0x00, 0x03, 0x00, 0x21, 0x22,
+    0x00, 0x01, 0x00, 0x07, 0x44, 0x01, 0xc1, 0x72, 0xb0, 0x22, 0x40,
+};
+
+template <size_t N>
+static void AppendNal(std::vector<uint8_t> &annexB, const uint8_t (&nal)[N], bool shortStartCode = false)
+{
+    if (!shortStartCode)
+        annexB.push_back(0);
+    annexB.insert(annexB.end(), { 0, 0, 1 });
+    annexB.insert(annexB.end(), nal, nal + N);
+}
+
+template <size_t N>
+static void CheckRecord(const std::vector<uint8_t> &annexB, uint32_t frameRateNum, uint32_t frameRateDen,
+                        const uint8_t (&expected)[N])
+{
+    std::vector<uint8_t> record;
+    CHECK(BuildHEVCConfigRecord(annexB.data(), annexB.size(), frameRateNum, frameRateDen, record));
+    CHECK(record == std::vector<uint8_t>(expected, expected + N));
+}
+
+// libheif's record with the choices ours makes: the SPS constraint flags,
+// constantFrameRate 1, and array_completeness set.
+template <size_t N>
+static std::vector<uint8_t> FromHeif(const uint8_t (&heif)[N], uint64_t constraintFlags)
+{
+    std::vector<uint8_t> record(heif, heif + N);
+    for (int i = 0; i < 6; i++)
+        record[6 + i] = static_cast<uint8_t>(constraintFlags >> (40 - 8 * i));
+    record[21] |= 0x40;
+    size_t pos = 23;
+    for (uint8_t array = 0; array < record[22]; array++) {
+        record[pos] |= 0x80;
+        uint16_t count = record[pos + 1] << 8 | record[pos + 2];
+        pos += 3;
+        for (uint16_t i = 0; i < count; i++)
+            pos += 2 + (record[pos] << 8 | record[pos + 1]);
+    }
+    return record;
+}
+
+static void TestRBSP()
+{
+    const uint8_t nal[] = { 0x42, 0x00, 0x00, 0x03, 0x01, 0x00, 0x00, 0x03, 0x03, 0x00, 0x00, 0x03 };
+    const uint8_t rbsp[] = { 0x42, 0x00, 0x00, 0x01, 0x00, 0x00, 0x03, 0x00, 0x00 };
+    CHECK(HEVCNalToRBSP(nal, sizeof(nal)) == std::vector<uint8_t>(rbsp, rbsp + sizeof(rbsp)));
+}
+
+static void TestMain10()
+{
+    HEVCConfigInfo info;
+    CHECK(ParseHEVCVPS(VpsMain10, sizeof(VpsMain10), info));
+    CHECK(ParseHEVCSPS(SpsMain10, sizeof(SpsMain10), info));
+    CHECK(ParseHEVCPPS(PpsMain10, sizeof(PpsMain10), info));
+    CHECK(info.profileIdc == 2 && info.levelIdc == 153 && info.tierFlag == 0);
+    CHECK(info.profileCompatibilityFlags == 0x20000000);
+    CHECK(info.constraintIndicatorFlags == 0x900000000000);
+    CHECK(info.chromaFormatIdc == 1 && info.bitDepthLuma == 10 && info.bitDepthChroma == 10);
+    CHECK(info.numTemporalLayers == 1 && info.temporalIdNested == 1);
+    // Only right when the scaling lists, RPS and HRD were all skipped exactly.
+    CHECK(info.minSpatialSegmentationIdc == 200);
+    CHECK(GetHEVCParallelismType(info) == 3);
+
+    std::vector<uint8_t> annexB;
+    AppendNal(annexB, VpsMain10);
+    AppendNal(annexB, SpsMain10);
+    AppendNal(annexB, PpsMain10);
+    CheckRecord(annexB, 60000, 1001, HvccMain10);
+
+    // Cut inside the VUI.
+    CHECK(!ParseHEVCSPS(SpsMain10, sizeof(SpsMain10) - 12, info));
+}
+
+static void TestX265()
+{
+    HEVCConfigInfo info;
+    CHECK(ParseHEVCVPS(VpsX265Main, sizeof(VpsX265Main), info));
+    CHECK(ParseHEVCSPS(SpsX265Main, sizeof(SpsX265Main), info));
+    CHECK(ParseHEVCPPS(PpsX265, sizeof(PpsX265), info));
+    CHECK(info.profileIdc == 3 && info.levelIdc == 30 && info.tierFlag == 0);
+    CHECK(info.profileCompatibilityFlags == 0x70000000);
+    CHECK(info.constraintIndicatorFlags == 0x900000000000);
+    CHECK(info.chromaFormatIdc == 1 && info.bitDepthLuma == 8 && info.bitDepthChroma == 8);
+    CHECK(info.numTemporalLayers == 1 && info.temporalIdNested == 1);
+    CHECK(GetHEVCParallelismType(info) == 0);
+
+    std::vector<uint8_t> annexB;
+    AppendNal(annexB, VpsX265Main);
+    AppendNal(annexB, SpsX265Main);
+    AppendNal(annexB, PpsX265);
+    std::vector<uint8_t> record;
+    CHECK(BuildHEVCConfigRecord(annexB.data(), annexB.size(), 0, 0, record));
+    CHECK(record == FromHeif(HeifX265Main, info.constraintIndicatorFlags));
+
+    info = HEVCConfigInfo();
+    CHECK(ParseHEVCVPS(VpsX265Main10, sizeof(VpsX265Main10), info));
+    CHECK(ParseHEVCSPS(SpsX265Main10, sizeof(SpsX265Main10), info));
+    CHECK(ParseHEVCPPS(PpsX265, sizeof(PpsX265), info));
+    CHECK(info.profileIdc == 4 && info.levelIdc == 30);
+    CHECK(info.profileCompatibilityFlags == 0x08000000);
+    CHECK(info.constraintIndicatorFlags == 0x9db800000000);
+    CHECK(info.chromaFormatIdc == 1 && info.bitDepthLuma == 10 && info.bitDepthChroma == 10);
+
+    annexB.clear();
+    AppendNal(annexB, VpsX265Main10);
+    AppendNal(annexB, SpsX265Main10);
+    AppendNal(annexB, PpsX265);
+    CHECK(BuildHEVCConfigRecord(annexB.data(), annexB.size(), 0, 0, record));
+    CHECK(record == FromHeif(HeifX265Main10, info.constraintIndicatorFlags));
+}
+
+static void TestTwoLayers()
+{
+    HEVCConfigInfo info;
+    CHECK(ParseHEVCVPS(VpsTwoLayers, sizeof(VpsTwoLayers), info));
+    CHECK(ParseHEVCSPS(SpsTwoLayers, sizeof(SpsTwoLayers), info));
+    CHECK(ParseHEVCPPS(PpsTiles, sizeof(PpsTiles), info));
+    CHECK(ParseHEVCPPS(PpsPlain, sizeof(PpsPlain), info));
+    CHECK(info.profileIdc == 1 && info.levelIdc == 123 && info.tierFlag == 1);
+    CHECK(info.numTemporalLayers == 2 && info.temporalIdNested == 0);
+    CHECK(info.bitDepthLuma == 8 && info.minSpatialSegmentationIdc == 100);
+    CHECK(info.tilesEnabled && !info.entropyCodingSync);
+    CHECK(GetHEVCParallelismType(info) == 2);
+
+    // Mixed three and four byte start codes.
+    std::vector<uint8_t> annexB;
+    AppendNal(annexB, VpsTwoLayers);
+    AppendNal(annexB, SpsTwoLayers, true);
+    AppendNal(annexB, PpsTiles);
+    AppendNal(annexB, PpsPlain, true);
+    CheckRecord(annexB, 50, 1, HvccTwoLayers);
+
+    // Every parameter set type is needed.
+    std::vector<uint8_t> noPps;
+    AppendNal(noPps, VpsTwoLayers);
+    AppendNal(noPps, SpsTwoLayers);
+    std::vector<uint8_t> record;
+    CHECK(!BuildHEVCConfigRecord(noPps.data(), noPps.size(), 50, 1, record));
+}
+
+int main()
+{
+    TestRBSP();
+    TestMain10();
+    TestX265();
+    TestTwoLayers();
+    return TestResult();
+}
@@ -0,0 +1,85 @@
+#include "hevc_ps.h"
+
+#include <vector>
+
+#include "check.h"
+
+// SPS NAL units from x265 run in CBR with HRD signalling, at the rates
+// DoOpen sets for the CBR mode: bit_rate and rc_max_rate equal, and
+// rc_buffer_size one second of it by default or two frames for low latency.
+
+// 6000 kb/s, 6000 kb buffer. Main Still Picture, 8-bit.
+static const uint8_t SpsCbrOneSecond[] = {
+    0x42, 0x01, 0x01, 0x03, 0x70, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x5a, 0xa0, 0x10, 0x20, 0x41, 0x65, 0xba,
+    0x92, 0x4a, 0x6b, 0x9b, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00,
+    0x03, 0x00, 0x02, 0xc1, 0x39, 0x0c, 0x7c, 0x00, 0x05, 0xb8, 0xd8, 0x00,
+    0x0b, 0x71, 0xb9,
+};
+
+// 6000 kb/s, 400 kb buffer, two frames at 30 fps. Format range extensions, 10-bit.
+static const uint8_t SpsCbrTwoFrames[] = {
+    0x42, 0x01, 0x01, 0x04, 0x08, 0x00, 0x00, 0x03, 0x00, 0x9d, 0xb8, 0x00,
+    0x00, 0x03, 0x00, 0x00, 0x5a, 0xa0, 0x10, 0x20, 0x41, 0x36, 0x5b, 0xa9,
+    0x24, 0xa6, 0xb9, 0xb0, 0x20, 0x00, 0x00, 0x03, 0x00, 0x20, 0x00, 0x00,
+    0x03, 0x00, 0x2c, 0x13, 0x70, 0xc7, 0xc0, 0x00, 0x5b, 0x8d, 0x80, 0x0c,
+    0x35, 0x90,
+};
+
+// 4000 kb/s, 8000 kb buffer, a buffer larger than a second.
+static const uint8_t SpsCbrLargeBuffer[] = {
+    0x42, 0x01, 0x01, 0x03, 0x70, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x5a, 0xa0, 0x10, 0x20, 0x41, 0x65, 0xba,
+    0x92, 0x4a, 0x6b, 0x9b, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00,
+    0x03, 0x00, 0x02, 0xc2, 0x59, 0x8c, 0x7c, 0x00, 0x1e, 0x84, 0x80, 0x03,
+    0xd0, 0x99,
+};
+
+// Constant QP, no HRD.
+static const uint8_t SpsConstantQP[] = {
+    0x42, 0x01, 0x01, 0x03, 0x70, 0x00, 0x00, 0x03, 0x00, 0x90, 0x00, 0x00,
+    0x03, 0x00, 0x00, 0x03, 0x00, 0x1e, 0xa0, 0x10, 0x20, 0x41, 0x65, 0xba,
+    0x92, 0x4a, 0x6b, 0x9b, 0x02, 0x00, 0x00, 0x03, 0x00, 0x02, 0x00, 0x00,
+    0x03, 0x00, 0x02, 0x10,
+};
+
+template <size_t N>
+static void CheckCbr(const uint8_t (&sps)[N], int64_t maxRate, int64_t bufferSize)
+{
+    HEVCConfigInfo info;
+    HEVCHrdInfo hrd;
+    CHECK(ParseHEVCSPS(sps, N, info, &hrd));
+    CHECK(hrd.present);
+    CHECK(hrd.bitRate == uint64_t(maxRate));
+    CHECK(hrd.cpbSize == uint64_t(bufferSize));
+    CHECK(hrd.cbr);
+}
+
+static void TestCbr()
+{
+    CheckCbr(SpsCbrOneSecond, 6000000, 6000000);
+    CheckCbr(SpsCbrTwoFrames, 6000000, 6000000 * 2 / 30);
+    CheckCbr(SpsCbrLargeBuffer, 4000000, 8000000);
+
+    // The scales x265 picked, which the values above are shifted by.
+    HEVCConfigInfo info;
+    HEVCHrdInfo hrd;
+    CHECK(ParseHEVCSPS(SpsCbrOneSecond, sizeof(SpsCbrOneSecond), info, &hrd));
+    CHECK(hrd.bitRateScale == 1 && hrd.cpbSizeScale == 3 && !hrd.lowDelay);
+}
+
+static void TestNoHrd()
+{
+    HEVCConfigInfo info;
+    HEVCHrdInfo hrd;
+    hrd.present = true;
+    CHECK(ParseHEVCSPS(SpsConstantQP, sizeof(SpsConstantQP), info, &hrd));
+    CHECK(!hrd.present && hrd.bitRate == 0 && hrd.cpbSize == 0);
+}
+
+int main()
+{
+    TestCbr();
+    TestNoHrd();
+    return TestResult();
+}
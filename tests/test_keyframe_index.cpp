@@ -0,0 +1,120 @@
+#include "keyframe_index.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.h"
+
+using Header = KeyframeIndexWriter::Header;
+using Entry = KeyframeIndexWriter::Entry;
+
+static std::vector<Entry> ReadEntries(const std::string &path, Header &header)
+{
+    std::vector<Entry> entries;
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+        return entries;
+    if (fread(&header, sizeof(header), 1, file) == 1) {
+        Entry entry;
+        while (fread(&entry, sizeof(entry), 1, file) == 1)
+            entries.push_back(entry);
+    }
+    fclose(file);
+    return entries;
+}
+
+// Packets of 1000 bytes, a keyframe every fourth.
+static void AddPackets(KeyframeIndexWriter &index, int first, int end)
+{
+    for (int i = first; i < end; i++)
+        index.Add(i, i * 1000, 1000, i % 4 == 0);
+}
+
+// The container only finds an index the encoder asked for, for its own
+// output, and only while the encoder or the container holds it.
+static void TestRegistry(const std::string &dir)
+{
+    std::string output = dir + "/registry.h264";
+    CHECK(!KeyframeIndexWriter::Find(output));
+
+    std::shared_ptr<KeyframeIndexWriter> requested = KeyframeIndexWriter::Create(output, false);
+    std::shared_ptr<KeyframeIndexWriter> found = KeyframeIndexWriter::Find(output);
+    CHECK(found == requested);
+    CHECK(!KeyframeIndexWriter::Find(dir + "/other.h264"));
+
+    requested.reset();
+    CHECK(KeyframeIndexWriter::Find(output) == found);
+    found.reset();
+    CHECK(!KeyframeIndexWriter::Find(output));
+}
+
+static void TestKeyframes(const std::string &dir)
+{
+    std::string output = dir + "/keyframes.h264";
+    std::shared_ptr<KeyframeIndexWriter> index = KeyframeIndexWriter::Create(output, false);
+    CHECK(index->Open(1001, 30000, 0));
+    AddPackets(*index, 0, 12);
+    index->Close();
+
+    Header header;
+    std::vector<Entry> entries = ReadEntries(output + ".idx", header);
+    CHECK(std::string(header.magic, 4) == "VKIX");
+    CHECK(header.version == 1);
+    CHECK(header.entrySize == sizeof(Entry));
+    CHECK(header.flags == 0);
+    CHECK(header.timeBaseNum == 1001 && header.timeBaseDen == 30000);
+    CHECK(entries.size() == 3);
+    for (size_t i = 0; i < entries.size(); i++) {
+        CHECK(entries[i].pts == static_cast<int64_t>(i * 4));
+        CHECK(entries[i].offset == i * 4000);
+        CHECK(entries[i].size == 1000);
+        CHECK(entries[i].flags == KeyframeIndexWriter::EntryKeyFrame);
+    }
+    unlink((output + ".idx").c_str());
+}
+
+// A resumed render keeps the entries before its checkpoint and continues
+// after them, as if it had never stopped.
+static void TestResume(const std::string &dir)
+{
+    std::string output = dir + "/resume.h264";
+    std::shared_ptr<KeyframeIndexWriter> index = KeyframeIndexWriter::Create(output, true);
+    CHECK(index->Open(1, 25, 0));
+    AddPackets(*index, 0, 10);
+    index->Close();
+
+    index = KeyframeIndexWriter::Create(output, true);
+    CHECK(index->Open(1, 25, 8000));
+    AddPackets(*index, 8, 12);
+    index->Close();
+
+    Header header;
+    std::vector<Entry> entries = ReadEntries(output + ".idx", header);
+    CHECK(header.flags == KeyframeIndexWriter::HeaderEveryFrame);
+    CHECK(entries.size() == 12);
+    for (size_t i = 0; i < entries.size(); i++) {
+        CHECK(entries[i].pts == static_cast<int64_t>(i));
+        CHECK(entries[i].offset == i * 1000);
+        CHECK(entries[i].flags == (i % 4 == 0 ? static_cast<uint32_t>(KeyframeIndexWriter::EntryKeyFrame) : 0u));
+    }
+    unlink((output + ".idx").c_str());
+}
+
+int main()
+{
+    char dir[] = "/tmp/dvcp-vaapi-index-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    TestRegistry(dir);
+    TestKeyframes(dir);
+    TestResume(dir);
+
+    rmdir(dir);
+    return TestResult();
+}
@@ -0,0 +1,61 @@
+#include "packet_order.h"
+
+#include "check.h"
+
+struct Packet
+{
+    int64_t pts;
+    int64_t dts;
+};
+
+// What libavcodec's VAAPI encoders emit for a closed GOP of IBBP with a
+// decode delay of one frame: the first DTS is shifted before the first
+// PTS, and every B-frame comes out after the P-frame it references.
+static const Packet BFramePackets[] = {
+    { 0, -1 }, { 3, 0 }, { 1, 1 }, { 2, 2 }, { 6, 3 }, { 4, 4 }, { 5, 5 }, { 9, 6 }, { 7, 7 }, { 8, 8 },
+};
+
+static void TestBFrameOrder()
+{
+    PacketOrder order;
+    for (const Packet &packet : BFramePackets)
+        CHECK(order.Check(packet.pts, packet.dts) == PacketOrder::orderOk);
+    CHECK(order.GetLastDts() == 8);
+}
+
+static void TestWithoutReordering()
+{
+    PacketOrder order;
+    for (int64_t pts = 100; pts < 200; pts++)
+        CHECK(order.Check(pts, pts) == PacketOrder::orderOk);
+}
+
+static void TestRejects()
+{
+    PacketOrder order;
+    CHECK(order.Check(0, -1) == PacketOrder::orderOk);
+    CHECK(order.Check(3, 0) == PacketOrder::orderOk);
+
+    // A repeated or falling DTS is reported, not patched up.
+    CHECK(order.Check(1, 0) == PacketOrder::orderDtsNotIncreasing);
+    CHECK(order.Check(2, -5) == PacketOrder::orderDtsNotIncreasing);
+    CHECK(order.GetLastDts() == 0);
+
+    // Decoded after it should be shown.
+    CHECK(order.Check(1, 2) == PacketOrder::orderDtsAfterPts);
+    CHECK(order.GetLastDts() == 0);
+
+    CHECK(order.Check(1, 1) == PacketOrder::orderOk);
+
+    // A new pass or codec starts over.
+    order.Reset();
+    CHECK(order.Check(0, 0) == PacketOrder::orderOk);
+}
+
+int main()
+{
+    TestBFrameOrder();
+    TestWithoutReordering();
+    TestRejects();
+    return TestResult();
+}
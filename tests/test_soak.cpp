@@ -0,0 +1,302 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <va/va.h>
+}
+
+#include "codec_traits.h"
+#include "es_container.h"
+#include "fmp4_container.h"
+#include "stub_host.h"
+
+#include "check.h"
+
+// Runs whole renders through VAAPIEncoder and the plugin's containers, as a
+// Resolve session does over days, and checks that nothing accumulates:
+// RSS, file descriptors, threads, host objects, and the VA displays,
+// configs, contexts, surfaces and buffers libavcodec creates. The VA calls
+// are counted through the linker's --wrap, which redirects libavutil's and
+// libavcodec's references. Needs a render node with a VAAPI encoder and is
+// skipped without one. DVCP_VAAPI_SOAK_CYCLES overrides the cycle count.
+
+static constexpr int DefaultCycles = 10000;
+static constexpr int WarmupCycles = 50;
+static constexpr int SkipExitCode = 77;
+
+static std::atomic<int> s_displays;
+static std::atomic<int> s_configs;
+static std::atomic<int> s_contexts;
+static std::atomic<int> s_surfaces;
+static std::atomic<int> s_buffers;
+
+extern "C" {
+VAStatus __real_vaInitialize(VADisplay dpy, int *major, int *minor);
+VAStatus __real_vaTerminate(VADisplay dpy);
+VAStatus __real_vaCreateConfig(VADisplay dpy, VAProfile profile, VAEntrypoint entrypoint, VAConfigAttrib *attribs,
+                               int numAttribs, VAConfigID *config);
+VAStatus __real_vaDestroyConfig(VADisplay dpy, VAConfigID config);
+VAStatus __real_vaCreateContext(VADisplay dpy, VAConfigID config, int width, int height, int flag,
+                                VASurfaceID *targets, int numTargets, VAContextID *context);
+VAStatus __real_vaDestroyContext(VADisplay dpy, VAContextID context);
+VAStatus __real_vaCreateSurfaces(VADisplay dpy, unsigned int format, unsigned int width, unsigned int height,
+                                 VASurfaceID *surfaces, unsigned int numSurfaces, VASurfaceAttrib *attribs,
+                                 unsigned int numAttribs);
+VAStatus __real_vaDestroySurfaces(VADisplay dpy, VASurfaceID *surfaces, int numSurfaces);
+VAStatus __real_vaCreateBuffer(VADisplay dpy, VAContextID context, VABufferType type, unsigned int size,
+                               unsigned int numElements, void *data, VABufferID *buffer);
+VAStatus __real_vaDestroyBuffer(VADisplay dpy, VABufferID buffer);
+
+VAStatus __wrap_vaInitialize(VADisplay dpy, int *major, int *minor)
+{
+    VAStatus status = __real_vaInitialize(dpy, major, minor);
+    if (status == VA_STATUS_SUCCESS)
+        s_displays++;
+    return status;
+}
+
+VAStatus __wrap_vaTerminate(VADisplay dpy)
+{
+    s_displays--;
+    return __real_vaTerminate(dpy);
+}
+
+VAStatus __wrap_vaCreateConfig(VADisplay dpy, VAProfile profile, VAEntrypoint entrypoint, VAConfigAttrib *attribs,
+                               int numAttribs, VAConfigID *config)
+{
+    VAStatus status = __real_vaCreateConfig(dpy, profile, entrypoint, attribs, numAttribs, config);
+    if (status == VA_STATUS_SUCCESS)
+        s_configs++;
+    return status;
+}
+
+VAStatus __wrap_vaDestroyConfig(VADisplay dpy, VAConfigID config)
+{
+    s_configs--;
+    return __real_vaDestroyConfig(dpy, config);
+}
+
+VAStatus __wrap_vaCreateContext(VADisplay dpy, VAConfigID config, int width, int height, int flag,
+                                VASurfaceID *targets, int numTargets, VAContextID *context)
+{
+    VAStatus status = __real_vaCreateContext(dpy, config, width, height, flag, targets, numTargets, context);
+    if (status == VA_STATUS_SUCCESS)
+        s_contexts++;
+    return status;
+}
+
+VAStatus __wrap_vaDestroyContext(VADisplay dpy, VAContextID context)
+{
+    s_contexts--;
+    return __real_vaDestroyContext(dpy, context);
+}
+
+VAStatus __wrap_vaCreateSurfaces(VADisplay dpy, unsigned int format, unsigned int width, unsigned int height,
+                                 VASurfaceID *surfaces, unsigned int numSurfaces, VASurfaceAttrib *attribs,
+                                 unsigned int numAttribs)
+{
+    VAStatus status = __real_vaCreateSurfaces(dpy, format, width, height, surfaces, numSurfaces, attribs, numAttribs);
+    if (status == VA_STATUS_SUCCESS)
+        s_surfaces += numSurfaces;
+    return status;
+}
+
+VAStatus __wrap_vaDestroySurfaces(VADisplay dpy, VASurfaceID *surfaces, int numSurfaces)
+{
+    s_surfaces -= numSurfaces;
+    return __real_vaDestroySurfaces(dpy, surfaces, numSurfaces);
+}
+
+VAStatus __wrap_vaCreateBuffer(VADisplay dpy, VAContextID context, VABufferType type, unsigned int size,
+                               unsigned int numElements, void *data, VABufferID *buffer)
+{
+    VAStatus status = __real_vaCreateBuffer(dpy, context, type, size, numElements, data, buffer);
+    if (status == VA_STATUS_SUCCESS)
+        s_buffers++;
+    return status;
+}
+
+VAStatus __wrap_vaDestroyBuffer(VADisplay dpy, VABufferID buffer)
+{
+    s_buffers--;
+    return __real_vaDestroyBuffer(dpy, buffer);
+}
+}
+
+static long GetRssPages()
+{
+    long size = 0, resident = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file) {
+        if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+            resident = 0;
+        fclose(file);
+    }
+    return resident;
+}
+
+static int CountEntries(const char *path)
+{
+    int count = 0;
+    DIR *dir = opendir(path);
+    if (!dir)
+        return -1;
+    while (readdir(dir))
+        count++;
+    closedir(dir);
+    return count;
+}
+
+static int FindRenderNode()
+{
+    for (int device = 128; device < 140; device++) {
+        if (access(("/dev/dri/renderD" + std::to_string(device)).c_str(), R_OK | W_OK) == 0)
+            return device;
+    }
+    return -1;
+}
+
+// Every cycle takes another output and another set of the settings that
+// start threads or open files, so each teardown path is taken often.
+static StubHost::Render MakeRender(const StubHost::Codec &codec, CodecId codecId, int device, const std::string &dir,
+                                   int cycle)
+{
+    StubHost::Render render;
+    render.codec = &codec;
+    render.device = device;
+    render.frames = 6;
+
+    std::vector<std::string> containers = { "mp4", FragmentedMP4Container::GetId(),
+                                            FragmentedMP4Container::GetSegmentedId() };
+    for (const std::string &id : ElementaryStreamContainer::GetIds(codecId))
+        containers.push_back(id);
+    render.container = containers[cycle % containers.size()];
+    render.path = dir + (render.container == FragmentedMP4Container::GetSegmentedId() ? "/soak.m3u8" : "/soak.out");
+
+    int variant = cycle / static_cast<int>(containers.size());
+    render.settings = {
+        { "vaapi_bframes", variant % 2 ? 2 : 0 },
+        { "vaapi_lookahead", variant % 3 == 1 ? 4 : 0 },
+        { "vaapi_stats", variant % 4 == 2 },
+        { "vaapi_checksum", variant % 2 },
+        { "vaapi_index", variant % 3 },
+    };
+    return render;
+}
+
+static CodecId GetCodecId(const StubHost::Codec &codec)
+{
+    switch (codec.fourcc) {
+        case FOURCC_HEVC:
+            return CodecId::HEVC;
+        case FOURCC_AV1:
+            return CodecId::AV1;
+        default:
+            return CodecId::H264;
+    }
+}
+
+static bool CheckVAObjects(int cycle)
+{
+    if (s_displays == 0 && s_configs == 0 && s_contexts == 0 && s_surfaces == 0 && s_buffers == 0)
+        return true;
+    fprintf(stderr, "cycle %d left VA objects: %d displays, %d configs, %d contexts, %d surfaces, %d buffers\n", cycle,
+            s_displays.load(), s_configs.load(), s_contexts.load(), s_surfaces.load(), s_buffers.load());
+    return false;
+}
+
+int main()
+{
+    int device = FindRenderNode();
+    if (device < 0) {
+        printf("No render node, skipping\n");
+        return SkipExitCode;
+    }
+
+    int cycles = DefaultCycles;
+    if (const char *value = getenv("DVCP_VAAPI_SOAK_CYCLES"))
+        cycles = std::max(atoi(value), WarmupCycles + 1);
+
+    char dir[] = "/tmp/dvcp-vaapi-soak-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    StubHost host;
+    host.SetQuiet(true);
+    size_t baseObjects = host.GetLiveObjects();
+
+    // The 8-bit codecs this device can open.
+    std::vector<StubHost::Codec> codecs;
+    for (StubHost::Codec &codec : host.ListCodecs()) {
+        if (codec.depth != 8)
+            continue;
+        StubHost::Render render;
+        render.codec = &codec;
+        render.device = device;
+        render.path = std::string(dir) + "/probe.mp4";
+        if (host.RunRender(render) == errNone && !host.GetPackets().empty())
+            codecs.push_back(codec);
+        host.GetPackets().clear();
+    }
+    if (codecs.empty()) {
+        printf("No codec opens on renderD%d, skipping\n", device);
+        std::filesystem::remove_all(dir);
+        return SkipExitCode;
+    }
+    CHECK(CheckVAObjects(-1));
+
+    long rss = 0;
+    int fds = 0;
+    int threads = 0;
+    bool clean = true;
+    for (int cycle = 0; cycle < cycles && clean; cycle++) {
+        if (cycle == WarmupCycles) {
+            rss = GetRssPages();
+            fds = CountEntries("/proc/self/fd");
+            threads = CountEntries("/proc/self/task");
+        }
+
+        const StubHost::Codec &codec = codecs[cycle % codecs.size()];
+        StubHost::Render render = MakeRender(codec, GetCodecId(codec), device, dir, cycle / codecs.size());
+
+        // The host may hold on to the packets it was sent, which must not
+        // change after they went out.
+        host.SetKeepSentBuffers(render.container == "mp4");
+        size_t errors = host.GetErrors();
+        StatusCode err = host.RunRender(render);
+        CHECK(err == errNone);
+        CHECK(host.GetErrors() == errors);
+        CHECK(host.GetPackets().size() == static_cast<size_t>(render.frames));
+        CHECK(host.SentBuffersUnchanged());
+        host.SetKeepSentBuffers(false);
+        host.GetPackets().clear();
+
+        CHECK(host.GetLiveObjects() == baseObjects);
+        CHECK(CheckVAObjects(cycle));
+        clean = err == errNone && host.GetErrors() == errors && host.GetLiveObjects() == baseObjects &&
+            CheckVAObjects(cycle);
+        if (!clean)
+            fprintf(stderr, "cycle %d with %s to %s failed\n", cycle, codec.name.c_str(), render.container.c_str());
+    }
+
+    long rssGrowth = GetRssPages() - rss;
+    printf("RSS grew by %ld pages over %d renders\n", rssGrowth, cycles - WarmupCycles);
+    // Allocator and driver noise. Leaking a single kilobyte per render
+    // would be more than this.
+    CHECK(rssGrowth < 2048);
+    CHECK(CountEntries("/proc/self/fd") == fds);
+    CHECK(CountEntries("/proc/self/task") == threads);
+
+    std::filesystem::remove_all(dir);
+    return TestResult();
+}
@@ -0,0 +1,130 @@
+#include "stream_checksum.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "check.h"
+
+static constexpr int PacketCount = 30;
+static constexpr int GopSize = 5;
+
+static std::vector<uint8_t> MakePacket(int index)
+{
+    std::vector<uint8_t> packet(100 + index * 37 % 300);
+    for (size_t i = 0; i < packet.size(); i++)
+        packet[i] = static_cast<uint8_t>(index * 31 + i);
+    return packet;
+}
+
+static void PushPackets(StreamChecksumWriter &writer, int first, int end)
+{
+    for (int i = first; i < end; i++) {
+        std::vector<uint8_t> packet = MakePacket(i);
+        writer.Push(packet.data(), packet.size(), i, i % GopSize == 0);
+    }
+}
+
+// The gop and stream lines, which a resumed render has to reproduce.
+static std::string ReadDigests(const std::string &path)
+{
+    std::string digests;
+    FILE *file = fopen(path.c_str(), "r");
+    if (!file)
+        return digests;
+    char line[512];
+    while (fgets(line, sizeof(line), file)) {
+        if (!strncmp(line, "gop ", 4) || !strncmp(line, "stream ", 7))
+            digests += line;
+    }
+    fclose(file);
+    return digests;
+}
+
+static std::string Hex(const Sha256::Digest &digest)
+{
+    std::string hex;
+    char byte[3];
+    for (uint8_t value : digest) {
+        snprintf(byte, sizeof(byte), "%02x", value);
+        hex += byte;
+    }
+    return hex;
+}
+
+static void TestSaveRestore()
+{
+    Sha256 abc;
+    abc.Update("abc", 3);
+    CHECK(Hex(abc.Final()) == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+    // Saved in the middle of a block and continued in a fresh object.
+    std::vector<uint8_t> data(1000);
+    for (size_t i = 0; i < data.size(); i++)
+        data[i] = static_cast<uint8_t>(i * 13);
+    for (size_t split : { size_t(0), size_t(64), size_t(100), size_t(999) }) {
+        Sha256 whole;
+        whole.Update(data.data(), data.size());
+
+        Sha256 first;
+        first.Update(data.data(), split);
+        std::vector<uint8_t> state = first.Save();
+        Sha256 second;
+        CHECK(second.Restore(state.data(), state.size()));
+        second.Update(data.data() + split, data.size() - split);
+        CHECK(second.Final() == whole.Final());
+
+        CHECK(!second.Restore(state.data(), state.size() - 1));
+    }
+}
+
+int main()
+{
+    TestSaveRestore();
+
+    char dir[] = "/tmp/dvcp-vaapi-checksum-XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string fullPath = std::string(dir) + "/full.sha256";
+    std::string resumedPath = std::string(dir) + "/resumed.sha256";
+
+    StreamChecksumWriter full;
+    CHECK(full.Open(fullPath, true, INT64_MIN));
+    PushPackets(full, 0, PacketCount);
+    full.Close();
+    std::string expected = ReadDigests(fullPath);
+    CHECK(!expected.empty());
+
+    // A render that stopped two packets into the GOP at 15, continued from
+    // there. The packets after the checkpoint are encoded again.
+    StreamChecksumWriter crashed;
+    CHECK(crashed.Open(resumedPath, true, INT64_MIN));
+    PushPackets(crashed, 0, 17);
+    crashed.Close();
+
+    StreamChecksumWriter resumed;
+    CHECK(resumed.Open(resumedPath, true, 15));
+    PushPackets(resumed, 15, PacketCount);
+    resumed.Close();
+    CHECK(ReadDigests(resumedPath) == expected);
+
+    // Without a state at the checkpoint only the resumed part is covered.
+    StreamChecksumWriter partial;
+    CHECK(partial.Open(resumedPath, true, 16));
+    PushPackets(partial, 16, PacketCount);
+    partial.Close();
+    std::string digests = ReadDigests(resumedPath);
+    CHECK(digests != expected);
+    CHECK(digests.find("gop 0 ") == std::string::npos);
+
+    unlink(fullPath.c_str());
+    unlink(resumedPath.c_str());
+    rmdir(dir);
+    return TestResult();
+}
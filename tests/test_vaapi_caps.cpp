@@ -0,0 +1,94 @@
+#include "vaapi_caps.h"
+
+extern "C" {
+#include <va/va.h>
+}
+
+#include "check.h"
+
+// ResolveLayout() against the limits of the formats and of the drivers. An
+// uncapped driver takes whatever the format allows, a capped one limits
+// slices and tiles the way Intel's and AMD's drivers do.
+
+static constexpr uint32_t AnyRows = VA_ENC_SLICE_STRUCTURE_ARBITRARY_ROWS;
+static constexpr uint32_t PowerOfTwoRows = VA_ENC_SLICE_STRUCTURE_POWER_OF_TWO_ROWS;
+
+struct LayoutCase
+{
+    const char *name;
+    CodecId codec;
+    uint32_t width;
+    uint32_t height;
+    // Driver limits.
+    uint32_t blockSize;
+    uint32_t maxSlices;
+    uint32_t sliceStructure;
+    uint32_t maxTiles;
+    VAAPICaps::Layout requested;
+    VAAPICaps::Layout expected;
+};
+
+static const LayoutCase Cases[] = {
+    // H.264 has no tiles, slices are whole macroblock rows.
+    { "H.264 720p uncapped", CodecId::H264, 1280, 720, 16, 1000, AnyRows, 0, { 8, 1, 1 }, { 8, 1, 1 } },
+    { "H.264 720p capped", CodecId::H264, 1280, 720, 16, 4, AnyRows, 0, { 8, 1, 1 }, { 4, 1, 1 } },
+    { "H.264 tiles ignored", CodecId::H264, 1280, 720, 16, 1000, AnyRows, 64, { 2, 4, 4 }, { 2, 1, 1 } },
+    { "H.264 4K uncapped", CodecId::H264, 3840, 2160, 16, 1000, AnyRows, 0, { 100, 1, 1 }, { 100, 1, 1 } },
+    { "H.264 8K one slice per row", CodecId::H264, 7680, 4320, 16, 1000, AnyRows, 0, { 300, 1, 1 }, { 270, 1, 1 } },
+    { "H.264 no slice structure", CodecId::H264, 1280, 720, 16, 1000, 0, 0, { 8, 1, 1 }, { 1, 1, 1 } },
+
+    // Drivers that only split into power of two row counts round down.
+    { "H.264 720p power of two", CodecId::H264, 1280, 720, 16, 1000, PowerOfTwoRows, 0, { 6, 1, 1 }, { 4, 1, 1 } },
+    { "H.264 720p power of two rows", CodecId::H264, 1280, 720, 16, 1000, PowerOfTwoRows, 0, { 64, 1, 1 },
+      { 32, 1, 1 } },
+    { "H.264 capped power of two", CodecId::H264, 1280, 720, 16, 6, PowerOfTwoRows, 0, { 8, 1, 1 }, { 4, 1, 1 } },
+    { "HEVC 720p power of two", CodecId::HEVC, 1280, 720, 64, 1000, PowerOfTwoRows, 0, { 12, 1, 1 },
+      { 8, 1, 1 } },
+
+    // HEVC tiles are at least 256x64 and carry one slice each.
+    { "HEVC 720p uncapped", CodecId::HEVC, 1280, 720, 64, 1000, AnyRows, 4096, { 1, 8, 8 }, { 40, 5, 8 } },
+    { "HEVC 720p capped", CodecId::HEVC, 1280, 720, 64, 1000, AnyRows, 4, { 1, 4, 4 }, { 4, 2, 2 } },
+    { "HEVC 512x128 minimum tile", CodecId::HEVC, 512, 128, 32, 1000, AnyRows, 4096, { 1, 4, 4 }, { 4, 2, 2 } },
+    { "HEVC below one minimum tile", CodecId::HEVC, 200, 50, 64, 1000, AnyRows, 4096, { 2, 4, 4 }, { 1, 1, 1 } },
+    { "HEVC 4K uncapped", CodecId::HEVC, 3840, 2160, 64, 1000, AnyRows, 4096, { 1, 20, 20 }, { 300, 15, 20 } },
+    { "HEVC 8K capped", CodecId::HEVC, 7680, 4320, 64, 1000, AnyRows, 22, { 1, 8, 8 }, { 20, 5, 4 } },
+    { "HEVC 8K slices without tiles", CodecId::HEVC, 7680, 4320, 64, 16, AnyRows, 22, { 32, 1, 1 },
+      { 16, 1, 1 } },
+
+    // AV1 has no slices, at most 64 tile columns and rows, and tiles at
+    // most 4096 wide.
+    { "AV1 720p uncapped", CodecId::AV1, 1280, 720, 64, 1, 0, 4096, { 1, 4, 2 }, { 1, 4, 2 } },
+    { "AV1 slices ignored", CodecId::AV1, 1280, 720, 64, 1000, AnyRows, 4096, { 4, 1, 1 }, { 1, 1, 1 } },
+    { "AV1 without tiles", CodecId::AV1, 1280, 720, 64, 1, 0, 0, { 1, 4, 4 }, { 1, 1, 1 } },
+    { "AV1 4K capped", CodecId::AV1, 3840, 2160, 64, 1, 0, 8, { 1, 4, 4 }, { 1, 3, 2 } },
+    { "AV1 8K uncapped", CodecId::AV1, 7680, 4320, 64, 1, 0, 4096, { 1, 100, 100 }, { 1, 64, 64 } },
+    { "AV1 8K two columns minimum", CodecId::AV1, 7680, 4320, 64, 1, 0, 2, { 1, 1, 1 }, { 1, 2, 1 } },
+    { "AV1 8K capped", CodecId::AV1, 7680, 4320, 64, 1, 0, 4, { 1, 8, 8 }, { 1, 2, 2 } },
+};
+
+static void TestResolveLayout()
+{
+    for (const LayoutCase &test : Cases) {
+        VAAPICaps caps;
+        caps.supported = true;
+        caps.blockSize = test.blockSize;
+        caps.maxSlices = test.maxSlices;
+        caps.sliceStructure = test.sliceStructure;
+        caps.maxTiles = test.maxTiles;
+
+        VAAPICaps::Layout layout = caps.ResolveLayout(test.codec, test.width, test.height, test.requested);
+        bool ok = layout.slices == test.expected.slices && layout.tileCols == test.expected.tileCols &&
+                  layout.tileRows == test.expected.tileRows;
+        if (!ok)
+            fprintf(stderr, "%s: %u slices and %ux%u tiles, expected %u and %ux%u\n", test.name, layout.slices,
+                    layout.tileCols, layout.tileRows, test.expected.slices, test.expected.tileCols,
+                    test.expected.tileRows);
+        CHECK(ok);
+    }
+}
+
+int main()
+{
+    TestResolveLayout();
+    return TestResult();
+}
@@ -0,0 +1,96 @@
+#include "timeline_markers.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <stdio.h>
+
+// Metadata values can't hold the characters the format uses itself.
+static std::string EscapeMetadata(const std::string &value)
+{
+    std::string escaped;
+    for (char c : value) {
+        if (c == '=' || c == ';' || c == '#' || c == '\\' || c == '\n')
+            escaped.push_back('\\');
+        escaped.push_back(c);
+    }
+    return escaped;
+}
+
+bool TimelineMarkers::Load(IPropertyProvider *p_pProps, const std::string &color, uint32_t frameRateNum,
+                           uint32_t frameRateDen)
+{
+    m_markers.clear();
+    m_frameRateNum = frameRateNum;
+    m_frameRateDen = std::max(frameRateDen, 1u);
+
+    PropertyType type = propTypeNull;
+    const void *blob = nullptr;
+    int blobSize = 0;
+    if (p_pProps->GetProperty(pIOPropMarkersBlob, &type, &blob, &blobSize) != errNone || type != propTypeUInt8 ||
+        blobSize <= 0)
+        return true;
+
+    HostMarkersMap markers;
+    if (!markers.FromBuffer(static_cast<const uint8_t *>(blob), blobSize)) {
+        g_Log(logLevelWarn, "VAAPI :: Failed to parse the timeline markers");
+        return false;
+    }
+
+    // Positions are on the timeline clock, which starts at the start
+    // timecode. Hosts that send them relative to the render start have
+    // positions before it.
+    double startTime = 0.0;
+    p_pProps->GetDouble(pIOPropStartTime, startTime);
+    double fps = static_cast<double>(m_frameRateNum) / m_frameRateDen;
+
+    for (const auto &[position, info] : markers.GetMarkersMap()) {
+        if (!color.empty() && info.GetColor() != color)
+            continue;
+
+        double seconds = position >= startTime ? position - startTime : position;
+        Marker marker;
+        marker.pts = std::llround(seconds * fps);
+        marker.name = info.GetName();
+        marker.color = info.GetColor();
+        if (!m_markers.empty() && m_markers.back().pts == marker.pts)
+            continue;
+        m_markers.push_back(std::move(marker));
+    }
+
+    // The map is ordered by position, so the PTS are too.
+    g_Log(logLevelInfo, "VAAPI :: %zu of %zu timeline markers used", m_markers.size(), markers.GetMarkersMap().size());
+    return true;
+}
+
+bool TimelineMarkers::IsMarkerFrame(int64_t pts) const
+{
+    auto it = std::lower_bound(m_markers.begin(), m_markers.end(), pts,
+                               [](const Marker &marker, int64_t value) { return marker.pts < value; });
+    return it != m_markers.end() && it->pts == pts;
+}
+
+bool TimelineMarkers::WriteChapters(const std::string &path, int64_t endPts) const
+{
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        g_Log(logLevelError, "VAAPI :: Failed to open chapters %s", path.c_str());
+        return false;
+    }
+
+    fputs(";FFMETADATA1\n", file);
+    for (size_t i = 0; i < m_markers.size(); i++) {
+        const Marker &marker = m_markers[i];
+        if (marker.pts >= endPts)
+            break;
+
+        int64_t end = i + 1 < m_markers.size() ? std::min(m_markers[i + 1].pts, endPts) : endPts;
+        const std::string &title = marker.name.empty() ? marker.color : marker.name;
+        fprintf(file, "\n[CHAPTER]\nTIMEBASE=%u/%u\nSTART=%lld\nEND=%lld\ntitle=%s\n", m_frameRateDen, m_frameRateNum,
+                static_cast<long long>(marker.pts), static_cast<long long>(end), EscapeMetadata(title).c_str());
+    }
+
+    bool ok = !ferror(file);
+    ok = fclose(file) == 0 && ok;
+    return ok;
+}
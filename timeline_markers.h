@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "wrapper/host_api.h"
+
+using namespace IOPlugin;
+
+// Timeline markers of a render, turned into frame PTS so the encoder can
+// start a GOP on them, and written out as chapters once the render ended.
+class TimelineMarkers
+{
+public:
+    // Reads pIOPropMarkersBlob, keeping only markers of the given color
+    // unless it is empty.
+    bool Load(IPropertyProvider *p_pProps, const std::string &color, uint32_t frameRateNum, uint32_t frameRateDen);
+
+    bool IsEmpty() const
+    {
+        return m_markers.empty();
+    }
+
+    size_t GetCount() const
+    {
+        return m_markers.size();
+    }
+
+    bool IsMarkerFrame(int64_t pts) const;
+
+    // FFMETADATA1 chapters, each lasting until the next one or endPts.
+    bool WriteChapters(const std::string &path, int64_t endPts) const;
+
+private:
+    struct Marker
+    {
+        int64_t pts;
+        std::string name;
+        std::string color;
+    };
+
+    std::vector<Marker> m_markers; // ordered by PTS, one per frame
+    uint32_t m_frameRateNum = 0;
+    uint32_t m_frameRateDen = 0;
+};
@@ -0,0 +1,132 @@
+#include "trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "wrapper/host_api.h"
+
+namespace {
+
+// Session ids are never reused, so a thread's cached buffer of a closed
+// session can't be mistaken for one of a later session at the same address.
+std::atomic<uint64_t> s_nextId = 1;
+std::atomic<uint32_t> s_fileIndex = 0;
+
+const char *TraceDir()
+{
+    static const char *dir = getenv("DVCP_VAAPI_TRACE");
+    return dir && *dir ? dir : nullptr;
+}
+
+} // namespace
+
+Tracer::Tracer()
+    : m_id(s_nextId++)
+    , m_enabled(TraceDir() != nullptr)
+{
+}
+
+Tracer::~Tracer() = default;
+
+uint64_t Tracer::NowUs()
+{
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(now).count();
+}
+
+Tracer::ThreadBuffer *Tracer::LocalBuffer()
+{
+    // Host threads usually serve one or two encoders, remember the last few.
+    struct CacheEntry
+    {
+        uint64_t id;
+        ThreadBuffer *buffer;
+    };
+    thread_local CacheEntry cache[4] = {};
+    thread_local uint32_t cacheNext = 0;
+    thread_local int tid = static_cast<int>(syscall(SYS_gettid));
+
+    for (const CacheEntry &entry : cache) {
+        if (entry.id == m_id)
+            return entry.buffer;
+    }
+
+    ThreadBuffer *buffer = nullptr;
+    {
+        std::lock_guard<std::mutex> guard(m_buffersLock);
+        for (auto &candidate : m_buffers) {
+            if (candidate->tid == tid)
+                buffer = candidate.get();
+        }
+        if (!buffer) {
+            m_buffers.push_back(std::make_unique<ThreadBuffer>());
+            buffer = m_buffers.back().get();
+            buffer->tid = tid;
+            buffer->events = std::make_unique<Event[]>(RingSize);
+        }
+    }
+
+    cache[cacheNext++ % 4] = {m_id, buffer};
+    return buffer;
+}
+
+void Tracer::AddSpan(const char *name, uint64_t startUs, uint64_t endUs, int64_t pts)
+{
+    if (!m_enabled)
+        return;
+
+    ThreadBuffer *buffer = LocalBuffer();
+    uint64_t count = buffer->count.load(std::memory_order_relaxed);
+    buffer->events[count % RingSize] = {name, startUs, endUs - startUs, pts};
+    buffer->count.store(count + 1, std::memory_order_release);
+}
+
+void Tracer::Flush()
+{
+    if (!m_enabled)
+        return;
+
+    std::string path = std::string(TraceDir()) + "/dvcp-vaapi-" + std::to_string(getpid()) +
+        "-" + std::to_string(s_fileIndex++) + ".json";
+    FILE *file = fopen(path.c_str(), "w");
+    if (!file) {
+        g_Log(logLevelError, "VAAPI :: Failed to open trace file %s", path.c_str());
+        return;
+    }
+
+    const int pid = getpid();
+    bool first = true;
+    uint64_t dropped = 0;
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+
+    std::lock_guard<std::mutex> guard(m_buffersLock);
+    for (auto &buffer : m_buffers) {
+        uint64_t count = buffer->count.load(std::memory_order_acquire);
+        uint64_t begin = count > RingSize ? count - RingSize : 0;
+        dropped += begin;
+        for (uint64_t i = begin; i < count; i++) {
+            const Event &event = buffer->events[i % RingSize];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"vaapi\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%llu",
+                    first ? "" : ",", event.name, pid, buffer->tid,
+                    static_cast<unsigned long long>(event.start), static_cast<unsigned long long>(event.duration));
+            if (event.pts != NoPTS)
+                fprintf(file, ",\"args\":{\"pts\":%lld}", static_cast<long long>(event.pts));
+            fputc('}', file);
+            first = false;
+        }
+        buffer->count.store(0, std::memory_order_relaxed);
+    }
+
+    fputs("\n]}\n", file);
+    fclose(file);
+
+    if (dropped)
+        g_Log(logLevelWarn, "VAAPI :: Trace kept the last %u events per thread, %llu older ones were dropped", RingSize,
+              static_cast<unsigned long long>(dropped));
+    g_Log(logLevelInfo, "VAAPI :: Wrote trace %s", path.c_str());
+}
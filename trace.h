@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <stdint.h>
+
+// Opt-in Chrome trace-event recorder, enabled by pointing DVCP_VAAPI_TRACE
+// at a directory. Each encoder owns one Tracer; its spans are kept in
+// per-thread rings and only serialized by Flush(), so recording neither
+// touches the filesystem nor takes a lock.
+class Tracer
+{
+public:
+    static constexpr int64_t NoPTS = INT64_MIN;
+    // Per thread and session, older events are overwritten beyond this.
+    static constexpr uint32_t RingSize = 1 << 16;
+
+    Tracer();
+    ~Tracer();
+
+    bool IsEnabled() const
+    {
+        return m_enabled;
+    }
+
+    static uint64_t NowUs();
+    void AddSpan(const char *name, uint64_t startUs, uint64_t endUs, int64_t pts = NoPTS);
+    // Writes the events of this session to a new file. No thread may record
+    // into it meanwhile, so it's called once the encoder is closed.
+    void Flush();
+
+private:
+    Tracer(const Tracer &) = delete;
+    Tracer &operator=(const Tracer &) = delete;
+
+    struct Event
+    {
+        const char *name;
+        uint64_t start;
+        uint64_t duration;
+        int64_t pts;
+    };
+
+    // Written by its thread only, so publishing an event is a single store.
+    struct ThreadBuffer
+    {
+        int tid = 0;
+        std::unique_ptr<Event[]> events;
+        std::atomic<uint64_t> count = 0;
+    };
+
+    ThreadBuffer *LocalBuffer();
+
+    const uint64_t m_id;
+    const bool m_enabled;
+    // Only taken the first time a thread records into this session.
+    std::mutex m_buffersLock;
+    std::vector<std::unique_ptr<ThreadBuffer>> m_buffers;
+};
+
+class TraceScope
+{
+public:
+    TraceScope(Tracer &tracer, const char *name, int64_t pts = Tracer::NoPTS)
+        : m_tracer(tracer)
+        , m_name(name)
+        , m_pts(pts)
+        , m_start(tracer.IsEnabled() ? Tracer::NowUs() : 0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (m_start)
+            m_tracer.AddSpan(m_name, m_start, Tracer::NowUs(), m_pts);
+    }
+
+    void SetPTS(int64_t pts)
+    {
+        m_pts = pts;
+    }
+
+    // Closes the current span and opens the next stage on the same scope.
+    void Next(const char *name)
+    {
+        if (m_start) {
+            uint64_t now = Tracer::NowUs();
+            m_tracer.AddSpan(m_name, m_start, now, m_pts);
+            m_start = now;
+        }
+        m_name = name;
+    }
+
+private:
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    Tracer &m_tracer;
+    const char *m_name;
+    int64_t m_pts;
+    uint64_t m_start;
+};
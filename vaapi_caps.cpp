@@ -0,0 +1,165 @@
+#include "vaapi_caps.h"
+
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include <libavutil/hwcontext.h>
+#include <libavutil/hwcontext_vaapi.h>
+}
+
+static VAProfile GetProfile(const CodecTraits &traits)
+{
+    switch (traits.id) {
+        case CodecId::H264: return VAProfileH264High;
+        case CodecId::HEVC: return traits.depth == 8 ? VAProfileHEVCMain : VAProfileHEVCMain10;
+        case CodecId::AV1: return VAProfileAV1Profile0;
+    }
+    return VAProfileNone;
+}
+
+VAAPICaps VAAPICaps::Query(AVBufferRef *hwdev, const CodecTraits &traits)
+{
+    VAAPICaps caps;
+    if (!hwdev)
+        return caps;
+
+    AVHWDeviceContext *deviceCtx = reinterpret_cast<AVHWDeviceContext *>(hwdev->data);
+    VADisplay display = static_cast<AVVAAPIDeviceContext *>(deviceCtx->hwctx)->display;
+    VAProfile profile = GetProfile(traits);
+
+    std::vector<VAEntrypoint> entrypoints(vaMaxNumEntrypoints(display));
+    int count = 0;
+    if (vaQueryConfigEntrypoints(display, profile, entrypoints.data(), &count) != VA_STATUS_SUCCESS)
+        return caps;
+
+    // libavcodec prefers the full entrypoint unless only the low power one exists.
+    bool haveFull = false;
+    for (int i = 0; i < count; i++) {
+        if (entrypoints[i] == VAEntrypointEncSlice)
+            haveFull = true;
+        else if (entrypoints[i] == VAEntrypointEncSliceLP)
+            caps.lowPower = true;
+    }
+    if (!haveFull && !caps.lowPower)
+        return caps;
+    caps.supported = true;
+    caps.lowPower = !haveFull;
+
+    // libavcodec's defaults when the driver doesn't report block sizes.
+    caps.blockSize = traits.id == CodecId::H264 ? 16 : traits.id == CodecId::HEVC ? 32 : 64;
+
+    VAConfigAttrib attribs[] = {
+        { VAConfigAttribEncMaxRefFrames, 0 },
+        { VAConfigAttribRateControl, 0 },
+        { VAConfigAttribEncMaxSlices, 0 },
+        { VAConfigAttribEncSliceStructure, 0 },
+        { VAConfigAttribEncTileSupport, 0 },
+        { VAConfigAttribEncROI, 0 },
+#if VA_CHECK_VERSION(1, 13, 0)
+        { VAConfigAttribEncHEVCBlockSizes, 0 },
+#endif
+#if VA_CHECK_VERSION(1, 14, 0)
+        { VAConfigAttribEncAV1Ext2, 0 },
+#endif
+    };
+    VAEntrypoint entrypoint = haveFull ? VAEntrypointEncSlice : VAEntrypointEncSliceLP;
+    if (vaGetConfigAttributes(display, profile, entrypoint, attribs, sizeof(attribs) / sizeof(attribs[0])) != VA_STATUS_SUCCESS)
+        return caps;
+
+    for (const VAConfigAttrib &attrib : attribs) {
+        if (attrib.value == VA_ATTRIB_NOT_SUPPORTED)
+            continue;
+        switch (attrib.type) {
+            case VAConfigAttribEncMaxRefFrames:
+                caps.maxRefL0 = attrib.value & 0xffff;
+                caps.maxRefL1 = attrib.value >> 16 & 0xffff;
+                break;
+            case VAConfigAttribRateControl:
+                caps.rateControls = attrib.value;
+                break;
+            case VAConfigAttribEncMaxSlices:
+                caps.maxSlices = std::max(attrib.value, 1u);
+                break;
+            case VAConfigAttribEncSliceStructure:
+                caps.sliceStructure = attrib.value;
+                break;
+            case VAConfigAttribEncTileSupport:
+                // Every HEVC tile goes in a slice of its own.
+                if (traits.id == CodecId::HEVC && attrib.value)
+                    caps.maxTiles = UINT32_MAX;
+                break;
+            case VAConfigAttribEncROI: {
+                VAConfigAttribValEncROI roi;
+                roi.value = attrib.value;
+                caps.roiRegions = roi.bits.num_roi_regions;
+                caps.roiQPDelta = roi.bits.roi_rc_qp_delta_support;
+                break;
+            }
+#if VA_CHECK_VERSION(1, 13, 0)
+            case VAConfigAttribEncHEVCBlockSizes:
+                if (traits.id == CodecId::HEVC) {
+                    VAConfigAttribValEncHEVCBlockSizes sizes;
+                    sizes.value = attrib.value;
+                    caps.blockSize = 8 << sizes.bits.log2_max_coding_tree_block_size_minus3;
+                }
+                break;
+#endif
+#if VA_CHECK_VERSION(1, 14, 0)
+            case VAConfigAttribEncAV1Ext2:
+                if (traits.id == CodecId::AV1) {
+                    VAConfigAttribValEncAV1Ext2 ext2;
+                    ext2.value = attrib.value;
+                    caps.maxTiles = ext2.bits.max_tile_num_minus1 + 1;
+                }
+                break;
+#endif
+            default:
+                break;
+        }
+    }
+    if (caps.maxTiles == UINT32_MAX)
+        caps.maxTiles = caps.sliceStructure ? caps.maxSlices : 1;
+
+    return caps;
+}
+
+VAAPICaps::Layout VAAPICaps::ResolveLayout(CodecId codec, uint32_t width, uint32_t height, const Layout &requested) const
+{
+    uint32_t gridCols = (width + blockSize - 1) / blockSize;
+    uint32_t gridRows = (height + blockSize - 1) / blockSize;
+    Layout layout = { 1, 1, 1 };
+
+    if (codec != CodecId::H264 && maxTiles > 1) {
+        // HEVC tiles are at least 256x64 luma samples, AV1 tiles at most
+        // 4096 wide and 64 to a row or column.
+        uint32_t maxCols = codec == CodecId::HEVC ? std::max(width / 256, 1u) : 64;
+        uint32_t maxRows = codec == CodecId::HEVC ? std::max(height / 64, 1u) : 64;
+        uint32_t minCols = codec == CodecId::AV1 ? (width + 4095) / 4096 : 1;
+        layout.tileCols = std::clamp(requested.tileCols, minCols, std::max(std::min(maxCols, gridCols), minCols));
+        layout.tileRows = std::clamp(requested.tileRows, 1u, std::min(maxRows, gridRows));
+        while (layout.tileCols * layout.tileRows > maxTiles) {
+            if (layout.tileRows > 1 && (layout.tileRows >= layout.tileCols || layout.tileCols <= minCols))
+                layout.tileRows--;
+            else if (layout.tileCols > minCols)
+                layout.tileCols--;
+            else
+                break;
+        }
+        if (codec == CodecId::HEVC)
+            layout.slices = layout.tileCols * layout.tileRows;
+    }
+
+    if (codec != CodecId::AV1 && layout.tileCols * layout.tileRows == 1 && sliceStructure) {
+        layout.slices = std::clamp(requested.slices, 1u, std::min(maxSlices, gridRows));
+        // Some drivers only split frames into power of two row counts.
+        uint32_t anyRows = VA_ENC_SLICE_STRUCTURE_ARBITRARY_ROWS | VA_ENC_SLICE_STRUCTURE_ARBITRARY_MACROBLOCKS |
+                           VA_ENC_SLICE_STRUCTURE_EQUAL_ROWS | VA_ENC_SLICE_STRUCTURE_EQUAL_MULTI_ROWS;
+        if (!(sliceStructure & anyRows)) {
+            while (layout.slices & (layout.slices - 1))
+                layout.slices &= layout.slices - 1;
+        }
+    }
+
+    return layout;
+}
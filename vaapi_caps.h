@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "codec_traits.h"
+
+extern "C" {
+#include <libavutil/buffer.h>
+}
+
+// Encode capabilities the VA driver reports for one codec variant, read from
+// the config attributes of the entrypoint libavcodec will use.
+struct VAAPICaps
+{
+    static constexpr uint32_t MaxBFrames = 3;
+
+    bool supported = false;
+    bool lowPower = false; // only VAEntrypointEncSliceLP is available
+    uint32_t maxRefL0 = 0;
+    uint32_t maxRefL1 = 0;
+    uint32_t rateControls = 0; // VA_RC_* bits, 0 when the driver doesn't say
+    uint32_t maxSlices = 1;
+    uint32_t sliceStructure = 0; // VA_ENC_SLICE_STRUCTURE_* bits
+    uint32_t maxTiles = 0; // 0 when frames can't be split into tiles
+    uint32_t blockSize = 16; // macroblock, CTU or superblock size in luma samples
+    uint32_t roiRegions = 0; // 0 when the driver takes no ROI, so no QP offsets
+    bool roiQPDelta = false; // ROI QP offsets also work with bit rate control
+
+    struct Layout
+    {
+        uint32_t slices;
+        uint32_t tileCols;
+        uint32_t tileRows;
+    };
+
+    // hwdev is a VAAPI AVHWDeviceContext.
+    static VAAPICaps Query(AVBufferRef *hwdev, const CodecTraits &traits);
+
+    uint32_t GetMaxBFrames() const
+    {
+        return maxRefL1 ? MaxBFrames : 0;
+    }
+
+    // Whether libavcodec passes full-frame ROI QP offsets on to the driver.
+    // Without, it drops the side data with a warning.
+    bool SupportsQPOffsets(bool constantQP) const
+    {
+        return roiRegions > 0 && (constantQP || roiQPDelta);
+    }
+
+    // Fits the requested slices and tiles to the driver limits and to the
+    // block grid of a width x height frame. HEVC tiles are one slice each.
+    Layout ResolveLayout(CodecId codec, uint32_t width, uint32_t height, const Layout &requested) const;
+};
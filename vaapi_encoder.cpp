@@ -1,29 +1,52 @@
 #include "vaapi_encoder.h"
+#include "av1_obu.h"
+#include "checkpoint.h"
+#include "es_container.h"
+#include "fmp4_container.h"
+#include "frame_stats.h"
+#include "gpu_usage.h"
+#include "hevc_ps.h"
+#include "keyframe_index.h"
+#include "lookahead.h"
+#include "metrics.h"
+#include "packet_order.h"
+#include "probes.h"
+#include "trace.h"
+#include "timeline_markers.h"
+#include "vaapi_caps.h"
 
 #include <assert.h>
+#include <cmath>
 #include <cstring>
 #include <vector>
 #include <stdint.h>
 
+#include <algorithm>
 #include <iostream>
+#include <optional>
 #include <filesystem>
 
+#include <sys/resource.h>
+
 extern "C" {
 #include <va/va.h>
 #include <libavutil/opt.h>
 }
 
-enum {
-    FOURCC_AVC = 1635148593,
-    FOURCC_HEVC = 1752589105,
-    FOURCC_AV1 = 1635135537,
-};
+VAAPI_PROBE_SEMAPHORE(frame_received);
+VAAPI_PROBE_SEMAPHORE(upload_done);
+VAAPI_PROBE_SEMAPHORE(frame_submitted);
+VAAPI_PROBE_SEMAPHORE(packet_received);
+VAAPI_PROBE_SEMAPHORE(packet_sent);
+VAAPI_PROBE_SEMAPHORE(flush);
+VAAPI_PROBE_SEMAPHORE(error);
 
-static const uint8_t uuid_h264[] = { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, 0x20 };
-static const uint8_t uuid_hevc_8[] = { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, 0x21 };
-static const uint8_t uuid_hevc_10[] = { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, 0x22 };
-static const uint8_t uuid_av1_8[] = { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, 0x23 };
-static const uint8_t uuid_av1_10[] = { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, 0x24 };
+static uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
 
 // H264 MP4
 static bool ConvertAnnexBToAVCC(const uint8_t* annexb_data, size_t annexb_size,
@@ -96,126 +119,110 @@ static bool ConvertAnnexBToAVCC(const uint8_t* annexb_data, size_t annexb_size,
     return true;
 }
 
-// HEVC MP4
-static bool ConvertAnnexBToHVCC(const uint8_t* annexb_data, size_t annexb_size,
-                                std::vector<uint8_t>& out_hvcc,
-                                uint8_t bitDepthLuma, uint8_t bitDepthChroma,
-                                uint32_t frameRateNum = 0, uint32_t frameRateDen = 0)
+template <CodecId Id>
+static bool BuildConfigRecord(const ConfigRecordParams &params, std::vector<uint8_t> &record);
+
+template <>
+bool BuildConfigRecord<CodecId::H264>(const ConfigRecordParams &params, std::vector<uint8_t> &record)
 {
-    if (!annexb_data || annexb_size < 6) return false;
+    return ConvertAnnexBToAVCC(params.extradata, params.size, record);
+}
 
-    size_t offset = 0;
-    std::vector<std::vector<uint8_t>> vps_list;
-    std::vector<std::vector<uint8_t>> sps_list;
-    std::vector<std::vector<uint8_t>> pps_list;
+template <>
+bool BuildConfigRecord<CodecId::HEVC>(const ConfigRecordParams &params, std::vector<uint8_t> &record)
+{
+    return BuildHEVCConfigRecord(params.extradata, params.size, params.frameRateNum, params.frameRateDen, record);
+}
 
-    while (offset + 4 < annexb_size) {
-        // Detect start code
-        size_t start_code_size = 0;
-        if (annexb_data[offset] == 0 && annexb_data[offset+1] == 0 && annexb_data[offset+2] == 1) {
-            start_code_size = 3;
-        } else if (annexb_data[offset] == 0 && annexb_data[offset+1] == 0 && annexb_data[offset+2] == 0 && annexb_data[offset+3] == 1) {
-            start_code_size = 4;
-        } else {
-            offset++;
-            continue;
-        }
+template <>
+bool BuildConfigRecord<CodecId::AV1>(const ConfigRecordParams &params, std::vector<uint8_t> &record)
+{
+    return BuildAV1ConfigRecord(params.extradata, params.size, record);
+}
 
-        offset += start_code_size;
-        size_t nal_start = offset;
-        size_t nal_end = annexb_size;
+template <CodecId Id>
+static size_t Mp4PayloadOffset(const uint8_t *, size_t)
+{
+    return 0;
+}
 
-        for (size_t i = offset; i + 3 < annexb_size; ++i) {
-            if (annexb_data[i] == 0 && annexb_data[i+1] == 0 && (annexb_data[i+2] == 1 || (annexb_data[i+2] == 0 && annexb_data[i+3] == 1))) {
-                nal_end = i;
-                break;
-            }
-        }
+template <>
+size_t Mp4PayloadOffset<CodecId::AV1>(const uint8_t *data, size_t size)
+{
+    return GetAV1TemporalDelimiterSize(data, size);
+}
 
-        if (nal_end <= nal_start) continue;
+#define VAAPI_UUID(last) { 0x01, 0x6f, 0x34, 0x71, 0x31, 0x17, 0x42, 0x05, 0xbf, 0x55, 0x37, 0x1c, 0xb0, 0xac, 0x66, last }
+#define VAAPI_CODEC(id, maxQP, qpPerDoubling, prepend) \
+    CodecId::id, maxQP, qpPerDoubling, BuildConfigRecord<CodecId::id>, prepend, Mp4PayloadOffset<CodecId::id>
 
-        uint8_t nal_unit_type = (annexb_data[nal_start] >> 1) & 0x3F;
-        std::vector<uint8_t> nal(annexb_data + nal_start, annexb_data + nal_end);
+static constexpr CodecTraits s_Codecs[] = {
+    { VAAPI_UUID(0x20), FOURCC_AVC, "h264_vaapi", "VAAPI H.264", "YUV 420 8-bit", 8, VAAPI_CODEC(H264, 51, 6.0, true) },
+    { VAAPI_UUID(0x21), FOURCC_HEVC, "hevc_vaapi", "VAAPI H.265", "YUV 420 8-bit", 8, VAAPI_CODEC(HEVC, 51, 6.0, true) },
+    { VAAPI_UUID(0x22), FOURCC_HEVC, "hevc_vaapi", "VAAPI H.265", "YUV 420 10-bit", 10, VAAPI_CODEC(HEVC, 51, 6.0, true) },
+    { VAAPI_UUID(0x23), FOURCC_AV1, "av1_vaapi", "VAAPI AV1", "YUV 420 8-bit", 8, VAAPI_CODEC(AV1, 255, 24.0, false) },
+    { VAAPI_UUID(0x24), FOURCC_AV1, "av1_vaapi", "VAAPI AV1", "YUV 420 10-bit", 10, VAAPI_CODEC(AV1, 255, 24.0, false) },
+};
 
-        switch (nal_unit_type) {
-            case 32: vps_list.push_back(nal); break; // VPS
-            case 33: sps_list.push_back(nal); break; // SPS
-            case 34: pps_list.push_back(nal); break; // PPS
-            default: break;
-        }
+#undef VAAPI_CODEC
+#undef VAAPI_UUID
 
-        offset = nal_end;
+static const CodecTraits *FindCodec(const uint8_t *uuid)
+{
+    for (const CodecTraits &traits : s_Codecs) {
+        if (!memcmp(uuid, traits.uuid, sizeof(traits.uuid)))
+            return &traits;
     }
+    return nullptr;
+}
 
-    if (vps_list.empty() || sps_list.empty() || pps_list.empty())
-        return false;
-
-    const std::vector<uint8_t>& sps = sps_list[0];
-
-    uint8_t general_profile_space = (sps[1] >> 6) & 0x03;
-    uint8_t general_tier_flag = (sps[1] >> 5) & 0x01;
-    uint8_t general_profile_idc = sps[1] & 0x1F;
-    uint32_t general_profile_compatibility_flags = (sps[2] << 24) | (sps[3] << 16) | (sps[4] << 8) | sps[5];
-    uint64_t general_constraint_indicator_flags =
-    ((uint64_t)sps[6] << 40) | ((uint64_t)sps[7] << 32) |
-    ((uint64_t)sps[8] << 24) | ((uint64_t)sps[9] << 16) |
-    ((uint64_t)sps[10] << 8) | sps[11];
-    uint8_t general_level_idc = sps[12];
-
-    out_hvcc.clear();
-    out_hvcc.push_back(1); // configurationVersion
-    out_hvcc.push_back((general_profile_space << 6) | (general_tier_flag << 5) | general_profile_idc);
-    out_hvcc.push_back((general_profile_compatibility_flags >> 24) & 0xFF);
-    out_hvcc.push_back((general_profile_compatibility_flags >> 16) & 0xFF);
-    out_hvcc.push_back((general_profile_compatibility_flags >> 8) & 0xFF);
-    out_hvcc.push_back(general_profile_compatibility_flags & 0xFF);
-
-    for (int i = 5; i >= 0; --i)
-        out_hvcc.push_back((general_constraint_indicator_flags >> (i * 8)) & 0xFF);
-
-    out_hvcc.push_back(general_level_idc);
-
-    // reserved (4 bits) + min_spatial_segmentation_idc (12 bits)
-    out_hvcc.push_back(0xF0); // reserved (4 bits set to 1)
-    out_hvcc.push_back(0x00); // min_spatial_segmentation_idc = 0
-
-    out_hvcc.push_back(0xFC); // reserved + parallelismType = 0 (unknown)
-    out_hvcc.push_back(0xFC | (0 & 0x03)); // reserved + chromaFormatIdc=0 (monochrome, will be overridden if needed)
-
-    out_hvcc.push_back(0xF8 | ((bitDepthLuma - 8) & 0x07));   // bitDepthLumaMinus8
-    out_hvcc.push_back(0xF8 | ((bitDepthChroma - 8) & 0x07)); // bitDepthChromaMinus8
-
-    if (frameRateNum > 0 && frameRateDen > 0) {
-        uint32_t avgFrameRate = (frameRateNum * 1000 + (frameRateDen/2)) / frameRateDen; // FPS x1000
-        out_hvcc.push_back((avgFrameRate >> 8) & 0xFF);
-        out_hvcc.push_back(avgFrameRate & 0xFF);
-    } else {
-        out_hvcc.push_back(0x00);
-        out_hvcc.push_back(0x00);
-    }
+enum RateControlMode
+{
+    rcCQP = 0,
+    rcVBR = 1,
+    rcCBR = 2,
+    rcQVBR = 3,
+    rcICQ = 4,
+};
 
-    // constantFrameRate = 1 (fixed framerate), numTemporalLayers = 0, temporalIdNested = 1, lengthSizeMinusOne = 3
-    out_hvcc.push_back((1 << 6) | (0 << 3) | (1 << 2) | 3);
+struct RateControlInfo
+{
+    const char *name; // libavcodec rc_mode
+    const char *label;
+    uint32_t vaMode;
+};
 
-    out_hvcc.push_back(3); // numOfArrays (VPS + SPS + PPS)
+static const RateControlInfo s_RateControls[] = {
+    { "CQP", "Constant Quality", VA_RC_CQP },
+    { "VBR", "Variable Bitrate", VA_RC_VBR },
+    { "CBR", "Constant Bitrate", VA_RC_CBR },
+    { "QVBR", "Quality Variable Bitrate", VA_RC_QVBR },
+    { "ICQ", "Intelligent Constant Quality", VA_RC_ICQ },
+};
 
-    auto append_array = [&](uint8_t nal_unit_type, const std::vector<std::vector<uint8_t>>& nals) {
-        out_hvcc.push_back(0x80 | nal_unit_type); // array_completeness + NAL unit type
-        out_hvcc.push_back(static_cast<uint8_t>(nals.size()));
-        for (const auto& nal : nals) {
-            out_hvcc.push_back((nal.size() >> 8) & 0xFF);
-            out_hvcc.push_back(nal.size() & 0xFF);
-            out_hvcc.insert(out_hvcc.end(), nal.begin(), nal.end());
-        }
+// Picks the closest mode the driver reports when the requested one is missing.
+static int32_t ResolveRateControl(int32_t mode, uint32_t supported)
+{
+    static const int32_t fallbacks[][3] = {
+        { rcCQP, rcICQ, rcVBR },
+        { rcVBR, rcCBR, rcCQP },
+        { rcCBR, rcVBR, rcCQP },
+        { rcQVBR, rcVBR, rcCBR },
+        { rcICQ, rcCQP, rcVBR },
     };
 
-    append_array(32, vps_list); // VPS
-    append_array(33, sps_list); // SPS
-    append_array(34, pps_list); // PPS
-
-    return true;
+    if (!supported)
+        return mode;
+    for (int32_t candidate : fallbacks[mode]) {
+        if (supported & s_RateControls[candidate].vaMode)
+            return candidate;
+    }
+    return mode;
 }
 
+// Intra frames carry no prediction from references, so mezzanine output
+// needs a lower QP than long-GOP for the same look.
+static constexpr int32_t IntraDefaultQP = 18;
 
 class UISettingsController
 {
@@ -225,8 +232,9 @@ public:
         InitDefaults();
     }
 
-    explicit UISettingsController(const HostCodecConfigCommon& p_CommonProps)
+    UISettingsController(const HostCodecConfigCommon& p_CommonProps, CodecId p_Codec)
         : m_CommonProps(p_CommonProps)
+        , m_Codec(p_Codec)
     {
         InitDefaults();
     }
@@ -240,17 +248,36 @@ public:
         uint8_t val8 = 0;
         p_pValues->GetUINT8("vaapi_reset", val8);
         if (val8 != 0) {
+            CodecId codec = m_Codec;
             *this = UISettingsController();
+            m_Codec = codec;
             return;
         }
 
         p_pValues->GetINT32("vaapi_preset", m_Preset);
+        p_pValues->GetINT32("vaapi_bframes", m_BFrames);
+        p_pValues->GetINT32("vaapi_lowlatency", m_LowLatency);
         p_pValues->GetINT32("vaapi_preencode", m_PreEncode);
         p_pValues->GetINT32("vaapi_vbaq", m_VBAQ);
         p_pValues->GetINT32("vaapi_rc", m_RateControl);
-        p_pValues->GetINT32("vaapi_qp", m_QP);
+        p_pValues->GetINT32("vaapi_intra", m_Intra);
+        if (!p_pValues->GetINT32("vaapi_qp", m_QP) && m_Intra)
+            m_QP = IntraDefaultQP;
         p_pValues->GetINT32("vaapi_bitrate", m_BitRate);
+        p_pValues->GetINT32("vaapi_maxrate", m_MaxRate);
+        p_pValues->GetINT32("vaapi_bufsize", m_BufferSize);
         p_pValues->GetINT32("vaapi_device", m_Device);
+        p_pValues->GetINT32("vaapi_stats", m_FrameStats);
+        p_pValues->GetINT32("vaapi_multipass", m_MultiPass);
+        p_pValues->GetINT32("vaapi_lookahead", m_Lookahead);
+        p_pValues->GetINT32("vaapi_lookahead_budget", m_LookaheadBudget);
+        p_pValues->GetINT32("vaapi_checkpoint", m_Checkpoint);
+        p_pValues->GetINT32("vaapi_index", m_Index);
+        p_pValues->GetINT32("vaapi_checksum", m_Checksum);
+        p_pValues->GetINT32("vaapi_markers", m_Markers);
+        p_pValues->GetString("vaapi_marker_color", m_MarkerColor);
+        p_pValues->GetINT32("vaapi_slices", m_Slices);
+        p_pValues->GetINT32("vaapi_tiles", m_Tiles);
     }
 
     StatusCode Render(HostListRef* p_pSettingsList)
@@ -304,19 +331,57 @@ public:
         }
 
         {
-            HostUIConfigEntryRef item("vaapi_rc");
+            HostUIConfigEntryRef item("vaapi_intra");
+
+            item.MakeCheckBox({}, "All-intra", m_Intra);
+            item.SetTriggersUpdate(true);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_lowlatency");
+
+            item.MakeCheckBox({}, "Low latency", m_LowLatency);
+            item.SetTriggersUpdate(true);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_bframes");
 
             std::vector<std::string> textsVec;
             std::vector<int> valuesVec;
 
-            textsVec.push_back("Constant Quality");
+            textsVec.push_back("None");
             valuesVec.push_back(0);
 
-            textsVec.push_back("Variable Bitrate");
-            valuesVec.push_back(1);
+            for (uint32_t i = 1; i <= VAAPICaps::MaxBFrames; i++) {
+                textsVec.push_back(std::to_string(i));
+                valuesVec.push_back(i);
+            }
+
+            item.MakeComboBox("B-Frames", textsVec, valuesVec, m_BFrames);
+            item.SetHidden(m_LowLatency != 0 || m_Intra != 0);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_rc");
+
+            std::vector<std::string> textsVec;
+            std::vector<int> valuesVec;
+
+            for (int32_t mode = rcCQP; mode <= rcICQ; mode++) {
+                textsVec.push_back(s_RateControls[mode].label);
+                valuesVec.push_back(mode);
+            }
 
             item.MakeRadioBox("Rate Control", textsVec, valuesVec, GetRateControl());
             item.SetTriggersUpdate(true);
+            item.SetHidden(m_LowLatency != 0);
 
             p_pSettingsList->Append(&item);
         }
@@ -331,9 +396,9 @@ public:
             } else {
                 pLabel = "(low)";
             }
-            item.MakeSlider("QP", pLabel, m_QP, 1, 51, 25);
+            item.MakeSlider(m_RateControl == rcCQP ? "QP" : "Quality", pLabel, m_QP, 1, 51, m_Intra ? IntraDefaultQP : 25);
             item.SetTriggersUpdate(true);
-            item.SetHidden(m_RateControl != 0);
+            item.SetHidden(!UsesQuality());
 
             p_pSettingsList->Append(&item);
         }
@@ -341,7 +406,23 @@ public:
         {
             HostUIConfigEntryRef item("vaapi_bitrate");
             item.MakeSlider("Bit Rate", "Kbps", m_BitRate, 100, 100000, 8000, 1);
-            item.SetHidden(m_RateControl != 1);
+            item.SetHidden(!UsesBitRate());
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_maxrate");
+            item.MakeSlider("Max Bit Rate", "Kbps, 0 = 1.5x", m_MaxRate, 0, 200000, 0, 1);
+            item.SetHidden(GetRateControl() != rcVBR && GetRateControl() != rcQVBR);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_bufsize");
+            item.MakeSlider("VBV Buffer", "Kbit, 0 = auto", m_BufferSize, 0, 200000, 0, 1);
+            item.SetHidden(!UsesBitRate());
 
             p_pSettingsList->Append(&item);
         }
@@ -355,6 +436,67 @@ public:
             }
         }
 
+        {
+            HostUIConfigEntryRef item("vaapi_lookahead");
+
+            std::vector<std::string> textsVec;
+            std::vector<int> valuesVec;
+
+            textsVec.push_back("Off");
+            valuesVec.push_back(0);
+
+            for (int frames : { 8, 16, 32 }) {
+                textsVec.push_back(std::to_string(frames) + " frames");
+                valuesVec.push_back(frames);
+            }
+
+            item.MakeComboBox("Lookahead", textsVec, valuesVec, m_Lookahead);
+            item.SetTriggersUpdate(true);
+            item.SetHidden(m_LowLatency != 0 || m_Intra != 0);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_lookahead_budget");
+            item.MakeSlider("Lookahead Budget", "us/frame", m_LookaheadBudget, 100, 10000, 1000, 100);
+            item.SetHidden(m_Lookahead == 0 || m_LowLatency != 0 || m_Intra != 0);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_slices");
+
+            std::vector<std::string> textsVec;
+            std::vector<int> valuesVec;
+
+            for (int slices : { 1, 2, 4, 8 }) {
+                textsVec.push_back(std::to_string(slices));
+                valuesVec.push_back(slices);
+            }
+
+            item.MakeComboBox("Slices", textsVec, valuesVec, m_Slices);
+            // HEVC tiles come with a slice each.
+            item.SetHidden(m_Codec == CodecId::AV1 || (m_Codec == CodecId::HEVC && m_Tiles != 0));
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_tiles");
+
+            std::vector<std::string> textsVec = { "Off", "2 x 1", "2 x 2", "4 x 2", "4 x 4" };
+            // Columns in the high byte, rows in the low one.
+            std::vector<int> valuesVec = { 0, 2 << 8 | 1, 2 << 8 | 2, 4 << 8 | 2, 4 << 8 | 4 };
+
+            item.MakeComboBox("Tiles", textsVec, valuesVec, m_Tiles);
+            item.SetTriggersUpdate(true);
+            item.SetHidden(m_Codec == CodecId::H264);
+
+            p_pSettingsList->Append(&item);
+        }
+
         {
             HostUIConfigEntryRef item("vaapi_preencode");
 
@@ -367,7 +509,70 @@ public:
             HostUIConfigEntryRef item("vaapi_vbaq");
 
             item.MakeCheckBox({}, "Enable VBAQ", m_VBAQ);
-            item.SetHidden(m_RateControl != 1);
+            item.SetHidden(!UsesBitRate());
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_multipass");
+
+            item.MakeCheckBox({}, "Two-pass encoding", m_MultiPass);
+            item.SetHidden(GetRateControl() != rcVBR || m_Intra != 0);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_markers");
+
+            item.MakeCheckBox({}, "Keyframes and chapters at markers", m_Markers);
+            item.SetTriggersUpdate(true);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_marker_color");
+
+            item.MakeMarkerColorSelector("Marker Color", {}, m_MarkerColor);
+            item.SetHidden(m_Markers == 0);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_checkpoint");
+
+            item.MakeCheckBox({}, "Resumable render", m_Checkpoint);
+            item.SetHidden(GetMultiPass() != 0);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_index");
+
+            std::vector<std::string> textsVec = { "Off", "Keyframes", "Every frame" };
+            std::vector<int> valuesVec = { 0, 1, 2 };
+
+            item.MakeComboBox("Keyframe index (ES only)", textsVec, valuesVec, m_Index);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_checksum");
+
+            item.MakeCheckBox({}, "Write SHA-256 checksums", m_Checksum);
+
+            p_pSettingsList->Append(&item);
+        }
+
+        {
+            HostUIConfigEntryRef item("vaapi_stats");
+
+            item.MakeCheckBox({}, "Write frame statistics", m_FrameStats);
 
             p_pSettingsList->Append(&item);
         }
@@ -390,11 +595,27 @@ private:
     {
         m_Device = 128;
         m_Preset = 2;
+        m_BFrames = 0;
+        m_LowLatency = 0;
+        m_Intra = 0;
         m_PreEncode = 1;
         m_VBAQ = 0;
         m_RateControl = 0;
         m_QP = 22;
         m_BitRate = 10000;
+        m_MaxRate = 0;
+        m_BufferSize = 0;
+        m_FrameStats = 0;
+        m_MultiPass = 0;
+        m_Lookahead = 0;
+        m_LookaheadBudget = 1000;
+        m_Checkpoint = 0;
+        m_Index = 0;
+        m_Checksum = 0;
+        m_Markers = 0;
+        m_MarkerColor.clear();
+        m_Slices = 1;
+        m_Tiles = 0;
     }
 
 public:
@@ -408,6 +629,23 @@ public:
         return m_Preset;
     }
 
+    int32_t GetLowLatency() const
+    {
+        return m_LowLatency;
+    }
+
+    int32_t GetIntra() const
+    {
+        return m_Intra;
+    }
+
+    // Low latency overrides everything that holds frames back, all-intra
+    // everything that needs inter prediction.
+    int32_t GetBFrames() const
+    {
+        return m_LowLatency || m_Intra ? 0 : std::max<int>(0, m_BFrames);
+    }
+
     int32_t GetPreEncode() const
     {
         return m_PreEncode;
@@ -418,9 +656,24 @@ public:
         return m_VBAQ;
     }
 
+    // Low latency always runs CBR.
     int32_t GetRateControl() const
     {
-        return m_RateControl;
+        if (m_LowLatency)
+            return rcCBR;
+        return std::clamp<int32_t>(m_RateControl, rcCQP, rcICQ);
+    }
+
+    bool UsesBitRate() const
+    {
+        int32_t mode = GetRateControl();
+        return mode == rcVBR || mode == rcCBR || mode == rcQVBR;
+    }
+
+    bool UsesQuality() const
+    {
+        int32_t mode = GetRateControl();
+        return mode == rcCQP || mode == rcQVBR || mode == rcICQ;
     }
 
     int32_t GetQP() const
@@ -433,52 +686,168 @@ public:
         return m_BitRate;
     }
 
+    int32_t GetMaxRate() const
+    {
+        return std::max<int>(0, m_MaxRate);
+    }
+
+    int32_t GetBufferSize() const
+    {
+        return std::max<int>(0, m_BufferSize);
+    }
+
+    int32_t GetFrameStats() const
+    {
+        return m_FrameStats;
+    }
+
+    // 0 off, 1 keyframes, 2 every frame.
+    int32_t GetIndex() const
+    {
+        return m_Index;
+    }
+
+    int32_t GetChecksum() const
+    {
+        return m_Checksum;
+    }
+
+    int32_t GetMarkers() const
+    {
+        return m_Markers;
+    }
+
+    // What the settings ask for, before the device limits apply.
+    VAAPICaps::Layout GetLayout() const
+    {
+        VAAPICaps::Layout layout = { 1, 1, 1 };
+        if (m_Codec != CodecId::AV1)
+            layout.slices = std::max<int>(1, m_Slices);
+        if (m_Codec != CodecId::H264 && m_Tiles > 0) {
+            layout.tileCols = std::max(1, m_Tiles >> 8);
+            layout.tileRows = std::max(1, m_Tiles & 0xFF);
+        }
+        return layout;
+    }
+
+    // Empty for markers of any color.
+    const std::string &GetMarkerColor() const
+    {
+        return m_MarkerColor;
+    }
+
+    int32_t GetMultiPass() const
+    {
+        return m_LowLatency || m_Intra ? 0 : m_MultiPass;
+    }
+
+    int32_t GetLookahead() const
+    {
+        return m_LowLatency || m_Intra ? 0 : std::max<int>(0, m_Lookahead);
+    }
+
+    int32_t GetLookaheadBudget() const
+    {
+        return std::max<int>(0, m_LookaheadBudget);
+    }
+
+    // A second pass can't pick up where a crashed one stopped.
+    int32_t GetCheckpoint() const
+    {
+        return GetMultiPass() ? 0 : m_Checkpoint;
+    }
+
+    // Identifies the settings that change the encoded bits, so a checkpoint
+    // is only resumed with the ones it was written with.
+    uint64_t GetHash() const
+    {
+        const int32_t values[] = {
+            m_Device, m_Preset, GetBFrames(), m_LowLatency, m_Intra, m_PreEncode, m_VBAQ, GetRateControl(),
+            m_QP, m_BitRate, m_MaxRate, m_BufferSize, GetLookahead(), m_Markers, m_Slices, m_Tiles,
+        };
+        uint64_t hash = CheckpointJournal::Hash(values, sizeof(values));
+        return CheckpointJournal::Hash(m_MarkerColor.data(), m_MarkerColor.size(), hash);
+    }
+
 private:
     HostCodecConfigCommon m_CommonProps;
+    CodecId m_Codec = CodecId::H264;
     int32_t m_Device;
     int32_t m_Preset;
+    int32_t m_BFrames;
+    int32_t m_LowLatency;
+    int32_t m_Intra;
     int32_t m_PreEncode;
     int32_t m_VBAQ;
     int32_t m_RateControl;
     int32_t m_QP;
     int32_t m_BitRate;
+    int32_t m_MaxRate;
+    int32_t m_BufferSize;
+    int32_t m_FrameStats;
+    int32_t m_MultiPass;
+    int32_t m_Lookahead;
+    int32_t m_LookaheadBudget;
+    int32_t m_Checkpoint;
+    int32_t m_Index;
+    int32_t m_Checksum;
+    int32_t m_Markers;
+    std::string m_MarkerColor;
+    int32_t m_Slices;
+    int32_t m_Tiles;
 };
 
-VAAPIEncoder::VAAPIEncoder(const char *name, uint32_t depth)
-    : m_name(name)
-    , m_depth(depth)
+VAAPIEncoder::VAAPIEncoder(const CodecTraits &traits)
+    : m_traits(traits)
+    , m_metrics(std::make_shared<EncoderMetrics>())
 {
 }
 
 VAAPIEncoder::~VAAPIEncoder()
 {
-    av_buffer_unref(&m_hwdev);
-    av_buffer_unref(&m_hwframes);
+    m_engineUsage.Stop();
+    if (m_lookahead)
+        m_lookahead->Stop();
+    LogSummary();
+
+    MetricsExporter::Unregister(m_metrics);
+
+    // The codec holds references to the frames and device contexts, so it goes first.
+    m_codec.reset();
+    m_hwframes.reset();
+    m_hwdev.reset();
+
+    m_tracer.Flush();
 }
 
 bool VAAPIEncoder::IsNeedNextPass()
 {
+    if (m_pass >= m_passCount || !m_passFlushed)
+        return false;
+
+    m_passFlushed = false;
+    if (StartSecondPass())
+        return true;
+
+    g_Log(logLevelError, "VAAPI :: Failed to start the second pass");
+    ReportError(errFail, __LINE__);
     return false;
 }
 
 bool VAAPIEncoder::IsAcceptingFrame(int64_t p_PTS)
 {
-    return false;
+    // A resumed render starts at the checkpointed keyframe.
+    if (m_resumePts != AV_NOPTS_VALUE)
+        return p_PTS >= m_resumePts;
+
+    // Both passes need every frame.
+    return m_passCount > 1;
 }
 
 VAAPIEncoder *VAAPIEncoder::Create(uint8_t *uuid)
 {
-    if (!memcmp(uuid, uuid_h264, 16))
-        return new VAAPIEncoder("h264_vaapi", 8);
-    else if (!memcmp(uuid, uuid_hevc_8, 16))
-        return new VAAPIEncoder("hevc_vaapi", 8);
-    else if (!memcmp(uuid, uuid_hevc_10, 16))
-        return new VAAPIEncoder("hevc_vaapi", 10);
-    else if (!memcmp(uuid, uuid_av1_8, 16))
-        return new VAAPIEncoder("av1_vaapi", 8);
-    else if (!memcmp(uuid, uuid_av1_10, 16))
-        return new VAAPIEncoder("av1_vaapi", 10);
-    return nullptr;
+    const CodecTraits *traits = FindCodec(uuid);
+    return traits ? new VAAPIEncoder(*traits) : nullptr;
 }
 
 StatusCode VAAPIEncoder::GetEncoderSettings(uint8_t *uuid, HostPropertyCollectionRef *p_pValues, HostListRef *p_pSettingsList)
@@ -486,7 +855,8 @@ StatusCode VAAPIEncoder::GetEncoderSettings(uint8_t *uuid, HostPropertyCollectio
     HostCodecConfigCommon commonProps;
     commonProps.Load(p_pValues);
 
-    UISettingsController settings(commonProps);
+    const CodecTraits *traits = FindCodec(uuid);
+    UISettingsController settings(commonProps, traits ? traits->id : CodecId::H264);
     settings.Load(p_pValues);
 
     return settings.Render(p_pSettingsList);
@@ -496,7 +866,8 @@ StatusCode VAAPIEncoder::RegisterCodecs(HostListRef *p_pList)
 {
     g_Log(logLevelInfo, "VAAPI :: RegisterCodecs");
 
-    auto addCodec = [&p_pList](const uint8_t *uuid, uint32_t fourcc, const char *group, const char *name, uint32_t depth) {
+    auto addCodec = [&p_pList](const uint8_t *uuid, uint32_t fourcc, const char *group, const char *name, uint32_t depth,
+                               uint32_t bFrames, CodecId codecId) {
         HostPropertyCollectionRef info;
         info.SetProperty(pIOPropUUID, propTypeUInt8, uuid, 16);
         info.SetProperty(pIOPropName, propTypeString, name, strlen(name));
@@ -517,7 +888,6 @@ StatusCode VAAPIEncoder::RegisterCodecs(HostListRef *p_pList)
         uint8_t dataRange[] = {0, 1};
         info.SetProperty(pIOPropDataRange, propTypeUInt8, &dataRange, sizeof(dataRange));;
 
-        uint32_t bFrames = 0;
         info.SetProperty(pIOPropTemporalReordering, propTypeUInt32, &bFrames, 1);
 
         uint8_t fieldOrder = fieldProgressive;
@@ -527,6 +897,10 @@ StatusCode VAAPIEncoder::RegisterCodecs(HostListRef *p_pList)
         std::vector<std::string> containerVec;
         containerVec.push_back("mp4");
         containerVec.push_back("mov");
+        containerVec.push_back(FragmentedMP4Container::GetId());
+        containerVec.push_back(FragmentedMP4Container::GetSegmentedId());
+        for (const std::string &id : ElementaryStreamContainer::GetIds(codecId))
+            containerVec.push_back(id);
         std::string valStrings;
         for (size_t i = 0; i < containerVec.size(); ++i) {
             valStrings.append(containerVec[i]);
@@ -539,11 +913,10 @@ StatusCode VAAPIEncoder::RegisterCodecs(HostListRef *p_pList)
         p_pList->Append(&info);
     };
 
-    addCodec(uuid_h264, FOURCC_AVC, "VAAPI H.264", "YUV 420 8-bit", 8);
-    addCodec(uuid_hevc_8, FOURCC_HEVC, "VAAPI H.265", "YUV 420 8-bit", 8);
-    addCodec(uuid_hevc_10, FOURCC_HEVC, "VAAPI H.265", "YUV 420 10-bit", 10);
-    addCodec(uuid_av1_8, FOURCC_AV1, "VAAPI AV1", "YUV 420 8-bit", 8);
-    addCodec(uuid_av1_10, FOURCC_AV1, "VAAPI AV1", "YUV 420 10-bit", 10);
+    // No device is picked yet. DoOpen() clamps the count to what the
+    // selected one supports and reports that in pIOPropTemporalReordering.
+    for (const CodecTraits &traits : s_Codecs)
+        addCodec(traits.uuid, traits.fourcc, traits.group, traits.name, traits.depth, VAAPICaps::MaxBFrames, traits.id);
 
     return errNone;
 }
@@ -567,132 +940,187 @@ StatusCode VAAPIEncoder::DoInit(HostPropertyCollectionRef *p_pProps)
 StatusCode VAAPIEncoder::DoOpen(HostBufferRef *p_pBuff)
 {
     g_Log(logLevelInfo, "VAAPI :: DoOpen");
+    TraceScope trace(m_tracer, "DoOpen");
 
     m_CommonProps.Load(p_pBuff);
 
-    UISettingsController settings(m_CommonProps);
-    settings.Load(p_pBuff);
+    m_pSettings = std::make_unique<UISettingsController>(m_CommonProps, m_traits.id);
+    m_pSettings->Load(p_pBuff);
     std::string container;
     if (p_pBuff->GetString(pIOPropContainerList, container)) {
         g_Log(logLevelInfo, "✅ Selected container: %s\n", container.c_str());
-        m_containerFormat = container;
+        // Our own fragmented MP4 takes the same samples, minus the host workarounds.
+        bool segmented = container == FragmentedMP4Container::GetSegmentedId();
+        m_isMp4 = container == "mp4" || container == FragmentedMP4Container::GetId() || segmented;
+        m_isHostMp4 = container == "mp4";
+        if (segmented && !m_pSettings->GetIntra()) {
+            m_segmentGop = std::lround(FragmentedMP4Container::SegmentSeconds * m_CommonProps.GetFrameRateNum() /
+                                       static_cast<double>(m_CommonProps.GetFrameRateDen()));
+        }
     } else {
         g_Log(logLevelError, "❌ Failed to retrieve container from pIOPropContainerList\n");
     }
 
-    int16_t primaries = 0;
-    if (!p_pBuff->GetINT16(pIOPropColorPrimaries, primaries))
+    if (!p_pBuff->GetINT16(pIOPropColorPrimaries, m_primaries))
         return errNoParam;
 
-    int16_t trc = 0;
-    if (!p_pBuff->GetINT16(pIOTransferCharacteristics, trc))
+    if (!p_pBuff->GetINT16(pIOTransferCharacteristics, m_trc))
         return errNoParam;
 
-    int16_t matrix = 0;
-    if (!p_pBuff->GetINT16(pIOColorMatrix, matrix))
+    if (!p_pBuff->GetINT16(pIOColorMatrix, m_matrix))
         return errNoParam;
 
-    std::string path = "/dev/dri/renderD" + std::to_string(settings.GetDevice());
-    int err = av_hwdevice_ctx_create(&m_hwdev, AV_HWDEVICE_TYPE_VAAPI, path.c_str(), NULL, 0);
+    std::string path = "/dev/dri/renderD" + std::to_string(m_pSettings->GetDevice());
+    std::vector<int> fdsBefore = EngineUsageSampler::ListDeviceFds(path);
+    AVBufferRef *hwdev = nullptr;
+    int err = av_hwdevice_ctx_create(&hwdev, AV_HWDEVICE_TYPE_VAAPI, path.c_str(), NULL, 0);
+    m_hwdev.reset(hwdev);
     if (err != 0) {
         g_Log(logLevelError, "VAAPI :: Failed to open device %d", err);
+        ReportError(err, __LINE__);
         return errFail;
     }
 
-    const AVCodec *codec = avcodec_find_encoder_by_name(m_name);
-    if (!codec) {
-        g_Log(logLevelError, "VAAPI :: Failed to find encoder '%s'", m_name);
-        return errFail;
+    // The fd opened by libva is the one whose fdinfo accounts our encode work.
+    int deviceFd = -1;
+    for (int fd : EngineUsageSampler::ListDeviceFds(path)) {
+        if (std::find(fdsBefore.begin(), fdsBefore.end(), fd) == fdsBefore.end())
+            deviceFd = fd;
+    }
+    m_engineUsage.Start(EngineUsageSampler::CreateSource(path, deviceFd));
+    m_openTime = NowNs();
+    getrusage(RUSAGE_SELF, &m_openUsage);
+
+    VAAPICaps caps = VAAPICaps::Query(m_hwdev.get(), m_traits);
+    m_lowPower = caps.lowPower;
+    m_bFrames = std::min<uint32_t>(m_pSettings->GetBFrames(), caps.GetMaxBFrames());
+    if (m_bFrames < static_cast<uint32_t>(m_pSettings->GetBFrames()))
+        g_Log(logLevelWarn, "VAAPI :: %s on this device doesn't support B-frames, encoding without", m_traits.group);
+
+    m_rateControl = ResolveRateControl(m_pSettings->GetRateControl(), caps.rateControls);
+    if (m_rateControl != m_pSettings->GetRateControl()) {
+        g_Log(logLevelWarn, "VAAPI :: %s rate control isn't supported by the driver, using %s",
+              s_RateControls[m_pSettings->GetRateControl()].name, s_RateControls[m_rateControl].name);
     }
 
-    m_codec = avcodec_alloc_context3(codec);
-    if (!m_codec)
-        return errFail;
+    VAAPICaps::Layout requested = m_pSettings->GetLayout();
+    m_layout = caps.ResolveLayout(m_traits.id, m_CommonProps.GetWidth(), m_CommonProps.GetHeight(), requested);
+    bool tiled = m_layout.tileCols * m_layout.tileRows > 1;
+    if (m_layout.tileCols != requested.tileCols || m_layout.tileRows != requested.tileRows ||
+        (!tiled && m_layout.slices != requested.slices)) {
+        g_Log(logLevelWarn, "VAAPI :: Asked for %u slices and %ux%u tiles, the device takes at most %u slices and %u tiles",
+              requested.slices, requested.tileCols, requested.tileRows, caps.maxSlices, caps.maxTiles);
+    }
+    g_Log(logLevelInfo, "VAAPI :: Encoding %u slices and %ux%u tiles on a grid of %ux%u %u-pixel blocks", m_layout.slices,
+          m_layout.tileCols, m_layout.tileRows, (m_CommonProps.GetWidth() + caps.blockSize - 1) / caps.blockSize,
+          (m_CommonProps.GetHeight() + caps.blockSize - 1) / caps.blockSize, caps.blockSize);
+
+    if (m_pSettings->GetCheckpoint() && !m_CommonProps.GetPath().empty()) {
+        // Checkpoints need an output whose bytes the plugin writes itself.
+        std::vector<std::string> streamIds = ElementaryStreamContainer::GetIds(m_traits.id);
+        if (container == FragmentedMP4Container::GetId() ||
+            std::find(streamIds.begin(), streamIds.end(), container) != streamIds.end()) {
+            const uint32_t format[] = {
+                m_CommonProps.GetWidth(), m_CommonProps.GetHeight(),
+                m_CommonProps.GetFrameRateNum(), m_CommonProps.GetFrameRateDen(),
+            };
+            uint64_t hash = m_pSettings->GetHash();
+            hash = CheckpointJournal::Hash(m_traits.uuid, sizeof(m_traits.uuid), hash);
+            hash = CheckpointJournal::Hash(format, sizeof(format), hash);
+            hash = CheckpointJournal::Hash(container.data(), container.size(), hash);
+
+            m_journal = CheckpointJournal::Open(m_CommonProps.GetPath(), hash);
+            const CheckpointJournal::Checkpoint *resume = m_journal ? m_journal->GetResume() : nullptr;
+            if (resume) {
+                m_resumePts = resume->pts;
+                // Rate control and lookahead state start fresh at the checkpoint.
+                if (m_rateControl != rcCQP || m_pSettings->GetLookahead())
+                    g_Log(logLevelInfo, "VAAPI :: The resumed part is encoded afresh, not bit-exact with an uninterrupted render");
+            }
+        } else {
+            g_Log(logLevelWarn, "VAAPI :: Resumable renders need one of the VAAPI containers");
+        }
+    }
 
-    m_codec->width = m_CommonProps.GetWidth();
-    m_codec->height = m_CommonProps.GetHeight();
-    m_codec->time_base = av_make_q(m_CommonProps.GetFrameRateDen(), m_CommonProps.GetFrameRateNum());
-    m_codec->framerate = av_make_q(m_CommonProps.GetFrameRateNum(), m_CommonProps.GetFrameRateDen());
-    m_codec->sample_aspect_ratio = av_make_q(1, 1);
-    m_codec->pix_fmt = AV_PIX_FMT_VAAPI;
-    m_codec->flags = AV_CODEC_FLAG_GLOBAL_HEADER;
-    m_codec->max_b_frames = 0;
-    m_codec->gop_size = 300;
-    m_codec->color_range = m_CommonProps.IsFullRange() ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
-    m_codec->color_primaries = static_cast<enum AVColorPrimaries>(primaries);
-    m_codec->color_trc = static_cast<enum AVColorTransferCharacteristic>(trc);
-    m_codec->colorspace = static_cast<enum AVColorSpace>(matrix);
-    m_codec->compression_level = settings.GetPreset() << 1 | settings.GetPreEncode() << 3 | settings.GetVBAQ() << 4;
-
-    if (settings.GetRateControl() == 0) {
-        av_opt_set(m_codec->priv_data, "rc_mode", "CQP", 0);
-        m_codec->global_quality = settings.GetQP();
-    } else {
-        av_opt_set(m_codec->priv_data, "rc_mode", "VBR", 0);
-        m_codec->bit_rate = settings.GetBitRate() * 1000;
-        m_codec->rc_max_rate = m_codec->bit_rate * 1.5;
-        m_codec->rc_buffer_size = m_codec->rc_max_rate;
+    if (m_pSettings->GetIndex() && !m_CommonProps.GetPath().empty()) {
+        // The index holds byte offsets, which only the elementary stream
+        // containers know.
+        std::vector<std::string> streamIds = ElementaryStreamContainer::GetIds(m_traits.id);
+        if (std::find(streamIds.begin(), streamIds.end(), container) != streamIds.end())
+            m_index = KeyframeIndexWriter::Create(m_CommonProps.GetPath(), m_pSettings->GetIndex() > 1);
+        else
+            g_Log(logLevelWarn, "VAAPI :: The keyframe index is only written for elementary streams");
     }
 
-    m_hwframes = av_hwframe_ctx_alloc(m_hwdev);
+    m_metrics->device = path;
+    m_metrics->codec = m_traits.ffName;
+    MetricsExporter::Register(m_metrics);
+
+    m_hwframes.reset(av_hwframe_ctx_alloc(m_hwdev.get()));
     if (!m_hwframes) {
         g_Log(logLevelError, "VAAPI :: Failed to create frames context");
         return errFail;
     }
 
-    m_format = m_depth == 8 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_P010;
+    m_format = m_traits.depth == 8 ? AV_PIX_FMT_NV12 : AV_PIX_FMT_P010;
 
     AVHWFramesContext *framesCtx = reinterpret_cast<AVHWFramesContext*>(m_hwframes->data);
     framesCtx->format = AV_PIX_FMT_VAAPI;
     framesCtx->sw_format = m_format;
-    framesCtx->width = m_codec->width;
-    framesCtx->height = m_codec->height;
+    framesCtx->width = m_CommonProps.GetWidth();
+    framesCtx->height = m_CommonProps.GetHeight();
 
-    err = av_hwframe_ctx_init(m_hwframes);
+    err = av_hwframe_ctx_init(m_hwframes.get());
     if (err != 0) {
         g_Log(logLevelError, "VAAPI :: Failed to init frames %d", err);
+        ReportError(err, __LINE__);
         return errFail;
     }
 
-    m_codec->hw_frames_ctx = m_hwframes;
-
-    err = avcodec_open2(m_codec, codec, NULL);
-    if (err != 0) {
-        g_Log(logLevelError, "VAAPI :: Failed to open encoder %d", err);
-        return errFail;
+    // Two-pass analyses the timeline in CQP and then re-encodes it with per-frame QPs.
+    if (m_rateControl == rcVBR && m_pSettings->GetMultiPass()) {
+        // Without ROI the plan would be dropped and the second pass would
+        // come out at the analysis QP, ignoring the bit rate.
+        if (!caps.SupportsQPOffsets(true))
+            g_Log(logLevelError, "VAAPI :: Two-pass encoding needs ROI support from the driver, encoding in a single pass");
+        else if (m_passStats.Open(std::filesystem::path(m_CommonProps.GetPath()).parent_path()))
+            m_passCount = 2;
     }
+    m_pass = 1;
+    m_passFlushed = false;
+    m_passQP = m_traits.maxQP / 2;
+
+    StatusCode status = OpenCodec(m_passCount > 1 ? m_passQP : -1);
+    if (status != errNone)
+        return status;
+
+    if (m_pSettings->GetLookahead()) {
+        m_lookahead = std::make_unique<Lookahead>();
+        if (!m_lookahead->Start(m_CommonProps.GetWidth(), m_CommonProps.GetHeight(), m_traits.depth,
+                                m_pSettings->GetLookahead(), m_pSettings->GetLookaheadBudget()))
+            m_lookahead.reset();
+    }
+    // Scene cuts work everywhere, the QP offsets need ROI. A two-pass
+    // encode gets its offsets from the plan instead.
+    m_lookaheadQP = m_lookahead && m_passCount == 1 && caps.SupportsQPOffsets(m_rateControl == rcCQP);
+    if (m_lookahead && m_passCount == 1 && !m_lookaheadQP)
+        g_Log(logLevelWarn, "VAAPI :: No ROI support for this rate control, lookahead only places scene cut keyframes");
 
     if (m_codec->extradata_size) {
-        if (m_containerFormat == "mp4") {
-            if (!strcmp(m_name, "h264_vaapi")) {
-                std::vector<uint8_t> avcc;
-                if (ConvertAnnexBToAVCC(m_codec->extradata, m_codec->extradata_size, avcc)) {
-                    p_pBuff->SetProperty(pIOPropMagicCookie, propTypeUInt8, avcc.data(), static_cast<int>(avcc.size()));
-                    m_configExtradata = std::move(avcc);
-                    m_sentFirstPacket = false;
-                } else {
-                    g_Log(logLevelError, "VAAPI :: Failed to convert H.264 extradata to AVCC");
-                }
-            } else if (!strcmp(m_name, "hevc_vaapi")) {
-                std::vector<uint8_t> hvcc;
-                uint8_t bitDepthLumaMinus8 = m_depth - 8;
-                uint8_t bitDepthChromaMinus8 = m_depth - 8;
-                uint32_t avgFrameRateNum = m_CommonProps.GetFrameRateNum();
-                uint32_t avgFrameRateDen = m_CommonProps.GetFrameRateDen();
-
-                if (ConvertAnnexBToHVCC(m_codec->extradata, m_codec->extradata_size, hvcc,
-                    bitDepthLumaMinus8, bitDepthChromaMinus8,
-                    avgFrameRateNum, avgFrameRateDen))
-                {
-                    p_pBuff->SetProperty(pIOPropMagicCookie, propTypeUInt8, hvcc.data(), static_cast<int>(hvcc.size()));
-                    m_configExtradata = std::move(hvcc);
+        if (m_isMp4) {
+            ConfigRecordParams params = {
+                m_codec->extradata, static_cast<size_t>(m_codec->extradata_size), m_traits.depth,
+                m_CommonProps.GetFrameRateNum(), m_CommonProps.GetFrameRateDen(),
+            };
+            std::vector<uint8_t> record;
+            if (m_traits.buildConfigRecord(params, record)) {
+                p_pBuff->SetProperty(pIOPropMagicCookie, propTypeUInt8, record.data(), static_cast<int>(record.size()));
+                if (m_traits.prependConfigRecord && m_isHostMp4) {
+                    m_configExtradata = std::move(record);
                     m_sentFirstPacket = false;
-                } else {
-                    g_Log(logLevelError, "VAAPI :: Failed to convert HEVC extradata to hvcC");
                 }
             } else {
-                // AV1 MP4
-                p_pBuff->SetProperty(pIOPropMagicCookie, propTypeUInt8, m_codec->extradata, m_codec->extradata_size);
+                g_Log(logLevelError, "VAAPI :: Failed to build %s MP4 config record", m_traits.group);
             }
         } else {
             // MOV
@@ -700,15 +1128,258 @@ StatusCode VAAPIEncoder::DoOpen(HostBufferRef *p_pBuff)
         }
     }
 
-    uint8_t multiPass = 0;
+    if (m_pSettings->GetFrameStats() && !m_CommonProps.GetPath().empty()) {
+        m_frameStats = std::make_unique<FrameStatsWriter>();
+        if (!m_frameStats->Open(m_CommonProps.GetPath() + ".stats.csv"))
+            m_frameStats.reset();
+    }
+
+    if (m_pSettings->GetMarkers()) {
+        m_markers.Load(p_pBuff, m_pSettings->GetMarkerColor(), m_CommonProps.GetFrameRateNum(),
+                       m_CommonProps.GetFrameRateDen());
+        // Intra frames are all IDRs already, and CMAF segments need their
+        // fixed GOP.
+        m_markerKeyframes = !m_markers.IsEmpty() && !m_pSettings->GetIntra() && !m_segmentGop;
+        if (!m_markers.IsEmpty() && m_segmentGop)
+            g_Log(logLevelInfo, "VAAPI :: Segmented output, markers only become chapters");
+    }
+
+    if (m_pSettings->GetChecksum() && !m_CommonProps.GetPath().empty()) {
+        m_checksums = std::make_unique<StreamChecksumWriter>();
+        if (!m_checksums->Open(m_CommonProps.GetPath() + ".sha256", m_journal != nullptr, m_resumePts))
+            m_checksums.reset();
+    }
+
+    uint8_t multiPass = m_passCount > 1;
     p_pBuff->SetProperty(pIOPropMultiPass, propTypeUInt8, &multiPass, 1);
 
-    uint32_t bFrames = 0;
-    p_pBuff->SetProperty(pIOPropTemporalReordering, propTypeUInt32, &bFrames, 1);
+    // An absent pIOPropTemporalReordering tells the host every frame is intra.
+    if (m_pSettings->GetIntra()) {
+        p_pBuff->SetProperty(pIOPropTemporalReordering, propTypeNull, NULL, 0);
+    } else {
+        uint32_t bFrames = m_bFrames;
+        p_pBuff->SetProperty(pIOPropTemporalReordering, propTypeUInt32, &bFrames, 1);
+    }
+
+    return errNone;
+}
+
+StatusCode VAAPIEncoder::OpenCodec(int fixedQP)
+{
+    const AVCodec *codec = avcodec_find_encoder_by_name(m_traits.ffName);
+    if (!codec) {
+        g_Log(logLevelError, "VAAPI :: Failed to find encoder '%s'", m_traits.ffName);
+        return errFail;
+    }
+
+    m_codec.reset(avcodec_alloc_context3(codec));
+    if (!m_codec)
+        return errFail;
+
+    m_codec->width = m_CommonProps.GetWidth();
+    m_codec->height = m_CommonProps.GetHeight();
+    m_codec->time_base = av_make_q(m_CommonProps.GetFrameRateDen(), m_CommonProps.GetFrameRateNum());
+    m_codec->framerate = av_make_q(m_CommonProps.GetFrameRateNum(), m_CommonProps.GetFrameRateDen());
+    m_codec->sample_aspect_ratio = av_make_q(1, 1);
+    m_codec->pix_fmt = AV_PIX_FMT_VAAPI;
+    m_codec->flags = AV_CODEC_FLAG_GLOBAL_HEADER;
+    m_codec->max_b_frames = m_bFrames;
+    m_codec->gop_size = m_pSettings->GetIntra() ? 1 : 300;
+    // Checkpoints sit at GOP boundaries, so nothing may reference across them.
+    if (m_journal)
+        m_codec->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    if (m_segmentGop) {
+        // Every segment starts with a keyframe that needs nothing before it.
+        m_codec->gop_size = m_segmentGop;
+        m_codec->flags |= AV_CODEC_FLAG_CLOSED_GOP;
+    }
+    m_codec->color_range = m_CommonProps.IsFullRange() ? AVCOL_RANGE_JPEG : AVCOL_RANGE_MPEG;
+    m_codec->color_primaries = static_cast<enum AVColorPrimaries>(m_primaries);
+    m_codec->color_trc = static_cast<enum AVColorTransferCharacteristic>(m_trc);
+    m_codec->colorspace = static_cast<enum AVColorSpace>(m_matrix);
+    m_codec->compression_level = m_pSettings->GetPreset() << 1 | m_pSettings->GetPreEncode() << 3 | m_pSettings->GetVBAQ() << 4;
+
+    int32_t rateControl = fixedQP >= 0 ? rcCQP : m_rateControl;
+    av_opt_set(m_codec->priv_data, "rc_mode", s_RateControls[rateControl].name, 0);
+
+    // The bit rate modes signal HRD parameters from bit_rate, rc_max_rate and rc_buffer_size.
+    int64_t bufferSize = m_pSettings->GetBufferSize() * INT64_C(1000);
+    switch (rateControl) {
+        case rcCQP:
+            m_codec->global_quality = fixedQP >= 0 ? fixedQP : m_pSettings->GetQP();
+            break;
+        case rcICQ:
+            m_codec->global_quality = m_pSettings->GetQP();
+            break;
+        case rcCBR:
+            m_codec->bit_rate = m_pSettings->GetBitRate() * 1000;
+            m_codec->rc_max_rate = m_codec->bit_rate;
+            if (!bufferSize) {
+                // Two frames for low latency keeps every frame close to the average size.
+                bufferSize = m_pSettings->GetLowLatency() ? m_codec->bit_rate * 2 / av_q2d(m_codec->framerate)
+                                                          : m_codec->bit_rate;
+            }
+            m_codec->rc_buffer_size = bufferSize;
+            break;
+        case rcVBR:
+        case rcQVBR:
+            m_codec->bit_rate = m_pSettings->GetBitRate() * 1000;
+            m_codec->rc_max_rate = m_pSettings->GetMaxRate() ? std::max<int64_t>(m_pSettings->GetMaxRate() * 1000, m_codec->bit_rate)
+                                                             : m_codec->bit_rate * 1.5;
+            m_codec->rc_buffer_size = bufferSize ? bufferSize : m_codec->rc_max_rate;
+            if (rateControl == rcQVBR)
+                m_codec->global_quality = m_pSettings->GetQP();
+            break;
+    }
+
+    // libavcodec spreads both evenly over the block grid.
+    if (m_layout.tileCols * m_layout.tileRows > 1) {
+        std::string tiles = std::to_string(m_layout.tileCols) + "x" + std::to_string(m_layout.tileRows);
+        av_opt_set(m_codec->priv_data, "tiles", tiles.c_str(), 0);
+    } else if (m_layout.slices > 1) {
+        m_codec->slices = m_layout.slices;
+    }
+
+    // libavcodec only opens the low power entrypoint when asked to.
+    if (m_lowPower)
+        av_opt_set_int(m_codec->priv_data, "low_power", 1, 0);
+
+    // A single request in flight means each frame is waited for right after it is submitted.
+    if (m_pSettings->GetLowLatency())
+        av_opt_set_int(m_codec->priv_data, "async_depth", 1, 0);
+
+    m_codec->hw_frames_ctx = av_buffer_ref(m_hwframes.get());
+    if (!m_codec->hw_frames_ctx)
+        return errAlloc;
+
+    if ((codec->capabilities & AV_CODEC_CAP_DR1) && HostResizeKeepsData()) {
+        m_codec->opaque = this;
+        m_codec->get_encode_buffer = GetEncodeBuffer;
+    }
+
+    int err = avcodec_open2(m_codec.get(), codec, NULL);
+    if (err != 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to open encoder %d", err);
+        ReportError(err, __LINE__);
+        m_codec.reset();
+        return errFail;
+    }
+
+    m_packetOrder.Reset();
+    m_codecQP = rateControl == rcCQP ? m_codec->global_quality : -1;
+    m_metrics->inFlight.store(0, std::memory_order_relaxed);
 
     return errNone;
 }
 
+bool VAAPIEncoder::StartSecondPass()
+{
+    TraceScope trace(m_tracer, "StartSecondPass");
+
+    PassStatsFile::PlanParams params = {};
+    params.targetBytes = m_pSettings->GetBitRate() * 1000.0 / 8 * m_passStats.GetCount() / av_q2d(m_codec->framerate);
+    params.analysisQP = m_passQP;
+    params.minQP = 1;
+    params.maxQP = m_traits.maxQP;
+    params.qpPerDoubling = m_traits.qpPerDoubling;
+    m_passStats.Plan(params);
+
+    // Both passes run CQP at m_passQP, so the parameter sets the host already
+    // has stay valid and the plan is applied as per-frame QP offsets.
+    std::vector<uint8_t> extradata(m_codec->extradata, m_codec->extradata + m_codec->extradata_size);
+    m_codec.reset();
+    if (OpenCodec(m_passQP) != errNone)
+        return false;
+
+    if (extradata != std::vector<uint8_t>(m_codec->extradata, m_codec->extradata + m_codec->extradata_size))
+        g_Log(logLevelWarn, "VAAPI :: Second pass stream headers differ from the first pass");
+
+    if (m_lookahead)
+        m_lookahead->Reset();
+
+    m_pass = 2;
+    return true;
+}
+
+bool VAAPIEncoder::AttachQPOffset(AVFrame *frame, int offset)
+{
+    // One region covering the whole frame moves its QP. The offset is a
+    // fraction of the QP range libavcodec scales ROI offsets by, which
+    // grows with bit depth for H.264 and HEVC.
+    int range = m_traits.id == CodecId::AV1 ? 255 : 51 + 6 * (static_cast<int>(m_traits.depth) - 8);
+    AVFrameSideData *sideData = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, sizeof(AVRegionOfInterest));
+    if (!sideData)
+        return false;
+
+    AVRegionOfInterest *roi = reinterpret_cast<AVRegionOfInterest *>(sideData->data);
+    roi->self_size = sizeof(AVRegionOfInterest);
+    roi->top = 0;
+    roi->bottom = frame->height;
+    roi->left = 0;
+    roi->right = frame->width;
+    roi->qoffset = av_make_q(std::clamp(offset, -range, range), range);
+    return true;
+}
+
+StatusCode VAAPIEncoder::SubmitFrame(AVFrame *frame, int qpOffset)
+{
+    // The second pass plan already spends bits where they matter, so
+    // lookahead offsets only apply to single pass encodes.
+    if (m_pass > 1) {
+        const PassStatsFile::Frame *stats = m_passStats.Find(frame->pts);
+        qpOffset = stats ? stats->qp - m_passQP : 0;
+    } else if (!m_lookaheadQP) {
+        qpOffset = 0;
+    }
+    if (qpOffset && !AttachQPOffset(frame, qpOffset))
+        return errAlloc;
+
+    // Only constant QP encodes know the QP a frame gets.
+    if (m_frameStats && m_codecQP >= 0)
+        m_frameQPs.Set(frame->pts, static_cast<int16_t>(std::clamp(m_codecQP + qpOffset, 0, m_traits.maxQP)));
+
+    TraceScope trace(m_tracer, "SendFrame", frame->pts);
+    uint64_t submitStart = NowNs();
+    m_submitTimes.Set(frame->pts, submitStart);
+
+    int err = avcodec_send_frame(m_codec.get(), frame);
+    if (err != 0) {
+        g_Log(logLevelError, "VAAPI :: Failed to encode frame %d", err);
+        ReportError(err, __LINE__);
+        return errFail;
+    }
+
+    m_metrics->submitNs.fetch_add(NowNs() - submitStart, std::memory_order_relaxed);
+    m_metrics->inFlight.fetch_add(1, std::memory_order_relaxed);
+    VAAPI_PROBE1(frame_submitted, frame->pts);
+
+    trace.Next("ReceiveData");
+    return ReceiveData();
+}
+
+StatusCode VAAPIEncoder::SubmitLookaheadFrames(bool drain)
+{
+    StatusCode status = errMoreData;
+    Lookahead::Decision decision;
+    while (m_lookahead->Pop(decision, drain)) {
+        AVFramePtr frame = std::move(m_lookaheadFrames.front());
+        m_lookaheadFrames.pop_front();
+
+        // libavcodec starts a new GOP with an IDR on frames marked as I,
+        // which would move the segment boundaries.
+        if (decision.sceneCut && !m_segmentGop)
+            frame->pict_type = AV_PICTURE_TYPE_I;
+
+        int qpOffset = static_cast<int>(std::lround(decision.qpOffset * m_traits.qpPerDoubling / 6.0));
+        StatusCode frameStatus = SubmitFrame(frame.get(), qpOffset);
+        if (frameStatus != errNone && frameStatus != errMoreData)
+            return frameStatus;
+        if (frameStatus == errNone)
+            status = errNone;
+    }
+    return status;
+}
+
 StatusCode VAAPIEncoder::DoProcess(HostBufferRef *p_pBuff)
 {
     if (!m_codec)
@@ -716,8 +1387,22 @@ StatusCode VAAPIEncoder::DoProcess(HostBufferRef *p_pBuff)
 
     if (!p_pBuff || !p_pBuff->IsValid()) {
         g_Log(logLevelInfo, "VAAPI :: Flush");
-        avcodec_send_frame(m_codec, nullptr);
-        return ReceiveData();
+        TraceScope trace(m_tracer, "Flush");
+        VAAPI_PROBE0(flush);
+        if (m_lookahead) {
+            StatusCode status = SubmitLookaheadFrames(true);
+            if (status != errNone && status != errMoreData)
+                return status;
+        }
+        avcodec_send_frame(m_codec.get(), nullptr);
+        StatusCode status = ReceiveData();
+        m_passFlushed = m_pass < m_passCount;
+        // The digests are complete as soon as the last packet went out.
+        if (m_checksums && !m_passFlushed)
+            m_checksums->Close();
+        if (m_pSettings->GetMarkers() && !m_markers.IsEmpty() && !m_passFlushed && !m_CommonProps.GetPath().empty())
+            m_markers.WriteChapters(m_CommonProps.GetPath() + ".chapters.txt", m_endPts);
+        return status;
     }
 
     uint32_t width;
@@ -732,14 +1417,23 @@ StatusCode VAAPIEncoder::DoProcess(HostBufferRef *p_pBuff)
     if (!p_pBuff->GetINT64(pIOPropPTS, pts))
         return errNoParam;
 
+    // Already in the output up to the checkpoint, should the host send them anyway.
+    if (m_resumePts != AV_NOPTS_VALUE && pts < m_resumePts)
+        return errNone;
+
+    m_inputTimes.Set(pts, NowNs());
+    TraceScope trace(m_tracer, "DoProcess", pts);
+    TraceScope traceStage(m_tracer, "LockBuffer", pts);
+
     char *buf = nullptr;
     size_t bufSize = 0;
     if (!p_pBuff->LockBuffer(&buf, &bufSize)) {
         g_Log(logLevelError, "VAAPI :: Failed to lock the buffer");
+        ReportError(errFail, __LINE__);
         return errFail;
     }
 
-    AVFrame *swFrame = av_frame_alloc();
+    AVFramePtr swFrame(av_frame_alloc());
     if (!swFrame) {
         p_pBuff->UnlockBuffer();
         return errFail;
@@ -749,45 +1443,217 @@ StatusCode VAAPIEncoder::DoProcess(HostBufferRef *p_pBuff)
     swFrame->height = height;
     swFrame->format = m_format;
 
-    uint32_t bpp = m_depth == 8 ? 1 : 2;
+    uint32_t bpp = m_traits.depth == 8 ? 1 : 2;
 
     swFrame->data[0] = reinterpret_cast<uint8_t*>(buf);
     swFrame->data[1] = reinterpret_cast<uint8_t*>(buf) + (width * height * bpp);
     swFrame->linesize[0] = width * bpp;
     swFrame->linesize[1] = width * bpp;
 
-    AVFrame *hwFrame = av_frame_alloc();
+    VAAPI_PROBE2(frame_received, pts, bufSize);
+    m_metrics->framesIn.fetch_add(1, std::memory_order_relaxed);
+
+    AVFramePtr hwFrame(av_frame_alloc());
     if (!hwFrame) {
         p_pBuff->UnlockBuffer();
         return errFail;
     }
 
-    int err = av_hwframe_get_buffer(m_hwframes, hwFrame, 0);
+    traceStage.Next("Upload");
+    uint64_t uploadStart = NowNs();
+
+    int err = av_hwframe_get_buffer(m_hwframes.get(), hwFrame.get(), 0);
     if (err != 0) {
         p_pBuff->UnlockBuffer();
         g_Log(logLevelError, "VAAPI :: Failed to get hw buffer %d", err);
+        ReportError(err, __LINE__);
         return errFail;
     }
 
-    err = av_hwframe_transfer_data(hwFrame, swFrame, 0);
-    p_pBuff->UnlockBuffer();
+    err = av_hwframe_transfer_data(hwFrame.get(), swFrame.get(), 0);
     if (err != 0) {
+        p_pBuff->UnlockBuffer();
         g_Log(logLevelError, "VAAPI :: Failed to upload buffer %d", err);
+        ReportError(err, __LINE__);
         return errFail;
     }
 
     hwFrame->pts = pts;
+    m_endPts = std::max(m_endPts, pts + 1);
+    // libavcodec starts a new GOP with an IDR on frames marked as I.
+    if (m_markerKeyframes && m_markers.IsMarkerFrame(pts))
+        hwFrame->pict_type = AV_PICTURE_TYPE_I;
+    uint64_t uploadTime = NowNs() - uploadStart;
+    m_metrics->uploadNs.fetch_add(uploadTime, std::memory_order_relaxed);
+    VAAPI_PROBE2(upload_done, pts, uploadTime);
+
+    if (!m_lookahead) {
+        p_pBuff->UnlockBuffer();
+        traceStage.Next("Submit");
+        StatusCode status = SubmitFrame(hwFrame.get(), 0);
+        if (status == errMoreData && m_pSettings->GetLowLatency() && !m_lateFrames++)
+            g_Log(logLevelWarn, "VAAPI :: Low latency: the driver held back frame %lld", static_cast<long long>(pts));
+        return status;
+    }
 
-    err = avcodec_send_frame(m_codec, hwFrame);
-    if (err != 0) {
-        g_Log(logLevelError, "VAAPI :: Failed to encode frame %d", err);
-        return errFail;
+    // Frames wait on the GPU until the window after them has been analyzed.
+    // Only uploaded frames are analyzed, so the two queues stay in step.
+    traceStage.Next("Lookahead");
+    m_lookahead->Push(reinterpret_cast<uint8_t *>(buf), width * bpp);
+    p_pBuff->UnlockBuffer();
+    m_lookaheadFrames.push_back(std::move(hwFrame));
+    traceStage.Next("Submit");
+    return SubmitLookaheadFrames(false);
+}
+
+int VAAPIEncoder::GetEncodeBuffer(AVCodecContext *ctx, AVPacket *pkt, int flags)
+{
+    VAAPIEncoder *encoder = static_cast<VAAPIEncoder *>(ctx->opaque);
+
+    std::unique_ptr<OutputBuffer> output(new OutputBuffer{ encoder });
+    size_t size = pkt->size + AV_INPUT_BUFFER_PADDING_SIZE;
+    char *buf = nullptr;
+    size_t bufSize = 0;
+    if (!output->buffer.IsValid() || !output->buffer.Resize(size) || !output->buffer.LockBuffer(&buf, &bufSize))
+        return avcodec_default_get_encode_buffer(ctx, pkt, flags);
+
+    pkt->buf = av_buffer_create(reinterpret_cast<uint8_t *>(buf), size, FreeOutputBuffer, output.get(), 0);
+    if (!pkt->buf) {
+        output->buffer.UnlockBuffer();
+        return AVERROR(ENOMEM);
     }
 
-    av_frame_free(&hwFrame);
-    av_frame_free(&swFrame);
+    memset(buf + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    pkt->data = pkt->buf->data;
+    output->locked = true;
+    encoder->m_outputBuffers.push_back(output.release());
+    return 0;
+}
 
-    return ReceiveData();
+void VAAPIEncoder::FreeOutputBuffer(void *opaque, uint8_t *data)
+{
+    OutputBuffer *output = static_cast<OutputBuffer *>(opaque);
+    std::vector<OutputBuffer *> &buffers = output->encoder->m_outputBuffers;
+    buffers.erase(std::find(buffers.begin(), buffers.end(), output));
+    if (output->locked)
+        output->buffer.UnlockBuffer();
+    delete output;
+}
+
+VAAPIEncoder::OutputBuffer *VAAPIEncoder::FindOutputBuffer(const AVPacket *pkt)
+{
+    if (!pkt->buf)
+        return nullptr;
+
+    // Packets libavcodec allocated itself have an opaque of their own.
+    void *opaque = av_buffer_get_opaque(pkt->buf);
+    for (OutputBuffer *output : m_outputBuffers) {
+        if (output == opaque)
+            return output;
+    }
+    return nullptr;
+}
+
+bool VAAPIEncoder::HostResizeKeepsData()
+{
+    // Packets encoded into a host buffer are shrunk to their payload after
+    // libavcodec wrote them. The host API doesn't say whether msgBufferResize
+    // keeps the contents, so the sequence ReceiveData() relies on is tried
+    // once on a scratch buffer.
+    static const bool keepsData = [] {
+        static constexpr size_t WrittenSize = 64 << 10;
+        static constexpr size_t KeptSize = WrittenSize - AV_INPUT_BUFFER_PADDING_SIZE - 100;
+
+        HostBufferRef buffer(true);
+        char *buf = nullptr;
+        size_t bufSize = 0;
+        bool kept = buffer.IsValid() && buffer.Resize(WrittenSize) && buffer.LockBuffer(&buf, &bufSize) &&
+            bufSize >= WrittenSize;
+        if (kept) {
+            for (size_t i = 0; i < WrittenSize; i++)
+                buf[i] = static_cast<char>(i * 31 + (i >> 8));
+            buffer.UnlockBuffer();
+
+            kept = buffer.Resize(KeptSize) && buffer.LockBuffer(&buf, &bufSize);
+            if (kept) {
+                kept = bufSize == KeptSize;
+                for (size_t i = 0; kept && i < KeptSize; i++)
+                    kept = buf[i] == static_cast<char>(i * 31 + (i >> 8));
+                buffer.UnlockBuffer();
+            }
+        }
+
+        if (!kept)
+            g_Log(logLevelInfo, "VAAPI :: Host buffers don't keep their data when shrunk, copying packets");
+        return kept;
+    }();
+
+    return keepsData;
+}
+
+void VAAPIEncoder::PushFrameStats(const AVPacket *pkt, int64_t dts)
+{
+    FrameStatsRow row = {};
+    row.pts = pkt->pts;
+    row.dts = dts;
+    row.size = pkt->size;
+    row.isKeyFrame = pkt->flags & AV_PKT_FLAG_KEY;
+
+    // The VAAPI encoders don't report picture types, but a frame that comes
+    // out after a later one can only be a B-frame.
+    if (row.isKeyFrame)
+        row.pictType = 'I';
+    else
+        row.pictType = m_statsMaxPts != AV_NOPTS_VALUE && pkt->pts < m_statsMaxPts ? 'B' : 'P';
+    m_statsMaxPts = m_statsMaxPts == AV_NOPTS_VALUE ? pkt->pts : std::max(m_statsMaxPts, pkt->pts);
+
+    int16_t qp = 0;
+    row.qp = m_frameQPs.Get(pkt->pts, qp) ? qp : -1.0f;
+
+    uint64_t submitTime = 0;
+    if (m_submitTimes.Get(pkt->pts, submitTime))
+        row.latencyUs = (NowNs() - submitTime) / 1000;
+
+    m_frameStats->Push(row);
+}
+
+void VAAPIEncoder::LogSummary()
+{
+    uint64_t frames = m_metrics->framesIn.load(std::memory_order_relaxed);
+    if (!m_openTime || !frames)
+        return;
+
+    double seconds = (NowNs() - m_openTime) / 1e9;
+    g_Log(logLevelInfo, "VAAPI :: Encoded %llu frames (%llu bytes) in %.2f s, %.2f fps",
+          static_cast<unsigned long long>(frames),
+          static_cast<unsigned long long>(m_metrics->bytesOut.load(std::memory_order_relaxed)),
+          seconds, frames / seconds);
+
+    if (m_latency.GetCount()) {
+        g_Log(logLevelInfo, "VAAPI :: Frame in to packet out latency p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms",
+              m_latency.GetPercentile(0.5) / 1000.0, m_latency.GetPercentile(0.9) / 1000.0,
+              m_latency.GetPercentile(0.99) / 1000.0, m_latency.GetMax() / 1000.0);
+    }
+    if (m_lateFrames) {
+        g_Log(logLevelWarn, "VAAPI :: Low latency: %llu frames had no packet when their DoProcess returned",
+              static_cast<unsigned long long>(m_lateFrames));
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    g_Log(logLevelInfo, "VAAPI :: %ld minor / %ld major page faults during render",
+          usage.ru_minflt - m_openUsage.ru_minflt, usage.ru_majflt - m_openUsage.ru_majflt);
+
+    if (m_engineUsage.HasSamples()) {
+        g_Log(logLevelInfo, "VAAPI :: Encode engine busy %.1f%% average, %.1f%% peak (%s)",
+              m_engineUsage.GetAverage() * 100.0, m_engineUsage.GetPeak() * 100.0, m_engineUsage.GetSourceName());
+    }
+}
+
+void VAAPIEncoder::ReportError(int err, int line)
+{
+    VAAPI_PROBE2(error, err, line);
+    m_metrics->errors.fetch_add(1, std::memory_order_relaxed);
 }
 
 void VAAPIEncoder::DoFlush()
@@ -797,15 +1663,18 @@ void VAAPIEncoder::DoFlush()
 
 StatusCode VAAPIEncoder::ReceiveData()
 {
-    AVPacket *pkt = av_packet_alloc();
-    if (!pkt)
+    AVPacketPtr packet(av_packet_alloc());
+    if (!packet)
         return errFail;
 
+    AVPacket *pkt = packet.get();
+
     bool haveOutput = false;
     StatusCode status = errNone;
 
     while (true) {
-        int err = avcodec_receive_packet(m_codec, pkt);
+        TraceScope traceReceive(m_tracer, "ReceivePacket");
+        int err = avcodec_receive_packet(m_codec.get(), pkt);
         if (err) {
             if (err == AVERROR(EAGAIN)) {
                 status = haveOutput ? errNone : errMoreData;
@@ -813,48 +1682,126 @@ StatusCode VAAPIEncoder::ReceiveData()
                 status = errNone;
             } else {
                 g_Log(logLevelError, "VAAPI :: Failed to receive packet %d", err);
+                ReportError(err, __LINE__);
                 status = errFail;
             }
             break;
         }
 
-        HostBufferRef outBuf;
-        if (!outBuf.IsValid() || !outBuf.Resize(pkt->size))
-            return errAlloc;
+        m_metrics->inFlight.fetch_sub(1, std::memory_order_relaxed);
+        traceReceive.SetPTS(pkt->pts);
+        traceReceive.Next("SendOutput");
+        VAAPI_PROBE4(packet_received, pkt->pts, pkt->dts, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+
+        if (m_pass < m_passCount) {
+            m_passStats.Append(pkt->pts, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+            av_packet_unref(pkt);
+            continue;
+        }
+
+        // libavcodec derives DTS from earlier input timestamps when reordering,
+        // rising and never past PTS. Anything else would make an invalid
+        // sample, so it fails the render rather than being patched up.
+        int64_t dts = m_bFrames && pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+        PacketOrder::Result order = m_packetOrder.Check(pkt->pts, dts);
+        if (order != PacketOrder::orderOk) {
+            g_Log(logLevelError, "VAAPI :: Packet with PTS %lld and DTS %lld out of order: %s (previous DTS %lld)",
+                  static_cast<long long>(pkt->pts), static_cast<long long>(dts), PacketOrder::Describe(order),
+                  static_cast<long long>(m_packetOrder.GetLastDts()));
+            ReportError(errFail, __LINE__);
+            return errFail;
+        }
 
         uint8_t isKeyFrame = pkt->flags & AV_PKT_FLAG_KEY;
+        bool injectConfig = !m_sentFirstPacket && isKeyFrame && !m_configExtradata.empty();
+        // MP4 samples can't carry the AV1 temporal delimiters. Our fragmented
+        // MP4 strips them while it copies the samples anyway, only the host's
+        // MP4 needs it done here. The checksums cover the samples without them
+        // whichever MP4 writes them.
+        size_t sampleOffset = m_isMp4 ? m_traits.mp4PayloadOffset(pkt->data, pkt->size) : 0;
+        size_t payloadOffset = m_isHostMp4 ? sampleOffset : 0;
+
+        // Packets that were encoded straight into one of our host buffers go
+        // out as is, shrunk to the payload. HostResizeKeepsData() made sure
+        // that keeps the bytes libavcodec wrote.
+        const uint8_t *payload = pkt->data + payloadOffset;
+        size_t payloadSize = pkt->size - payloadOffset;
+        if (m_checksums)
+            m_checksums->Push(pkt->data + sampleOffset, pkt->size - sampleOffset, pkt->pts, isKeyFrame);
+
+        OutputBuffer *output = injectConfig ? nullptr : FindOutputBuffer(pkt);
+        std::optional<HostBufferRef> copyBuf;
+        HostBufferRef *outBuf = nullptr;
+
+        if (output) {
+            // The host buffer can't start later, so the payload moves up in
+            // place rather than into a new buffer. That's a couple of bytes
+            // of AV1 temporal delimiter, a few microseconds per packet.
+            if (payloadOffset)
+                memmove(pkt->data, payload, payloadSize);
+            output->buffer.UnlockBuffer();
+            output->locked = false;
+            if (!output->buffer.Resize(payloadSize))
+                return errAlloc;
+            outBuf = &output->buffer;
+        } else {
+            copyBuf.emplace();
+            outBuf = &*copyBuf;
+            if (!outBuf->IsValid() || !outBuf->Resize(payloadSize))
+                return errAlloc;
 
-        char *buf = nullptr;
-        size_t bufSize = 0;
-        if (!m_sentFirstPacket && isKeyFrame && !m_configExtradata.empty() && m_containerFormat == "mp4") {
-            size_t totalSize = m_configExtradata.size() + pkt->size;
-            if (!outBuf.Resize(totalSize)) return errAlloc;
+            char *buf = nullptr;
+            size_t bufSize = 0;
+            if (injectConfig) {
+                size_t totalSize = m_configExtradata.size() + payloadSize;
+                if (!outBuf->Resize(totalSize)) return errAlloc;
 
-            if (!outBuf.LockBuffer(&buf, &bufSize)) return errAlloc;
+                if (!outBuf->LockBuffer(&buf, &bufSize)) return errAlloc;
 
-            memcpy(buf, m_configExtradata.data(), m_configExtradata.size());
-            memcpy(buf + m_configExtradata.size(), pkt->data, pkt->size);
+                memcpy(buf, m_configExtradata.data(), m_configExtradata.size());
+                memcpy(buf + m_configExtradata.size(), payload, payloadSize);
 
-            m_sentFirstPacket = true;
-            g_Log(logLevelInfo, "VAAPI :: Injected extradata into first keyframe");
-        } else {
-            if (!outBuf.LockBuffer(&buf, &bufSize)) return errAlloc;
-            memcpy(buf, pkt->data, pkt->size);
+                m_sentFirstPacket = true;
+                g_Log(logLevelInfo, "VAAPI :: Injected extradata into first keyframe");
+            } else {
+                if (!outBuf->LockBuffer(&buf, &bufSize)) return errAlloc;
+                memcpy(buf, payload, payloadSize);
+            }
+            outBuf->UnlockBuffer();
         }
 
-        outBuf.SetProperty(pIOPropPTS, propTypeInt64, &pkt->pts, 1);
-        outBuf.SetProperty(pIOPropDTS, propTypeInt64, &pkt->dts, 1);
-        outBuf.SetProperty(pIOPropIsKeyFrame, propTypeUInt8, &isKeyFrame, 1);
+        if (m_frameStats)
+            PushFrameStats(pkt, dts);
+
+        outBuf->SetProperty(pIOPropPTS, propTypeInt64, &pkt->pts, 1);
+        outBuf->SetProperty(pIOPropDTS, propTypeInt64, &dts, 1);
+        outBuf->SetProperty(pIOPropIsKeyFrame, propTypeUInt8, &isKeyFrame, 1);
+
+        int64_t sentPts = pkt->pts;
+        int sentSize = pkt->size;
 
+        uint64_t sendStart = NowNs();
+        status = m_pCallback->SendOutput(outBuf);
+        uint64_t sendTime = NowNs() - sendStart;
+
+        // Releases our reference to an output buffer, whatever the host kept
+        // it holds its own reference to.
         av_packet_unref(pkt);
+        VAAPI_PROBE3(packet_sent, sentPts, sentSize, sendTime);
+
+        uint64_t inputTime = 0;
+        if (m_inputTimes.Get(sentPts, inputTime))
+            m_latency.Add((NowNs() - inputTime) / 1000);
 
-        status = m_pCallback->SendOutput(&outBuf);
+        m_metrics->outputNs.fetch_add(sendTime, std::memory_order_relaxed);
+        m_metrics->packetsOut.fetch_add(1, std::memory_order_relaxed);
+        m_metrics->bytesOut.fetch_add(sentSize, std::memory_order_relaxed);
+        if (isKeyFrame)
+            m_metrics->keyframes.fetch_add(1, std::memory_order_relaxed);
         if (status != errNone)
             break;
         haveOutput = true;
     }
 
-    av_packet_free(&pkt);
-
     return status;
 }
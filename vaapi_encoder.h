@@ -1,7 +1,22 @@
 #pragma once
 
+#include <deque>
 #include <memory>
+#include <vector>
 
+#include <sys/resource.h>
+
+#include "av_ptr.h"
+#include "codec_traits.h"
+#include "frame_stats.h"
+#include "gpu_usage.h"
+#include "lookahead.h"
+#include "packet_order.h"
+#include "pass_stats.h"
+#include "stream_checksum.h"
+#include "timeline_markers.h"
+#include "trace.h"
+#include "vaapi_caps.h"
 #include "wrapper/plugin_api.h"
 
 extern "C" {
@@ -11,7 +26,10 @@ extern "C" {
 
 using namespace IOPlugin;
 
+class CheckpointJournal;
+class KeyframeIndexWriter;
 class UISettingsController;
+struct EncoderMetrics;
 
 class VAAPIEncoder : public IPluginCodecRef
 {
@@ -26,25 +44,89 @@ public:
     static StatusCode GetEncoderSettings(uint8_t *uuid, HostPropertyCollectionRef *p_pValues, HostListRef *p_pSettingsList);
 
 private:
-    explicit VAAPIEncoder(const char *name, uint32_t depth);
+    explicit VAAPIEncoder(const CodecTraits &traits);
     StatusCode DoInit(HostPropertyCollectionRef *p_pProps) override;
     StatusCode DoOpen(HostBufferRef *p_pBuff) override;
     StatusCode DoProcess(HostBufferRef *p_pBuff) override;
     void DoFlush() override;
     StatusCode ReceiveData();
+    // Opens m_codec with the user's rate control, or CQP at fixedQP when it's >= 0.
+    StatusCode OpenCodec(int fixedQP);
+    bool StartSecondPass();
+    bool AttachQPOffset(AVFrame *frame, int offset);
+    StatusCode SubmitFrame(AVFrame *frame, int qpOffset);
+    StatusCode SubmitLookaheadFrames(bool drain);
+
+    // A host buffer libavcodec encodes a packet into, so it needs no extra
+    // copy. It belongs to the packet's AVBufferRef. Each packet gets its own,
+    // the host may keep the one it was sent.
+    struct OutputBuffer
+    {
+        VAAPIEncoder *encoder;
+        HostBufferRef buffer{ true };
+        bool locked = false;
+    };
 
-    const char *m_name;
-    uint32_t m_depth;
+    static int GetEncodeBuffer(AVCodecContext *ctx, AVPacket *pkt, int flags);
+    static void FreeOutputBuffer(void *opaque, uint8_t *data);
+    static bool HostResizeKeepsData();
+    OutputBuffer *FindOutputBuffer(const AVPacket *pkt);
+    void PushFrameStats(const AVPacket *pkt, int64_t dts);
+    void LogSummary();
+    void ReportError(int err, int line);
+
+    const CodecTraits &m_traits;
+    Tracer m_tracer;
 
     enum AVPixelFormat m_format = AV_PIX_FMT_NONE;
-    AVBufferRef *m_hwdev = nullptr;
-    AVCodecContext *m_codec = nullptr;
-    AVBufferRef *m_hwframes = nullptr;
+    AVBufferRefPtr m_hwdev;
+    AVCodecContextPtr m_codec;
+    AVBufferRefPtr m_hwframes;
 
     int m_ColorModel;
     std::unique_ptr<UISettingsController> m_pSettings;
     HostCodecConfigCommon m_CommonProps;
+    int16_t m_primaries = 0;
+    int16_t m_trc = 0;
+    int16_t m_matrix = 0;
     std::vector<uint8_t> m_configExtradata;
     bool m_sentFirstPacket = false;
-    std::string m_containerFormat;
+    bool m_isMp4 = false;
+    bool m_isHostMp4 = false;
+    int m_segmentGop = 0; // frames per CMAF segment, 0 when not segmenting
+    std::shared_ptr<CheckpointJournal> m_journal;
+    std::shared_ptr<KeyframeIndexWriter> m_index;
+    int64_t m_resumePts = AV_NOPTS_VALUE;
+    bool m_lowPower = false; // caps came from VAEntrypointEncSliceLP
+    uint32_t m_bFrames = 0;
+    int32_t m_rateControl = 0;
+    VAAPICaps::Layout m_layout = { 1, 1, 1 };
+    PacketOrder m_packetOrder;
+    std::shared_ptr<EncoderMetrics> m_metrics;
+    PtsClock m_submitTimes;
+    PtsClock m_inputTimes;
+    PtsTable<int16_t> m_frameQPs;
+    int m_codecQP = -1; // constant QP m_codec was opened with
+    int64_t m_statsMaxPts = AV_NOPTS_VALUE;
+    LatencyHistogram m_latency;
+    uint64_t m_lateFrames = 0;
+    std::unique_ptr<FrameStatsWriter> m_frameStats;
+    std::unique_ptr<StreamChecksumWriter> m_checksums;
+    TimelineMarkers m_markers;
+    bool m_markerKeyframes = false;
+    int64_t m_endPts = 0;
+    EngineUsageSampler m_engineUsage;
+    uint64_t m_openTime = 0;
+    struct rusage m_openUsage = {};
+    std::vector<OutputBuffer *> m_outputBuffers; // held by packets
+    std::unique_ptr<Lookahead> m_lookahead;
+    std::deque<AVFramePtr> m_lookaheadFrames;
+    bool m_lookaheadQP = false; // lookahead offsets reach the driver
+
+    // Two-pass state. The first pass only fills m_passStats, nothing is sent to the host.
+    uint32_t m_passCount = 1;
+    uint32_t m_pass = 1;
+    bool m_passFlushed = false;
+    int m_passQP = 0;
+    PassStatsFile m_passStats;
 };